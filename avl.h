@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+// intrusive AVL tree node, should be embedded into the payload.
+// Each node also counts its subtree, for rank queries in O(log n).
+struct AVLNode {
+    AVLNode *parent = NULL;
+    AVLNode *left = NULL;
+    AVLNode *right = NULL;
+    uint32_t height = 0;    // subtree height
+    uint32_t cnt = 0;       // subtree size
+};
+
+inline void avl_init(AVLNode *node) {
+    node->left = node->right = node->parent = NULL;
+    node->height = 1;
+    node->cnt = 1;
+}
+
+// helpers
+inline uint32_t avl_height(AVLNode *node) { return node ? node->height : 0; }
+inline uint32_t avl_cnt(AVLNode *node) { return node ? node->cnt : 0; }
+
+// fix the tree after an insertion, returns the new root
+AVLNode *avl_fix(AVLNode *node);
+// detach a node, returns the new root
+AVLNode *avl_del(AVLNode *node);
+// the node `offset` positions away in the sorted order, NULL if out of range
+AVLNode *avl_offset(AVLNode *node, int64_t offset);
+// the position of the node in the sorted order, from 0
+int64_t  avl_rank(AVLNode *node);
@@ -0,0 +1,568 @@
+// Microbenchmarks of the hashtable and of the request/response codec,
+// without the network. The results are one JSON document on stdout, the
+// progress is on stderr.
+//
+//   micro_bench [--sizes 1000,100000,...] [--runs N] [--filter SUBSTR]
+//
+// Build like the server, plus -DHM_SWISS for the other engine. The codec
+// is static in server_epoll.cpp, so that file is compiled in here with its
+// `main()` renamed.
+
+#define main server_main
+#include "../server_epoll.cpp"
+#undef main
+
+
+// a node keyed by an integer, hashed like a key of 8 bytes
+struct BenchNode {
+    HNode node;
+    uint64_t key = 0;
+};
+
+struct BenchKey {
+    uint64_t key;
+    uint64_t hcode;
+};
+
+static BenchKey bench_key(uint64_t id) {
+    uint8_t bytes[8];
+    memcpy(bytes, &id, 8);
+    return BenchKey{id, str_hash(bytes, 8)};
+}
+
+static HNode *bench_find(HMap &map, const BenchKey &k) {
+    return hm_find(&map, k.hcode, [&](HNode *node) {
+        return container_of(node, BenchNode, node)->key == k.key;
+    });
+}
+
+static HNode *bench_remove(HMap &map, const BenchKey &k) {
+    return hm_remove(&map, k.hcode, [&](HNode *node) {
+        return container_of(node, BenchNode, node)->key == k.key;
+    });
+}
+
+// splitmix64, fixed seeds so that runs are comparable
+static uint64_t bench_rand(uint64_t &s) {
+    uint64_t z = (s += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+static void bench_shuffle(std::vector<BenchKey> &keys, uint64_t seed) {
+    for (size_t i = keys.size(); i > 1; i--) {
+        std::swap(keys[i - 1], keys[bench_rand(seed) % i]);
+    }
+}
+
+// the compiler must not drop the work whose result is unused
+static uint64_t g_bench_sink = 0;
+
+static void bench_use(uint64_t v) {
+    asm volatile("" : : "r"(v) : "memory");
+    g_bench_sink += v;
+}
+
+// Evict the caches between batches of cold lookups by streaming over a
+// buffer of twice the last level cache, within [64MB, 512MB].
+const size_t k_evict_min = 64 << 20;
+const size_t k_evict_max = 512 << 20;
+static std::vector<uint8_t> g_bench_evict;
+
+static void bench_evict() {
+    if (g_bench_evict.empty()) {
+        long llc = sysconf(_SC_LEVEL3_CACHE_SIZE);
+        size_t n = llc > 0 ? 2 * (size_t)llc : k_evict_min;
+        n = n < k_evict_min ? k_evict_min : (n > k_evict_max ? k_evict_max : n);
+        g_bench_evict.assign(n, 1);
+    }
+    uint64_t sum = 0;
+    for (size_t i = 0; i < g_bench_evict.size(); i += 64) {
+        g_bench_evict[i]++;
+        sum += g_bench_evict[i];
+    }
+    bench_use(sum);
+}
+
+// One result: the time per operation of each run, reported as the median
+// and the best. Latency benchmarks also give their percentiles.
+struct BenchResult {
+    std::string name;
+    uint64_t keys = 0;      // 0 for the codec
+    uint64_t ops = 0;       // per run
+    uint64_t bytes = 0;     // per run, for the codec
+    std::vector<double> ns_per_op;
+    HistSum hist;
+    uint64_t max_ns = 0;
+    uint64_t rehash_ops = 0;    // ops that ran with 2 tables live
+};
+
+static std::vector<BenchResult> g_results;
+static const char *g_bench_filter = NULL;
+static size_t g_bench_runs = 3;
+
+static bool bench_wanted(const char *name) {
+    return !g_bench_filter || strstr(name, g_bench_filter);
+}
+
+static double bench_median(std::vector<double> v) {
+    std::sort(v.begin(), v.end());
+    return v.empty() ? 0 : v[v.size() / 2];
+}
+
+static void bench_report(BenchResult &r) {
+    fprintf(stderr, "%-24s keys=%-10llu %8.1f ns/op\n", r.name.c_str(),
+        (unsigned long long)r.keys, bench_median(r.ns_per_op));
+    g_results.push_back(std::move(r));
+}
+
+// a map of the keys [0, n), nodes in one array
+struct BenchMap {
+    HMap map;
+    std::vector<BenchNode> nodes;
+};
+
+static void bench_fill(BenchMap &m, const std::vector<BenchKey> &keys) {
+    m.nodes.resize(keys.size());
+    for (size_t i = 0; i < keys.size(); i++) {
+        BenchNode &n = m.nodes[i];
+        n.key = keys[i].key;
+        n.node.hcode = keys[i].hcode;
+        hm_insert(&m.map, &n.node);
+    }
+}
+
+// finish a resize in progress, so that a lookup sees 1 table
+static void bench_settle(BenchMap &m) {
+    while (hm_rehashing(&m.map)) {
+        hm_migrate(&m.map, 1 << 20);
+    }
+}
+
+static std::vector<BenchKey> bench_keys(uint64_t lo, uint64_t hi) {
+    std::vector<BenchKey> keys(hi - lo);
+    for (uint64_t i = lo; i < hi; i++) {
+        keys[i - lo] = bench_key(i);
+    }
+    return keys;
+}
+
+// `hm_insert()` from empty to n keys, through all the resizes
+static void bench_insert(uint64_t n) {
+    BenchResult r;
+    r.name = "hm_insert";
+    r.keys = n;
+    r.ops = n;
+    std::vector<BenchKey> keys = bench_keys(0, n);
+    bench_shuffle(keys, 1);
+    for (size_t run = 0; run < g_bench_runs; run++) {
+        BenchMap m;
+        m.nodes.resize(n);
+        uint64_t t0 = get_monotonic_nsec();
+        for (size_t i = 0; i < n; i++) {
+            BenchNode &node = m.nodes[i];
+            node.key = keys[i].key;
+            node.node.hcode = keys[i].hcode;
+            hm_insert(&m.map, &node.node);
+        }
+        uint64_t t1 = get_monotonic_nsec();
+        r.ns_per_op.push_back((double)(t1 - t0) / (double)n);
+        hm_clear(&m.map);
+    }
+    bench_report(r);
+}
+
+// `probes` lookups of `keys` in order, in batches, with the caches
+// evicted before each batch if `cold`
+static double bench_lookups(BenchMap &m, const std::vector<BenchKey> &keys,
+    size_t probes, bool cold, bool hit)
+{
+    const size_t k_batch = 256;
+    uint64_t ns = 0;
+    uint64_t found = 0;
+    for (size_t done = 0; done < probes; done += k_batch) {
+        if (cold) {
+            bench_evict();
+        }
+        size_t end = done + k_batch < probes ? done + k_batch : probes;
+        uint64_t t0 = get_monotonic_nsec();
+        for (size_t i = done; i < end; i++) {
+            found += bench_find(m.map, keys[i % keys.size()]) != NULL;
+        }
+        ns += get_monotonic_nsec() - t0;
+    }
+    if (found != (hit ? probes : 0)) {
+        die("lookup: wrong result");
+    }
+    bench_use(found);
+    return (double)ns / (double)probes;
+}
+
+// `hm_lookup()`: hits in a working set of 1K keys that stays cached, hits
+// over all keys with the caches evicted, and misses over all slots
+static void bench_lookup(uint64_t n) {
+    if (!bench_wanted("hm_lookup_hit_hot") && !bench_wanted("hm_lookup_hit_cold")
+        && !bench_wanted("hm_lookup_miss"))
+    {
+        return;
+    }
+    BenchMap m;
+    std::vector<BenchKey> keys = bench_keys(0, n);
+    bench_fill(m, keys);
+    bench_settle(m);
+    const size_t k_probes = 1 << 20;
+    const size_t k_cold_probes = 1 << 12;   // the evictions take most of the time
+    struct Case {
+        const char *name;
+        bool cold;
+        bool hit;
+    };
+    const Case cases[] = {
+        {"hm_lookup_hit_hot", false, true},
+        {"hm_lookup_hit_cold", true, true},
+        {"hm_lookup_miss", false, false},
+    };
+    for (const Case &c : cases) {
+        if (!bench_wanted(c.name)) {
+            continue;
+        }
+        std::vector<BenchKey> probe;
+        if (!c.hit) {
+            probe = bench_keys(n, n + (n < k_probes ? n : k_probes));
+        } else if (c.cold) {
+            probe = keys;
+        } else {
+            probe.assign(keys.begin(), keys.begin() + (n < 1024 ? n : 1024));
+        }
+        bench_shuffle(probe, 2);
+        BenchResult r;
+        r.name = c.name;
+        r.keys = n;
+        r.ops = c.cold ? k_cold_probes : k_probes;
+        for (size_t run = 0; run < g_bench_runs; run++) {
+            r.ns_per_op.push_back(bench_lookups(m, probe, r.ops, c.cold, c.hit));
+        }
+        bench_report(r);
+    }
+    hm_clear(&m.map);
+}
+
+// `hm_delete()` of all keys in random order, through the shrinking
+static void bench_delete(uint64_t n) {
+    BenchResult r;
+    r.name = "hm_delete";
+    r.keys = n;
+    r.ops = n;
+    std::vector<BenchKey> keys = bench_keys(0, n);
+    for (size_t run = 0; run < g_bench_runs; run++) {
+        BenchMap m;
+        bench_fill(m, keys);
+        bench_settle(m);
+        std::vector<BenchKey> order = keys;
+        bench_shuffle(order, 3 + run);
+        uint64_t t0 = get_monotonic_nsec();
+        for (const BenchKey &k : order) {
+            bench_use((uint64_t)(uintptr_t)bench_remove(m.map, k));
+        }
+        uint64_t t1 = get_monotonic_nsec();
+        if (hm_size(&m.map) != 0) {
+            die("delete: keys left");
+        }
+        r.ns_per_op.push_back((double)(t1 - t0) / (double)n);
+        hm_clear(&m.map);
+    }
+    bench_report(r);
+}
+
+// The latency of each insert from n keys until the next resize is done,
+// which is where the progressive rehashing shows: a spike there means
+// too much work per operation. Each insert is timed on its own, so the
+// numbers include the clock, about 20ns.
+static void bench_rehash(uint64_t n) {
+    BenchResult r;
+    r.name = "hm_insert_rehash";
+    r.keys = n;
+    std::vector<BenchKey> keys = bench_keys(0, n);
+    for (size_t run = 0; run < g_bench_runs; run++) {
+        BenchMap m;
+        bench_fill(m, keys);
+        bench_settle(m);
+        Hist *hist = new Hist();
+        std::vector<BenchNode> more;
+        more.reserve(4 * n + 1024);     // no reallocation, the map points into it
+        bool started = false;
+        uint64_t ns = 0, ops = 0, rehash_ops = 0;
+        for (uint64_t id = n; more.size() < more.capacity(); id++) {
+            BenchKey k = bench_key(id);
+            more.emplace_back();
+            BenchNode &node = more.back();
+            node.key = k.key;
+            node.node.hcode = k.hcode;
+            uint64_t t0 = get_monotonic_nsec();
+            hm_insert(&m.map, &node.node);
+            uint64_t dt = get_monotonic_nsec() - t0;
+            hist_add(*hist, dt);
+            r.max_ns = dt > r.max_ns ? dt : r.max_ns;
+            ns += dt;
+            ops++;
+            bool rehashing = hm_rehashing(&m.map);
+            rehash_ops += rehashing;
+            if (started && !rehashing) {
+                break;  // a whole resize is in
+            }
+            started = started || rehashing;
+        }
+        hist_merge(r.hist, *hist);
+        delete hist;
+        r.ops = ops;
+        r.rehash_ops = rehash_ops;
+        r.ns_per_op.push_back((double)ns / (double)ops);
+        hm_clear(&m.map);
+    }
+    bench_report(r);
+}
+
+// requests in the binary format, back to back like a pipeline
+static void bench_frames(Buffer &buf, size_t n, size_t nkeys) {
+    std::string value(16, 'x');
+    std::vector<std::string> names;
+    std::vector<std::string_view> args;
+    for (size_t i = 0; i < n; i++) {
+        names.clear();
+        args.clear();
+        names.push_back(nkeys > 1 ? "mget" : (i % 2 ? "get" : "set"));
+        for (size_t k = 0; k < nkeys; k++) {
+            names.push_back("key:" + std::to_string(i * nkeys + k));
+        }
+        if (names[0] == "set") {
+            names.push_back(value);
+        }
+        for (const std::string &s : names) {
+            args.push_back(s);
+        }
+        frame_append(buf, args.data(), args.size());
+    }
+}
+
+// the same requests in RESP
+static void bench_resp_frames(std::string &out, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        std::string key = "key:" + std::to_string(i);
+        if (i % 2) {
+            out += "*2\r\n$3\r\nget\r\n$" + std::to_string(key.size()) + "\r\n" + key + "\r\n";
+        } else {
+            out += "*3\r\n$3\r\nset\r\n$" + std::to_string(key.size()) + "\r\n" + key
+                + "\r\n$16\r\nxxxxxxxxxxxxxxxx\r\n";
+        }
+    }
+}
+
+static void bench_codec_result(const char *name, uint64_t ops, uint64_t bytes,
+    const std::vector<double> &ns)
+{
+    BenchResult r;
+    r.name = name;
+    r.ops = ops;
+    r.bytes = bytes;
+    r.ns_per_op = ns;
+    bench_report(r);
+}
+
+// `parse_req()` over a pipeline of get/set, and of 16-key mget
+static void bench_parse() {
+    const size_t k_reqs = 1 << 18;
+    std::vector<std::string_view> cmd;
+    for (size_t nkeys : {(size_t)1, (size_t)16}) {
+        const char *name = nkeys > 1 ? "parse_req_mget16" : "parse_req";
+        if (!bench_wanted(name)) {
+            continue;
+        }
+        Buffer buf;
+        bench_frames(buf, k_reqs, nkeys);
+        std::vector<double> ns;
+        for (size_t run = 0; run < g_bench_runs; run++) {
+            const uint8_t *cur = buf_data(buf);
+            const uint8_t *end = cur + buf_size(buf);
+            uint64_t args = 0;
+            uint64_t t0 = get_monotonic_nsec();
+            while (cur < end) {
+                uint32_t len = 0;
+                memcpy(&len, cur, 4);
+                if (parse_req(cur + 4, len, cmd) < 0) {
+                    die("parse_req: invalid");
+                }
+                args += cmd.size();
+                cur += 4 + len;
+            }
+            ns.push_back((double)(get_monotonic_nsec() - t0) / (double)k_reqs);
+            bench_use(args);
+        }
+        bench_codec_result(name, k_reqs, buf_size(buf), ns);
+    }
+}
+
+// `resp_parse()` over the same pipeline in RESP
+static void bench_parse_resp() {
+    if (!bench_wanted("resp_parse")) {
+        return;
+    }
+    const size_t k_reqs = 1 << 18;
+    std::string data;
+    bench_resp_frames(data, k_reqs);
+    RespParser p;
+    std::vector<double> ns;
+    for (size_t run = 0; run < g_bench_runs; run++) {
+        const uint8_t *cur = (const uint8_t *)data.data();
+        size_t left = data.size();
+        uint64_t args = 0;
+        uint64_t t0 = get_monotonic_nsec();
+        while (left > 0) {
+            resp_reset(p);
+            if (resp_parse(p, cur, left, k_max_args, k_max_msg) != RESP_DONE) {
+                die("resp_parse: invalid");
+            }
+            args += p.args.size();
+            cur += p.pos;
+            left -= p.pos;
+        }
+        ns.push_back((double)(get_monotonic_nsec() - t0) / (double)k_reqs);
+        bench_use(args);
+    }
+    bench_codec_result("resp_parse", k_reqs, data.size(), ns);
+}
+
+// a `get` reply with a 16-byte value, and a 16-key `mget`, serialized into
+// an output buffer in each protocol
+static void bench_response() {
+    const size_t k_reps = 1 << 20;
+    std::string value(16, 'x');
+    struct Case {
+        const char *name;
+        uint8_t proto;
+        uint32_t nvals;     // 0 for a get
+    };
+    const Case cases[] = {
+        {"response_get", PROTO_BINARY, 0},
+        {"response_get_resp", PROTO_RESP2, 0},
+        {"response_mget16", PROTO_BINARY, 16},
+        {"response_mget16_resp", PROTO_RESP2, 16},
+    };
+    for (const Case &c : cases) {
+        if (!bench_wanted(c.name)) {
+            continue;
+        }
+        Buffer buf;
+        std::vector<double> ns;
+        uint64_t bytes = 0;
+        for (size_t run = 0; run < g_bench_runs; run++) {
+            bytes = 0;
+            uint64_t t0 = get_monotonic_nsec();
+            for (size_t i = 0; i < k_reps; i++) {
+                Response out;
+                response_begin(out, buf, c.proto);
+                if (c.nvals == 0) {
+                    out_val(out, value, NULL);
+                } else {
+                    out_arr(out, c.nvals);
+                    for (uint32_t k = 0; k < c.nvals; k++) {
+                        out_bulk(out, value, NULL);
+                    }
+                }
+                response_end(out);
+                if (buf_size(buf) >= (1 << 20)) {
+                    bytes += buf_size(buf);
+                    buf_clear(buf);     // as if sent
+                }
+            }
+            bytes += buf_size(buf);
+            buf_clear(buf);
+            ns.push_back((double)(get_monotonic_nsec() - t0) / (double)k_reps);
+        }
+        bench_codec_result(c.name, k_reps, bytes, ns);
+    }
+}
+
+// the buckets are reported by their upper bound, which may pass the max
+static uint64_t bench_quantile(const BenchResult &r, double q) {
+    uint64_t v = hist_quantile(r.hist, q);
+    return v < r.max_ns ? v : r.max_ns;
+}
+
+static void json_result(FILE *fp, const BenchResult &r, bool last) {
+    double med = bench_median(r.ns_per_op);
+    double best = *std::min_element(r.ns_per_op.begin(), r.ns_per_op.end());
+    fprintf(fp, "    {\"name\": \"%s\", \"keys\": %llu, \"ops\": %llu, "
+        "\"ns_per_op\": %.2f, \"ns_per_op_min\": %.2f, \"mops\": %.3f",
+        r.name.c_str(), (unsigned long long)r.keys, (unsigned long long)r.ops,
+        med, best, med > 0 ? 1e3 / med : 0);
+    if (r.bytes) {
+        fprintf(fp, ", \"mb_per_sec\": %.1f",
+            med > 0 ? (double)r.bytes / ((double)r.ops * med) * 1e3 : 0);
+    }
+    if (r.hist.total) {
+        fprintf(fp, ", \"rehash_ops\": %llu, \"p50_ns\": %llu, \"p99_ns\": %llu, "
+            "\"p999_ns\": %llu, \"max_ns\": %llu",
+            (unsigned long long)(r.rehash_ops / g_bench_runs),
+            (unsigned long long)bench_quantile(r, 0.5),
+            (unsigned long long)bench_quantile(r, 0.99),
+            (unsigned long long)bench_quantile(r, 0.999),
+            (unsigned long long)r.max_ns);
+    }
+    fprintf(fp, "}%s\n", last ? "" : ",");
+}
+
+int main(int argc, char **argv) {
+    std::vector<uint64_t> sizes = {1000, 10000, 100000, 1000000, 10000000};
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--sizes") && i + 1 < argc) {
+            sizes.clear();
+            for (char *s = argv[++i]; *s; ) {
+                char *end = NULL;
+                sizes.push_back(strtoull(s, &end, 10));
+                if (end == s || sizes.back() == 0 || (*end && *end != ',')) {
+                    fprintf(stderr, "bad --sizes\n");
+                    return 1;
+                }
+                s = *end ? end + 1 : end;
+            }
+        } else if (!strcmp(argv[i], "--runs") && i + 1 < argc) {
+            g_bench_runs = (size_t)atoi(argv[++i]);
+            g_bench_runs = g_bench_runs ? g_bench_runs : 1;
+        } else if (!strcmp(argv[i], "--filter") && i + 1 < argc) {
+            g_bench_filter = argv[++i];
+        } else {
+            fprintf(stderr, "usage: %s [--sizes N,N,...] [--runs N] [--filter SUBSTR]\n",
+                argv[0]);
+            return 1;
+        }
+    }
+    for (uint64_t n : sizes) {
+        if (bench_wanted("hm_insert")) {
+            bench_insert(n);
+        }
+        bench_lookup(n);
+        if (bench_wanted("hm_delete")) {
+            bench_delete(n);
+        }
+        if (bench_wanted("hm_insert_rehash")) {
+            bench_rehash(n);
+        }
+    }
+    bench_parse();
+    bench_parse_resp();
+    bench_response();
+
+#ifdef HM_SWISS
+    const char *engine = "swiss";
+#else
+    const char *engine = "chaining";
+#endif
+    printf("{\n  \"engine\": \"%s\",\n  \"runs\": %zu,\n  \"results\": [\n",
+        engine, g_bench_runs);
+    for (size_t i = 0; i < g_results.size(); i++) {
+        json_result(stdout, g_results[i], i + 1 == g_results.size());
+    }
+    printf("  ]\n}\n");
+    return 0;
+}
@@ -2,16 +2,21 @@ import subprocess
 import time
 import matplotlib.pyplot as plt
 import os
+import shlex
 import signal
 
 # Configuration
 SERVER_CMD = "../server"
+SERVER_THREADS = os.environ.get("SERVER_THREADS", "1")  # e.g. SERVER_THREADS=4
 CLIENT_SRC = "swarm.cpp"
 CLIENT_EXE = "./swarm_bench"
 TOTAL_REQS = 1000000
+# extra client options, e.g. SWARM_ARGS="--threads 4 --ratio 90:10:0 --keys 1000000 --zipf 0.99 --populate"
+SWARM_ARGS = shlex.split(os.environ.get("SWARM_ARGS", ""))
+HIST_DIR = "hist"  # the latency distribution of each run, from --hist-out
 
 concurrency_levels = [1, 10, 50, 100, 200, 500, 800, 1000]
-results = []  # List of (rps, p99) tuples
+results = []  # List of (rps, p50, p99, p999, max) tuples, latencies in ms
 
 def compile_client():
     print("Compiling benchmark client...")
@@ -25,26 +30,30 @@ def compile_client():
     "-DNDEBUG",           # CRITICAL: Removes all assert() checks
     "-fno-exceptions",    # Removes exception handling overhead (if not using try/catch)
     "-fno-rtti",          # Removes runtime type info overhead
-    "-std=c++17"          # Use modern C++ optimizations
+    "-std=c++17",         # Use modern C++ optimizations
+    "-pthread"            # The client runs several epoll threads
 ], check=True)
 
 def run_test(clients):
     print(f"Testing {clients} clients...", end="", flush=True)
     
-    server = subprocess.Popen([SERVER_CMD], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    server = subprocess.Popen([SERVER_CMD, "--threads", SERVER_THREADS], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
     time.sleep(1)  # Increased startup time
 
     try:
-        output = subprocess.check_output([CLIENT_EXE, str(clients), str(TOTAL_REQS)], 
-                                          timeout=60)  # Add timeout
-        rps_str, p99_str = output.decode().strip().split(',')
-        rps = float(rps_str)
-        p99 = float(p99_str)
-        print(f" RPS: {rps:.0f}, P99: {p99:.2f}ms")
-        return (rps, p99)
+        hist_file = os.path.join(HIST_DIR, f"{clients}.txt")
+        output = subprocess.check_output([CLIENT_EXE, "--clients", str(clients),
+                                          "--requests", str(TOTAL_REQS),
+                                          "--hist-out", hist_file] + SWARM_ARGS,
+                                          stderr=subprocess.DEVNULL,
+                                          timeout=120)  # Add timeout
+        rps, p50, p99, p999, lat_max = [float(x) for x in output.decode().strip().split(',')]
+        print(f" RPS: {rps:.0f}, P50: {p50:.3f}ms, P99: {p99:.3f}ms, "
+              f"P99.9: {p999:.3f}ms, Max: {lat_max:.3f}ms")
+        return (rps, p50, p99, p999, lat_max)
     except (subprocess.CalledProcessError, subprocess.TimeoutExpired, ValueError) as e:
         print(f" Failed! ({e})")
-        return (0, 0)
+        return (0, 0, 0, 0, 0)
     finally:
         server.terminate()
         server.wait()
@@ -56,6 +65,7 @@ if __name__ == "__main__":
         exit(1)
 
     compile_client()
+    os.makedirs(HIST_DIR, exist_ok=True)
 
     print(f"\n--- Starting Benchmark (Total Load: {TOTAL_REQS} reqs) ---\n")
     
@@ -65,11 +75,12 @@ if __name__ == "__main__":
 
     # Extract metrics
     rps_values = [r[0] for r in results]
-    p99_values = [r[1] for r in results]
+    latency_lines = [("P50", 1, 'o', 'g'), ("P99", 2, 's', 'r'),
+                     ("P99.9", 3, '^', 'm'), ("Max", 4, 'x', 'k')]
+
+    fig, (ax1, ax2, ax3) = plt.subplots(1, 3, figsize=(22, 6))
 
     # Plot RPS
-    fig, (ax1, ax2) = plt.subplots(1, 2, figsize=(16, 6))
-    
     ax1.plot(concurrency_levels, rps_values, marker='o', linestyle='-', color='b')
     ax1.set_title(f'Throughput vs Concurrency (Total: {TOTAL_REQS} reqs)')
     ax1.set_xlabel('Concurrent Clients')
@@ -81,17 +92,44 @@ if __name__ == "__main__":
             ax1.annotate(f"{y/1000:.0f}k", (x, y), textcoords="offset points", 
                         xytext=(0,10), ha='center', fontsize=8)
 
-    # Plot P99 Latency
-    ax2.plot(concurrency_levels, p99_values, marker='s', linestyle='-', color='r')
-    ax2.set_title('P99 Latency vs Concurrency')
+    # Plot the latency percentiles
+    for label, idx, marker, color in latency_lines:
+        ax2.plot(concurrency_levels, [r[idx] for r in results], marker=marker,
+                 linestyle='-', color=color, label=label)
+    ax2.set_title('Latency vs Concurrency')
     ax2.set_xlabel('Concurrent Clients')
-    ax2.set_ylabel('P99 Latency (ms)')
+    ax2.set_ylabel('Latency (ms)')
     ax2.grid(True)
     ax2.set_xscale('log')
-    for x, y in zip(concurrency_levels, p99_values):
-        if y > 0:
-            ax2.annotate(f"{y:.1f}", (x, y), textcoords="offset points", 
-                        xytext=(0,10), ha='center', fontsize=8)
+    ax2.set_yscale('log')
+    ax2.legend()
+
+    # Plot the latency by percentile of each run, HdrHistogram-style: the
+    # x axis is 1/(1-p), so that the tail gets as much room as the median
+    for c in concurrency_levels:
+        hist_file = os.path.join(HIST_DIR, f"{c}.txt")
+        if not os.path.exists(hist_file):
+            continue
+        xs, ys = [], []
+        with open(hist_file) as f:
+            for line in f:
+                if line.startswith('#'):
+                    continue
+                value, pct, _ = line.split()
+                pct = min(float(pct), 0.999999)
+                xs.append(1 / (1 - pct))
+                ys.append(float(value))
+        ax3.plot(xs, ys, linestyle='-', label=f"{c} clients")
+    ax3.set_title('Latency by Percentile')
+    ax3.set_xlabel('Percentile')
+    ax3.set_ylabel('Latency (ms)')
+    ax3.set_xscale('log')
+    ax3.set_yscale('log')
+    ticks = [2, 10, 100, 1000, 10000, 100000]
+    ax3.set_xticks(ticks)
+    ax3.set_xticklabels(["50%", "90%", "99%", "99.9%", "99.99%", "99.999%"])
+    ax3.grid(True)
+    ax3.legend(fontsize=8)
 
     plt.tight_layout()
     output_file = "benchmark_result.png"
@@ -1,194 +1,843 @@
-#include <iostream>
-#include <vector>
-#include <deque>
-#include <map>
-#include <unistd.h>
+// The benchmark client: many pipelined connections spread over a few epoll
+// threads, sending a mix of get/set/del over a keyspace. Closed-loop, each
+// connection keeps `--pipeline` requests in flight; open-loop (`--rate`),
+// requests start on a fixed schedule whether or not the server keeps up,
+// and their latency is counted from when they were due, so a stall is not
+// hidden by the requests it held back (coordinated omission).
+//
+//   swarm_bench [options] [clients] [requests]
+//
+// prints `rps,p50_ms,p99_ms,p999_ms,max_ms` on stdout, a summary on stderr.
+
+#include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
-#include <sys/poll.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include <errno.h>
-#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+// C++
 #include <algorithm>
-#include <chrono>
+#include <atomic>
+#include <deque>
+#include <thread>
+#include <vector>
+#include "../hist.h"
+
+
+enum { OP_GET = 0, OP_SET = 1, OP_DEL = 2, OP_COUNT = 3 };
+static const char *const k_op_names[OP_COUNT] = {"get", "set", "del"};
+
+// response status, as in the server
+enum { RES_OK = 0, RES_ERR = 1, RES_NX = 2 };
+
+struct Options {
+    const char *host = "127.0.0.1";
+    uint16_t port = 1234;
+    size_t threads = 1;
+    size_t clients = 1;
+    uint64_t requests = 1000000;    // of all connections
+    double duration = 0;            // seconds, instead of `requests`
+    size_t pipeline = 32;           // closed-loop, in flight per connection
+    double rate = 0;                // requests/s of all connections, 0 for closed-loop
+    uint32_t ratio[OP_COUNT] = {0, 1, 0};
+    uint64_t keys = 1;
+    double zipf = 0;                // the exponent, 0 for uniform keys
+    bool populate = false;
+    uint64_t seed = 1;
+    const char *hist_out = NULL;
+};
+
+static Options g_opt;
+
+// value sizes: fixed, uniform in [lo, hi], or picked by weight
+struct SizeDist {
+    uint32_t lo = 5;
+    uint32_t hi = 5;
+    std::vector<uint32_t> sizes;
+    std::vector<uint64_t> cum;      // the running sum of the weights
+};
+
+static SizeDist g_vsize;
+static std::vector<uint8_t> g_value;    // the bytes of the largest value
+
+static void die(const char *msg) {
+    fprintf(stderr, "[%d] %s\n", errno, msg);
+    exit(1);
+}
+
+static uint64_t get_monotonic_nsec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+// splitmix64, one state per thread
+static uint64_t rng_next(uint64_t &s) {
+    uint64_t z = (s += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+// in [0, 1)
+static double rng_unit(uint64_t &s) {
+    return (double)(rng_next(s) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static uint64_t rng_below(uint64_t &s, uint64_t n) {
+    return (uint64_t)(((unsigned __int128)rng_next(s) * n) >> 64);
+}
+
+// Zipf over the ranks [1, n] by rejection-inversion (Hörmann & Derflinger),
+// O(1) per sample with no table, for any exponent > 0.
+struct Zipf {
+    double s = 0;
+    double n = 0;
+    double h_x1 = 0;        // h_integral(1.5) - 1
+    double h_n = 0;         // h_integral(n + 0.5)
+    double s_factor = 0;
+};
+
+static Zipf g_zipf;
+
+// log1p(x) / x, and expm1(x) / x, accurate near 0
+static double zipf_helper1(double x) {
+    return fabs(x) > 1e-8 ? log1p(x) / x : 1 - x * (0.5 - x * (1.0 / 3 - 0.25 * x));
+}
+
+static double zipf_helper2(double x) {
+    return fabs(x) > 1e-8 ? expm1(x) / x : 1 + x * 0.5 * (1 + x / 3 * (1 + 0.25 * x));
+}
+
+static double zipf_h(const Zipf &z, double x) {
+    return exp(-z.s * log(x));
+}
+
+static double zipf_h_integral(const Zipf &z, double x) {
+    double log_x = log(x);
+    return zipf_helper2((1 - z.s) * log_x) * log_x;
+}
+
+static double zipf_h_integral_inv(const Zipf &z, double x) {
+    double t = x * (1 - z.s);
+    t = t < -1 ? -1 : t;
+    return exp(zipf_helper1(t) * x);
+}
+
+static void zipf_init(Zipf &z, double s, uint64_t n) {
+    z.s = s;
+    z.n = (double)n;
+    z.h_x1 = zipf_h_integral(z, 1.5) - 1;
+    z.h_n = zipf_h_integral(z, z.n + 0.5);
+    z.s_factor = 2 - zipf_h_integral_inv(z, zipf_h_integral(z, 2.5) - zipf_h(z, 2));
+}
+
+static uint64_t zipf_sample(const Zipf &z, uint64_t &rng) {
+    while (true) {
+        double u = z.h_n + rng_unit(rng) * (z.h_x1 - z.h_n);
+        double x = zipf_h_integral_inv(z, u);
+        double k = floor(x + 0.5);
+        k = k < 1 ? 1 : (k > z.n ? z.n : k);
+        if (k - x <= z.s_factor || u >= zipf_h_integral(z, k + 0.5) - zipf_h(z, k)) {
+            return (uint64_t)k;
+        }
+    }
+}
 
-enum State { STATE_CONNECTING, STATE_CONNECTED, STATE_DONE };
+// The ranks are scattered over the keyspace by multiplying with a prime,
+// a bijection while the prime doesn't divide it, so the hot keys don't all
+// hash next to each other or land in one shard.
+const uint64_t k_scatter = 2654435761ull;
+
+static uint64_t pick_key(uint64_t &rng) {
+    if (g_opt.keys <= 1) {
+        return 0;
+    }
+    if (g_opt.zipf <= 0) {
+        return rng_below(rng, g_opt.keys);
+    }
+    uint64_t rank = zipf_sample(g_zipf, rng) - 1;
+    if (g_opt.keys % k_scatter == 0) {
+        return rank;
+    }
+    return (uint64_t)(((unsigned __int128)rank * k_scatter) % g_opt.keys);
+}
+
+static uint32_t pick_size(uint64_t &rng) {
+    const SizeDist &d = g_vsize;
+    if (d.sizes.empty()) {
+        return d.lo + (uint32_t)rng_below(rng, (uint64_t)(d.hi - d.lo) + 1);
+    }
+    uint64_t w = rng_below(rng, d.cum.back());
+    size_t i = 0;
+    while (d.cum[i] <= w) {
+        i++;
+    }
+    return d.sizes[i];
+}
+
+static uint32_t pick_op(uint64_t &rng) {
+    const uint32_t *r = g_opt.ratio;
+    uint64_t w = rng_below(rng, (uint64_t)r[0] + r[1] + r[2]);
+    return w < r[0] ? OP_GET : (w < (uint64_t)r[0] + r[1] ? OP_SET : OP_DEL);
+}
+
+static void buf_append_u32(std::vector<uint8_t> &buf, uint32_t v) {
+    uint8_t tmp[4];
+    memcpy(tmp, &v, 4);
+    buf.insert(buf.end(), tmp, tmp + 4);
+}
+
+static void buf_append_arg(std::vector<uint8_t> &buf, const void *data, uint32_t len) {
+    buf_append_u32(buf, len);
+    buf.insert(buf.end(), (const uint8_t *)data, (const uint8_t *)data + len);
+}
+
+// `[len][nargs][len][arg]...`, see the server's Binary Protocol
+static void append_request(std::vector<uint8_t> &buf, uint32_t op, uint64_t key, uint32_t vlen) {
+    char name[32];
+    uint32_t klen = (uint32_t)snprintf(name, sizeof(name), "key:%llu", (unsigned long long)key);
+    uint32_t nargs = op == OP_SET ? 3 : 2;
+    const uint32_t oplen = 3;
+    uint32_t len = 4 + 4 + oplen + 4 + klen + (op == OP_SET ? 4 + vlen : 0);
+    buf_append_u32(buf, len);
+    buf_append_u32(buf, nargs);
+    buf_append_arg(buf, k_op_names[op], oplen);
+    buf_append_arg(buf, name, klen);
+    if (op == OP_SET) {
+        buf_append_arg(buf, g_value.data(), vlen);
+    }
+}
+
+struct Pending {
+    uint64_t start_ns;  // sent, or due in open-loop
+    uint32_t op;
+};
 
 struct Client {
-    int fd;
-    State state = STATE_CONNECTING;
-    int sent_count = 0;
-    int recv_count = 0;
+    int fd = -1;
+    bool done = false;
+    uint32_t events = 0;            // registered with epoll
+    uint64_t sent = 0;
+    uint64_t limit = 0;             // requests to send
+    uint64_t next_ns = 0;           // open-loop, when the next one is due
     std::vector<uint8_t> wbuf;
-    size_t wbuf_sent = 0;
+    size_t wpos = 0;
     std::vector<uint8_t> rbuf;
-    
-    // FIX: Queue to track the start time of every individual inflight request
-    std::deque<std::chrono::steady_clock::time_point> inflight_timestamps;
+    size_t rpos = 0;
+    std::deque<Pending> inflight;
 };
 
+struct Thread {
+    size_t id = 0;
+    int epfd = -1;
+    uint64_t rng = 0;
+    std::vector<Client> clients;
+    std::vector<size_t> order;      // open-loop, see `open_loop_step()`
+    size_t cursor = 0;
+    Hist hist[OP_COUNT];
+    uint64_t max_ns = 0;
+    size_t open = 0;                // connections
+    uint64_t unsent = 0;            // of the connections still open, without `--duration`
+    uint64_t recv = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t errors = 0;            // error responses
+    uint64_t dropped = 0;           // connections lost before the end
+    uint64_t end_ns = 0;            // the last response
+};
+
+static std::atomic<size_t> g_ready{0};
+static std::atomic<bool> g_go{false};
+static uint64_t g_start_ns = 0;
+static uint64_t g_stop_ns = 0;      // no new requests after it, with `--duration`
+static uint64_t g_interval_ns = 0;  // open-loop, between 2 requests of a connection
+
+static int connect_to() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        die("socket()");
+    }
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(g_opt.port);
+    if (inet_pton(AF_INET, g_opt.host, &addr.sin_addr) != 1) {
+        fprintf(stderr, "bad host %s\n", g_opt.host);
+        exit(1);
+    }
+    if (connect(fd, (const struct sockaddr *)&addr, sizeof(addr))) {
+        die("connect()");
+    }
+    int val = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+    return fd;
+}
+
 static void fd_set_nb(int fd) {
     int flags = fcntl(fd, F_GETFL, 0);
-    if (flags == -1) { perror("fcntl get"); exit(1); }
-    if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) { perror("fcntl set"); exit(1); }
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        die("fcntl()");
+    }
 }
 
-// Request generation (unchanged)
-void fill_request(std::vector<uint8_t> &buf) {
-    buf.resize(31);
-    uint32_t len = 27, n = 3, l1 = 3, l2 = 3, l3 = 5;
-    uint8_t *ptr = buf.data();
-    memcpy(ptr, &len, 4); ptr += 4;
-    memcpy(ptr, &n, 4);   ptr += 4;
-    memcpy(ptr, &l1, 4);  memcpy(ptr + 4, "set", 3); ptr += 7;
-    memcpy(ptr, &l2, 4);  memcpy(ptr + 4, "key", 3); ptr += 7;
-    memcpy(ptr, &l3, 4);  memcpy(ptr + 4, "value", 5); ptr += 9; 
+static void write_all(int fd, const uint8_t *data, size_t n) {
+    while (n > 0) {
+        ssize_t rv = write(fd, data, n);
+        if (rv <= 0) {
+            die("write()");
+        }
+        data += rv;
+        n -= (size_t)rv;
+    }
 }
 
-int main(int argc, char **argv) {
-    if (argc < 3) return 1;
-    int k_num_clients = atoi(argv[1]);
-    int k_total_requests = atoi(argv[2]);
-    int reqs_per_client = k_total_requests / k_num_clients;
-
-    std::vector<Client> clients(k_num_clients);
-    std::vector<uint8_t> request_data;
-    fill_request(request_data);
-    
-    std::vector<double> latencies;
-    latencies.reserve(k_total_requests);
+static void read_full(int fd, uint8_t *data, size_t n) {
+    while (n > 0) {
+        ssize_t rv = read(fd, data, n);
+        if (rv <= 0) {
+            die("read()");
+        }
+        data += rv;
+        n -= (size_t)rv;
+    }
+}
 
-    struct sockaddr_in addr = {};
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(1234);
-    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
-
-    std::map<int, Client*> fd2client;
-
-    // FIX: Start timer AFTER setup or track connection time separately
-    auto global_start = std::chrono::steady_clock::now();
-
-    for (int i = 0; i < k_num_clients; ++i) {
-        int fd = socket(AF_INET, SOCK_STREAM, 0);
-        if (fd < 0) { perror("socket"); continue; }
-        fd_set_nb(fd);
-        connect(fd, (const struct sockaddr *)&addr, sizeof(addr));
-        clients[i].fd = fd;
-        clients[i].wbuf = request_data; 
-        fd2client[fd] = &clients[i];
-    }
-
-    std::vector<struct pollfd> poll_args;
-    int completed = 0;
-
-    while (completed < k_num_clients) {
-        poll_args.clear();
-        for (auto &c : clients) {
-            if (c.state == STATE_DONE) continue;
-            struct pollfd pfd = {c.fd, (short)(c.state == STATE_CONNECTING ? POLLOUT : POLLIN), 0};
-            if (c.state == STATE_CONNECTED && c.sent_count < reqs_per_client) pfd.events |= POLLOUT;
-            poll_args.push_back(pfd);
-        }
-
-        int rv = poll(poll_args.data(), poll_args.size(), 5000); // 5s timeout
-        if (rv < 0) break;
-
-        for (const auto &pfd : poll_args) {
-            if (pfd.revents == 0) continue;
-            Client *c = fd2client[pfd.fd];
-
-            if (c->state == STATE_CONNECTING) {
-                if (pfd.revents & (POLLOUT | POLLERR)) {
-                    int err = 0; socklen_t len = sizeof(err);
-                    getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
-                    if (err == 0) c->state = STATE_CONNECTED;
-                    else { close(c->fd); c->state = STATE_DONE; completed++; }
-                }
+// `--populate`: set the keys of this thread with blocking I/O, unmeasured
+static void populate(Thread &t, int fd) {
+    const uint64_t batch = 256;
+    uint64_t lo = g_opt.keys * t.id / g_opt.threads;
+    uint64_t hi = g_opt.keys * (t.id + 1) / g_opt.threads;
+    std::vector<uint8_t> buf;
+    std::vector<uint8_t> body;
+    for (uint64_t k = lo; k < hi; k += batch) {
+        uint64_t n = hi - k < batch ? hi - k : batch;
+        buf.clear();
+        for (uint64_t i = 0; i < n; i++) {
+            append_request(buf, OP_SET, k + i, pick_size(t.rng));
+        }
+        write_all(fd, buf.data(), buf.size());
+        for (uint64_t i = 0; i < n; i++) {
+            uint32_t len = 0;
+            read_full(fd, (uint8_t *)&len, 4);
+            body.resize(len);
+            read_full(fd, body.data(), len);
+        }
+    }
+}
+
+static void client_close(Thread &t, Client &c, bool lost) {
+    if (lost) {
+        t.dropped++;
+    }
+    if (c.limit != UINT64_MAX) {
+        t.unsent -= c.limit - c.sent;
+    }
+    close(c.fd);
+    c.fd = -1;
+    c.done = true;
+    t.open--;
+    c.inflight.clear();
+}
+
+static void client_update_events(Thread &t, Client &c) {
+    uint32_t events = EPOLLIN | (c.wpos < c.wbuf.size() ? (uint32_t)EPOLLOUT : 0);
+    if (events == c.events) {
+        return;
+    }
+    struct epoll_event ev = {};
+    ev.events = events;
+    ev.data.ptr = &c;
+    if (epoll_ctl(t.epfd, c.events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, c.fd, &ev)) {
+        die("epoll_ctl()");
+    }
+    c.events = events;
+}
+
+static void client_flush(Thread &t, Client &c) {
+    while (c.wpos < c.wbuf.size()) {
+        ssize_t rv = write(c.fd, c.wbuf.data() + c.wpos, c.wbuf.size() - c.wpos);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv < 0 && errno == EAGAIN) {
+            break;
+        }
+        if (rv <= 0) {
+            return client_close(t, c, true);
+        }
+        c.wpos += (size_t)rv;
+    }
+    if (c.wpos == c.wbuf.size()) {
+        c.wbuf.clear();
+        c.wpos = 0;
+    }
+    client_update_events(t, c);
+}
+
+static void client_queue(Thread &t, Client &c, uint64_t start_ns) {
+    uint32_t op = pick_op(t.rng);
+    append_request(c.wbuf, op, pick_key(t.rng), op == OP_SET ? pick_size(t.rng) : 0);
+    c.inflight.push_back(Pending{start_ns, op});
+    c.sent++;
+    t.unsent -= c.limit != UINT64_MAX;
+}
+
+// queue the requests that may start now
+static void client_fill(Thread &t, Client &c, uint64_t now) {
+    bool stop = g_stop_ns && now >= g_stop_ns;
+    if (g_interval_ns) {
+        while (c.sent < c.limit && c.next_ns <= now && !(g_stop_ns && c.next_ns >= g_stop_ns)) {
+            client_queue(t, c, c.next_ns);  // as of when it was due
+            c.next_ns += g_interval_ns;
+        }
+    } else {
+        while (!stop && c.sent < c.limit && c.inflight.size() < g_opt.pipeline) {
+            client_queue(t, c, now);
+        }
+    }
+}
+
+static bool client_finished(const Client &c, uint64_t now) {
+    bool out = c.sent >= c.limit || (g_stop_ns && now >= g_stop_ns);
+    return out && c.inflight.empty();
+}
+
+static void client_on_response(Thread &t, Client &c, uint32_t status, uint64_t now) {
+    assert(!c.inflight.empty());
+    Pending p = c.inflight.front();
+    c.inflight.pop_front();
+    uint64_t ns = now > p.start_ns ? now - p.start_ns : 0;
+    hist_add(t.hist[p.op], ns);
+    t.max_ns = ns > t.max_ns ? ns : t.max_ns;
+    t.recv++;
+    t.end_ns = now;
+    if (status == RES_ERR) {
+        t.errors++;
+    } else if (p.op == OP_GET) {
+        (status == RES_NX ? t.misses : t.hits)++;
+    }
+}
+
+static void client_read(Thread &t, Client &c, uint64_t now) {
+    const size_t k_read = 64 * 1024;
+    while (true) {
+        size_t used = c.rbuf.size();
+        c.rbuf.resize(used + k_read);
+        ssize_t rv = read(c.fd, c.rbuf.data() + used, k_read);
+        c.rbuf.resize(used + (rv > 0 ? (size_t)rv : 0));
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv < 0 && errno == EAGAIN) {
+            break;
+        }
+        if (rv <= 0) {
+            return client_close(t, c, true);
+        }
+        if ((size_t)rv < k_read) {
+            break;  // drained
+        }
+    }
+    // `[len][status][data]`
+    while (c.rbuf.size() - c.rpos >= 8) {
+        uint32_t len = 0;
+        uint32_t status = 0;
+        memcpy(&len, &c.rbuf[c.rpos], 4);
+        memcpy(&status, &c.rbuf[c.rpos + 4], 4);
+        if (c.rbuf.size() - c.rpos < 4 + (size_t)len) {
+            break;
+        }
+        if (c.inflight.empty()) {
+            return client_close(t, c, true);    // not asked for
+        }
+        client_on_response(t, c, status, now);
+        c.rpos += 4 + (size_t)len;
+    }
+    if (c.rpos == c.rbuf.size()) {
+        c.rbuf.clear();
+        c.rpos = 0;
+    } else if (c.rpos > c.rbuf.size() / 2) {
+        c.rbuf.erase(c.rbuf.begin(), c.rbuf.begin() + (long)c.rpos);
+        c.rpos = 0;
+    }
+}
+
+// A stuck server would leave requests in flight forever, so the thread
+// gives up this long after the requests are all sent.
+const uint64_t k_drain_ns = 10ull * 1000000000;
+
+// Open-loop, the connections of a thread run on the same interval, so
+// sorted by their phase they are due in turn, and only those that are due
+// are visited. Returns when the next one is due.
+static uint64_t open_loop_step(Thread &t, uint64_t now) {
+    size_t n = t.order.size();
+    for (size_t i = 0; i < n; i++, t.cursor = (t.cursor + 1) % n) {
+        Client &c = t.clients[t.order[t.cursor]];
+        if (c.done || c.sent >= c.limit) {
+            continue;
+        }
+        if (c.next_ns > now) {
+            return c.next_ns;
+        }
+        client_fill(t, c, now);
+        client_flush(t, c);
+    }
+    return now + k_drain_ns;    // nothing left to send
+}
+
+// whether all requests are sent, then the finished connections are closed
+static bool thread_draining(Thread &t, uint64_t now) {
+    if (g_stop_ns ? now < g_stop_ns : t.unsent > 0) {
+        return false;
+    }
+    for (Client &c : t.clients) {
+        if (!c.done && client_finished(c, now)) {
+            client_close(t, c, false);
+        }
+    }
+    return true;
+}
+
+static bool g_pwait2 = true;
+
+// Wait up to `wait_ns`, to the ns with epoll_pwait2() (Linux 5.11+). Else
+// the timeout is in ms, and the last ms before a request is due is spun,
+// which keeps the schedule accurate but takes a core.
+static int wait_events(int epfd, struct epoll_event *events, int n, uint64_t wait_ns) {
+#ifdef SYS_epoll_pwait2
+    if (g_pwait2) {
+        struct timespec ts = {(time_t)(wait_ns / 1000000000), (long)(wait_ns % 1000000000)};
+        int rv = (int)syscall(SYS_epoll_pwait2, epfd, events, n, &ts, NULL, 0);
+        if (rv >= 0 || errno != ENOSYS) {
+            return rv;
+        }
+        g_pwait2 = false;
+    }
+#endif
+    return epoll_wait(epfd, events, n, (int)(wait_ns / 1000000));
+}
+
+static void thread_main(Thread *tp) {
+    Thread &t = *tp;
+    for (Client &c : t.clients) {
+        c.fd = connect_to();
+    }
+    t.open = t.clients.size();
+    if (g_opt.populate && !t.clients.empty()) {
+        populate(t, t.clients[0].fd);
+    }
+    t.epfd = epoll_create1(0);
+    if (t.epfd < 0) {
+        die("epoll_create1()");
+    }
+    for (Client &c : t.clients) {
+        fd_set_nb(c.fd);
+        client_update_events(t, c);
+    }
+    g_ready.fetch_add(1);
+    while (!g_go.load(std::memory_order_acquire)) {
+        std::this_thread::yield();
+    }
+    uint64_t now = get_monotonic_nsec();
+    for (size_t i = 0; i < t.clients.size(); i++) {
+        Client &c = t.clients[i];
+        if (g_interval_ns) {
+            c.next_ns = g_start_ns + (uint64_t)(rng_unit(t.rng) * (double)g_interval_ns);
+            t.order.push_back(i);
+        } else {
+            client_fill(t, c, now);     // then refilled by the responses
+            client_flush(t, c);
+        }
+    }
+    std::sort(t.order.begin(), t.order.end(), [&](size_t a, size_t b) {
+        return t.clients[a].next_ns < t.clients[b].next_ns;
+    });
+    const size_t k_max_events = 256;
+    struct epoll_event events[k_max_events];
+    uint64_t give_up = 0;
+    while (true) {
+        now = get_monotonic_nsec();
+        const uint64_t k_max_wait_ns = 100 * 1000000;
+        uint64_t wait = k_max_wait_ns;
+        if (g_interval_ns) {
+            uint64_t next = open_loop_step(t, now);
+            wait = next > now ? next - now : 0;
+            wait = wait < k_max_wait_ns ? wait : k_max_wait_ns;
+        }
+        if (thread_draining(t, now)) {
+            give_up = give_up ? give_up : now + k_drain_ns;
+            if (t.open == 0 || now >= give_up) {
+                break;
+            }
+        }
+        int n = wait_events(t.epfd, events, (int)k_max_events, wait);
+        if (n < 0 && errno != EINTR) {
+            die("epoll_wait()");
+        }
+        now = get_monotonic_nsec();
+        for (int i = 0; i < n; i++) {
+            Client &c = *(Client *)events[i].data.ptr;
+            if (c.done) {
                 continue;
             }
-
-            if (pfd.revents & POLLIN) {
-                uint8_t buf[8192];
-                ssize_t n = read(c->fd, buf, sizeof(buf));
-                if (n > 0) {
-                    c->rbuf.insert(c->rbuf.end(), buf, buf + n);
-                    while (c->rbuf.size() >= 4) {
-                        uint32_t len; memcpy(&len, c->rbuf.data(), 4);
-                        if (c->rbuf.size() < 4 + len) break;
-                        
-                        // FIX: Calculate latency using the matching start timestamp
-                        if (!c->inflight_timestamps.empty()) {
-                            auto start_time = c->inflight_timestamps.front();
-                            c->inflight_timestamps.pop_front();
-                            std::chrono::duration<double, std::milli> diff = std::chrono::steady_clock::now() - start_time;
-                            latencies.push_back(diff.count());
-                        }
-                        
-                        c->rbuf.erase(c->rbuf.begin(), c->rbuf.begin() + 4 + len);
-                        c->recv_count++;
-                        if (c->recv_count >= reqs_per_client) {
-                            close(c->fd); c->state = STATE_DONE; completed++; break;
-                        }
-                    }
-                } else if (n == 0 || (n < 0 && errno != EAGAIN)) {
-                    close(c->fd); c->state = STATE_DONE; completed++;
-                }
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+                client_read(t, c, now);
+            }
+            if (c.done) {
+                continue;
             }
+            if (!g_interval_ns) {
+                client_fill(t, c, now);
+            }
+            client_flush(t, c);
+            if (!c.done && client_finished(c, now)) {
+                client_close(t, c, false);
+            }
+        }
+    }
+    for (Client &c : t.clients) {
+        if (!c.done) {
+            client_close(t, c, true);
+        }
+    }
+    close(t.epfd);
+}
+
+// `N`, `LO-HI`, or `SIZE:WEIGHT,SIZE:WEIGHT,...`
+static bool parse_sizes(const char *s, SizeDist &d) {
+    d = SizeDist{};
+    char *end = NULL;
+    if (!strchr(s, ':')) {
+        d.lo = d.hi = (uint32_t)strtoul(s, &end, 10);
+        if (*end == '-') {
+            d.hi = (uint32_t)strtoul(end + 1, &end, 10);
+        }
+        return *end == '\0' && d.lo <= d.hi;
+    }
+    uint64_t sum = 0;
+    while (*s) {
+        uint32_t size = (uint32_t)strtoul(s, &end, 10);
+        if (*end != ':') {
+            return false;
+        }
+        uint64_t w = strtoull(end + 1, &end, 10);
+        if (w == 0 || (*end != ',' && *end != '\0')) {
+            return false;
+        }
+        sum += w;
+        d.sizes.push_back(size);
+        d.cum.push_back(sum);
+        d.lo = d.sizes.size() == 1 || size < d.lo ? size : d.lo;
+        d.hi = size > d.hi ? size : d.hi;
+        s = *end ? end + 1 : end;
+    }
+    return !d.sizes.empty();
+}
+
+// `GET:SET:DEL`
+static bool parse_ratio(const char *s, uint32_t *ratio) {
+    unsigned r[OP_COUNT] = {};
+    if (sscanf(s, "%u:%u:%u", &r[0], &r[1], &r[2]) != 3 || r[0] + r[1] + r[2] == 0) {
+        return false;
+    }
+    for (size_t i = 0; i < OP_COUNT; i++) {
+        ratio[i] = r[i];
+    }
+    return true;
+}
+
+static double hist_ms(uint64_t ns) {
+    return (double)ns / 1e6;
+}
+
+// the buckets are reported by their upper bound, which may pass the max
+static uint64_t quantile_ns(const HistSum &h, uint64_t max_ns, double q) {
+    uint64_t v = hist_quantile(h, q);
+    return v < max_ns ? v : max_ns;
+}
+
+// the distribution as `value_ms percentile count` lines, one per bucket
+static void write_hist(const char *path, const HistSum &h) {
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        die("fopen()");
+    }
+    fprintf(fp, "# value_ms percentile count\n");
+    uint64_t seen = 0;
+    for (size_t b = 0; b < k_hist_buckets; b++) {
+        if (!h.counts[b]) {
+            continue;
+        }
+        seen += h.counts[b];
+        uint64_t upper = b + 1 < k_hist_buckets ? hist_lower(b + 1) - 1 : hist_lower(b);
+        fprintf(fp, "%.6f %.9f %llu\n", hist_ms(upper), (double)seen / (double)h.total,
+            (unsigned long long)h.counts[b]);
+    }
+    fclose(fp);
+}
 
-            if (c->state == STATE_CONNECTED && (pfd.revents & POLLOUT)) {
-                // Inside the POLLOUT block:
-                // New: Only allows 32 requests in flight at a time
-                int max_pipeline = 32; // Example pipeline depth
-                while (c->sent_count < reqs_per_client && (c->sent_count - c->recv_count) < max_pipeline){
-                    // FIX: Capture timestamp at the "Intent to Send"
-                    // If we are starting a new request (wbuf_sent == 0), start the timer.
-                    // We use a separate 'pending_time' to store this until we confirm a write > 0.
-                    if (c->wbuf_sent == 0 && c->inflight_timestamps.size() <= (c->sent_count - c->recv_count)) {
-                        c->inflight_timestamps.push_back(std::chrono::steady_clock::now());
-                    }
-
-                    ssize_t n = write(c->fd, 
-                                    c->wbuf.data() + c->wbuf_sent, 
-                                    c->wbuf.size() - c->wbuf_sent);
-                    
-                    if (n < 0) {
-                        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                            // Buffer is full. We keep the timestamp in the queue because
-                            // the "latency clock" is already ticking for this request!
-                            break; 
-                        }
-                        // Fatal error logic here
-                        close(c->fd); c->state = STATE_DONE; completed++; 
-                        break;
-                    }
-
-                    c->wbuf_sent += n;
-                    
-                    // Request fully flushed to kernel
-                    if (c->wbuf_sent == c->wbuf.size()) {
-                        c->sent_count++;
-                        c->wbuf_sent = 0;
-                        // Timer was already pushed at the start of this block
-                    }
-                }
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [--host IP] [--port PORT] [--threads N] [--clients N] "
+        "[--requests N] [--duration SEC] [--pipeline N] [--rate RPS] "
+        "[--ratio GET:SET:DEL] [--keys N] [--zipf S] "
+        "[--value-size N|LO-HI|SIZE:WEIGHT,...] [--populate] [--seed N] "
+        "[--hist-out PATH] [clients] [requests]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    size_t npos = 0;
+    for (int i = 1; i < argc; ++i) {
+        bool more = i + 1 < argc;
+        if (!strcmp(argv[i], "--host") && more) {
+            g_opt.host = argv[++i];
+        } else if (!strcmp(argv[i], "--port") && more) {
+            g_opt.port = (uint16_t)atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--threads") && more) {
+            g_opt.threads = (size_t)atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--clients") && more) {
+            g_opt.clients = (size_t)atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--requests") && more) {
+            g_opt.requests = strtoull(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--duration") && more) {
+            g_opt.duration = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--pipeline") && more) {
+            g_opt.pipeline = (size_t)atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--rate") && more) {
+            g_opt.rate = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--ratio") && more) {
+            if (!parse_ratio(argv[++i], g_opt.ratio)) {
+                usage(argv[0]);
             }
+        } else if (!strcmp(argv[i], "--keys") && more) {
+            g_opt.keys = strtoull(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--zipf") && more) {
+            g_opt.zipf = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--value-size") && more) {
+            if (!parse_sizes(argv[++i], g_vsize)) {
+                usage(argv[0]);
+            }
+        } else if (!strcmp(argv[i], "--populate")) {
+            g_opt.populate = true;
+        } else if (!strcmp(argv[i], "--seed") && more) {
+            g_opt.seed = strtoull(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "--hist-out") && more) {
+            g_opt.hist_out = argv[++i];
+        } else if (argv[i][0] != '-' && npos < 2) {
+            // the old positional form, `swarm_bench clients requests`
+            if (npos++ == 0) {
+                g_opt.clients = (size_t)atoi(argv[i]);
+            } else {
+                g_opt.requests = strtoull(argv[i], NULL, 10);
+            }
+        } else {
+            usage(argv[0]);
         }
     }
+    if (g_opt.threads == 0) {
+        g_opt.threads = std::thread::hardware_concurrency();
+    }
+    if (g_opt.clients == 0 || g_opt.pipeline == 0 || g_opt.keys == 0) {
+        usage(argv[0]);
+    }
+    g_opt.threads = g_opt.threads > g_opt.clients ? g_opt.clients : g_opt.threads;
+    if (g_opt.zipf > 0) {
+        zipf_init(g_zipf, g_opt.zipf, g_opt.keys);
+    }
+    g_value.assign(g_vsize.hi, 'x');
+    if (g_opt.rate > 0) {
+        g_interval_ns = (uint64_t)(1e9 * (double)g_opt.clients / g_opt.rate);
+        g_interval_ns = g_interval_ns ? g_interval_ns : 1;
+    }
 
-    auto global_end = std::chrono::steady_clock::now();
-    std::chrono::duration<double> duration = global_end - global_start;
-    
-    // FIX: Accurate P99 percentile
-    std::sort(latencies.begin(), latencies.end());
-    double p99 = 0;
-    if (!latencies.empty()) {
-        size_t idx = (size_t)(latencies.size() * 0.99);
-        if (idx >= latencies.size()) idx = latencies.size() - 1;
-        p99 = latencies[idx];
+    // the connections, and the requests, split evenly
+    std::vector<Thread> threads(g_opt.threads);
+    for (size_t i = 0; i < g_opt.threads; i++) {
+        Thread &t = threads[i];
+        t.id = i;
+        t.rng = g_opt.seed * 0x100000001b3ull + i;
+        size_t lo = g_opt.clients * i / g_opt.threads;
+        size_t hi = g_opt.clients * (i + 1) / g_opt.threads;
+        t.clients.resize(hi - lo);
+        for (size_t k = lo; k < hi; k++) {
+            Client &c = t.clients[k - lo];
+            c.limit = g_opt.duration > 0 ? UINT64_MAX
+                : g_opt.requests * (k + 1) / g_opt.clients - g_opt.requests * k / g_opt.clients;
+            t.unsent += c.limit != UINT64_MAX ? c.limit : 0;
+        }
     }
+    std::vector<std::thread> workers;
+    for (Thread &t : threads) {
+        workers.emplace_back(thread_main, &t);
+    }
+    while (g_ready.load() < threads.size()) {
+        usleep(1000);
+    }
+    g_start_ns = get_monotonic_nsec();
+    if (g_opt.duration > 0) {
+        g_stop_ns = g_start_ns + (uint64_t)(g_opt.duration * 1e9);
+    }
+    g_go.store(true, std::memory_order_release);
+    for (std::thread &w : workers) {
+        w.join();
+    }
+
+    HistSum all;
+    HistSum ops[OP_COUNT];
+    uint64_t end_ns = g_start_ns, max_ns = 0;
+    uint64_t recv = 0, hits = 0, misses = 0, errors = 0, dropped = 0;
+    for (Thread &t : threads) {
+        for (size_t op = 0; op < OP_COUNT; op++) {
+            hist_merge(all, t.hist[op]);
+            hist_merge(ops[op], t.hist[op]);
+        }
+        end_ns = t.end_ns > end_ns ? t.end_ns : end_ns;
+        max_ns = t.max_ns > max_ns ? t.max_ns : max_ns;
+        recv += t.recv;
+        hits += t.hits;
+        misses += t.misses;
+        errors += t.errors;
+        dropped += t.dropped;
+    }
+    double secs = (double)(end_ns - g_start_ns) / 1e9;
+    double rps = secs > 0 ? (double)recv / secs : 0;
 
-    printf("%.0f,%.2f\n", (double)k_total_requests / duration.count(), p99);
-    return 0;
-}
\ No newline at end of file
+    fprintf(stderr, "%zu threads, %zu clients, %s, %llu keys %s, %llu responses in %.3fs\n",
+        g_opt.threads, g_opt.clients, g_interval_ns ? "open-loop" : "closed-loop",
+        (unsigned long long)g_opt.keys, g_opt.zipf > 0 ? "zipf" : "uniform",
+        (unsigned long long)recv, secs);
+    for (size_t op = 0; op < OP_COUNT; op++) {
+        const HistSum &h = ops[op];
+        if (!h.total) {
+            continue;
+        }
+        fprintf(stderr, "  %s: %llu, avg %.3fms p50 %.3fms p99 %.3fms p99.9 %.3fms\n",
+            k_op_names[op], (unsigned long long)h.total, hist_ms(h.sum / h.total),
+            hist_ms(quantile_ns(h, max_ns, 0.5)), hist_ms(quantile_ns(h, max_ns, 0.99)),
+            hist_ms(quantile_ns(h, max_ns, 0.999)));
+    }
+    if (hits + misses) {
+        fprintf(stderr, "  get hits %.1f%%\n", 100.0 * (double)hits / (double)(hits + misses));
+    }
+    if (errors || dropped) {
+        fprintf(stderr, "  %llu errors, %llu connections lost\n",
+            (unsigned long long)errors, (unsigned long long)dropped);
+    }
+    if (g_opt.hist_out) {
+        write_hist(g_opt.hist_out, all);
+    }
+    printf("%.0f,%.3f,%.3f,%.3f,%.3f\n", rps, hist_ms(quantile_ns(all, max_ns, 0.5)),
+        hist_ms(quantile_ns(all, max_ns, 0.99)), hist_ms(quantile_ns(all, max_ns, 0.999)),
+        hist_ms(max_ns));
+    return dropped ? 2 : 0;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+// CRC-32C (Castagnoli), 8 bytes per instruction with SSE4.2.
+// The bitwise fallback is slow, it's only there to build anywhere.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#endif
+
+
+inline uint32_t crc32c(uint32_t crc, const uint8_t *p, size_t len) {
+    crc = ~crc;
+#if defined(__SSE4_2__)
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        crc = (uint32_t)_mm_crc32_u64(crc, v);
+    }
+    for (; len > 0; p++, len--) {
+        crc = _mm_crc32_u8(crc, *p);
+    }
+#else
+    for (; len > 0; p++, len--) {
+        crc ^= *p;
+        for (int k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (0x82F63B78u & (0u - (crc & 1)));
+        }
+    }
+#endif
+    return ~crc;
+}
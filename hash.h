@@ -0,0 +1,146 @@
+#pragma once
+
+// 64-bit string hash, in the style of wyhash: 8 bytes at a time, mixed by
+// a 64x64->128 multiply. Keys of 2KB or more go through 64-byte stripes
+// accumulated with AVX2 multiplies (as in XXH3), when built with AVX2.
+// All 64 bits are used: the table slots take the low bits, the shard
+// takes the high bits.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+
+// Set once at startup, before any key is hashed. A random seed makes the
+// hashes unpredictable to clients, against hash-flooding.
+inline uint64_t g_hash_seed = 0;
+
+const uint64_t k_hash_secret[4] = {
+    0xa0761d6478bd642full, 0xe7037ed1a0b428dbull,
+    0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull,
+};
+
+inline uint64_t hash_mix(uint64_t a, uint64_t b) {
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+inline uint64_t hash_r8(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+inline uint64_t hash_r4(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+// 1 to 3 bytes
+inline uint64_t hash_r3(const uint8_t *p, size_t k) {
+    return ((uint64_t)p[0] << 16) | ((uint64_t)p[k >> 1] << 8) | p[k - 1];
+}
+
+#if defined(__AVX2__)
+const size_t k_hash_stripe = 64;
+const size_t k_hash_simd_min = 2048;    // below this the scalar lanes are as fast
+
+// 8 lanes of 64 bits: lane += swap(data) + lo32(data ^ key) * hi32(data ^ key)
+inline void hash_stripe(__m256i acc[2], const uint8_t *p, const __m256i key[2]) {
+    for (int i = 0; i < 2; i++) {
+        __m256i data = _mm256_loadu_si256((const __m256i *)(p + 32 * i));
+        __m256i dk = _mm256_xor_si256(data, key[i]);
+        __m256i prod = _mm256_mul_epu32(dk, _mm256_shuffle_epi32(dk, 0x31));
+        __m256i swap = _mm256_shuffle_epi32(data, 0x4E);
+        acc[i] = _mm256_add_epi64(acc[i], _mm256_add_epi64(swap, prod));
+    }
+}
+
+// the stripes of a long key, folded into a seed for the scalar tail
+inline uint64_t hash_long(const uint8_t *&p, size_t &len, uint64_t seed) {
+    uint64_t k[8], a[8];
+    for (int i = 0; i < 8; i++) {
+        k[i] = hash_mix(seed ^ k_hash_secret[i & 3], k_hash_secret[(i + 1) & 3] + i);
+        a[i] = (i & 1) ? k_hash_secret[(i >> 1) & 3] : seed;
+    }
+    __m256i key[2], acc[2];
+    memcpy(key, k, sizeof(key));
+    memcpy(acc, a, sizeof(acc));
+    const __m256i prime = _mm256_set1_epi32((int)0x9E3779B1);
+    for (size_t n = 0; len >= k_hash_stripe; n++) {
+        hash_stripe(acc, p, key);
+        p += k_hash_stripe;
+        len -= k_hash_stripe;
+        if ((n & 15) == 15) {
+            // scramble so that the lanes don't saturate on long inputs
+            for (int i = 0; i < 2; i++) {
+                __m256i v = _mm256_xor_si256(acc[i], _mm256_srli_epi64(acc[i], 47));
+                v = _mm256_xor_si256(v, key[i]);
+                __m256i hi = _mm256_mul_epu32(_mm256_srli_epi64(v, 32), prime);
+                __m256i lo = _mm256_mul_epu32(v, prime);
+                acc[i] = _mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32));
+            }
+        }
+    }
+    memcpy(a, acc, sizeof(a));
+    for (int i = 0; i < 4; i++) {
+        seed ^= hash_mix(a[2 * i] ^ k_hash_secret[i], a[2 * i + 1] ^ seed);
+    }
+    return seed;
+}
+#endif
+
+inline uint64_t str_hash(const uint8_t *p, size_t len) {
+    const size_t total = len;
+    uint64_t seed = g_hash_seed ^ hash_mix(g_hash_seed ^ k_hash_secret[0], k_hash_secret[1]);
+    uint64_t a, b;
+    if (len <= 16) {
+        if (len >= 4) {
+            // 2 overlapping reads cover 4 to 16 bytes
+            a = (hash_r4(p) << 32) | hash_r4(p + ((len >> 3) << 2));
+            b = (hash_r4(p + len - 4) << 32) | hash_r4(p + len - 4 - ((len >> 3) << 2));
+        } else if (len > 0) {
+            a = hash_r3(p, len);
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+#if defined(__AVX2__)
+        if (len >= k_hash_simd_min) {
+            // leaves < 64 bytes, the final reads below may reach back
+            // into the stripes, which is fine for a long key.
+            seed = hash_long(p, len, seed);
+        }
+#endif
+        if (len > 48) {
+            // 3 independent lanes
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = hash_mix(hash_r8(p) ^ k_hash_secret[1], hash_r8(p + 8) ^ seed);
+                see1 = hash_mix(hash_r8(p + 16) ^ k_hash_secret[2], hash_r8(p + 24) ^ see1);
+                see2 = hash_mix(hash_r8(p + 32) ^ k_hash_secret[3], hash_r8(p + 40) ^ see2);
+                p += 48;
+                len -= 48;
+            } while (len > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (len > 16) {
+            seed = hash_mix(hash_r8(p) ^ k_hash_secret[1], hash_r8(p + 8) ^ seed);
+            p += 16;
+            len -= 16;
+        }
+        a = hash_r8(p + len - 16);
+        b = hash_r8(p + len - 8);
+    }
+    a ^= k_hash_secret[1];
+    b ^= seed;
+    __uint128_t r = (__uint128_t)a * b;
+    a = (uint64_t)r;
+    b = (uint64_t)(r >> 64);
+    return hash_mix(a ^ k_hash_secret[0] ^ total, b ^ k_hash_secret[1]);
+}
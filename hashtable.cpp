@@ -1,6 +1,9 @@
+// the chaining engine, see hashtable_swiss.cpp for the other one
+#ifndef HM_SWISS
+
 #include <assert.h>
 #include <stdlib.h>     // calloc(), free()
-#include "hashtable.h"
+#include "hashtable_t.h"
 
 
 // n must be a power of 2
@@ -20,38 +23,20 @@ static void h_insert(HTab *htab, HNode *node) {
     htab->size++;
 }
 
-// hashtable look up subroutine.
-// Pay attention to the return value. It returns the address of
-// the parent pointer that owns the target node,
-// which can be used to delete the target node.
-static HNode **h_lookup(HTab *htab, HNode *key, bool (*eq)(HNode *, HNode *)) {
-    if (!htab->tab) {
-        return NULL;
-    }
-
-    size_t pos = key->hcode & htab->mask;
-    HNode **from = &htab->tab[pos];     // incoming pointer to the target
-    for (HNode *cur; (cur = *from) != NULL; from = &cur->next) {
-        if (cur->hcode == key->hcode && eq(cur, key)) {
-            return from;                // may be a node, may be a slot
-        }
-    }
-    return NULL;
-}
+// work per operation, tuned by the event loop, see `hm_set_rehash_work()`
+const size_t k_rehashing_work = 128;
+const size_t k_rehashing_work_min = 16;
+const size_t k_rehashing_work_max = 1024;
+static thread_local size_t t_rehashing_work = k_rehashing_work;
 
-// remove a node from the chain
-static HNode *h_detach(HTab *htab, HNode **from) {
-    HNode *node = *from;    // the target node
-    *from = node->next;     // update the incoming pointer to the target
-    htab->size--;
-    return node;
+void hm_set_rehash_work(size_t n) {
+    n = n < k_rehashing_work_min ? k_rehashing_work_min : n;
+    t_rehashing_work = n > k_rehashing_work_max ? k_rehashing_work_max : n;
 }
 
-const size_t k_rehashing_work = 128;    // constant work
-
-static void hm_help_rehashing(HMap *hmap) {
+size_t hm_migrate(HMap *hmap, size_t n) {
     size_t nwork = 0;
-    while (nwork < k_rehashing_work && hmap->older.size > 0) {
+    while (nwork < n && hmap->older.size > 0) {
         // find a non-empty slot
         HNode **from = &hmap->older.tab[hmap->migrate_pos];
         if (!*from) {
@@ -67,23 +52,24 @@ static void hm_help_rehashing(HMap *hmap) {
         free(hmap->older.tab);
         hmap->older = HTab{};
     }
+    return nwork;
 }
 
-static void hm_trigger_rehashing(HMap *hmap) {
+void hm_help_rehashing(HMap *hmap) {
+    hm_migrate(hmap, t_rehashing_work);
+}
+
+static void hm_trigger_rehashing(HMap *hmap, size_t n) {
     assert(hmap->older.tab == NULL);
     // (newer, older) <- (new_table, newer)
     hmap->older = hmap->newer;
-    h_init(&hmap->newer, (hmap->newer.mask + 1) * 2);
+    h_init(&hmap->newer, n);
     hmap->migrate_pos = 0;
 }
 
+// the C-style interface, see hashtable_t.h for the inlined one
 HNode *hm_lookup(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *)) {
-    hm_help_rehashing(hmap);
-    HNode **from = h_lookup(&hmap->newer, key, eq);
-    if (!from) {
-        from = h_lookup(&hmap->older, key, eq);
-    }
-    return from ? *from : NULL;
+    return hm_find(hmap, key->hcode, [&](HNode *cur) { return eq(cur, key); });
 }
 
 const size_t k_max_load_factor = 8;
@@ -97,29 +83,102 @@ void hm_insert(HMap *hmap, HNode *node) {
     if (!hmap->older.tab) {         // check whether we need to rehash
         size_t shreshold = (hmap->newer.mask + 1) * k_max_load_factor;
         if (hmap->newer.size >= shreshold) {
-            hm_trigger_rehashing(hmap);
+            hm_trigger_rehashing(hmap, (hmap->newer.mask + 1) * 2);
         }
     }
     hm_help_rehashing(hmap);        // migrate some keys
 }
 
-HNode *hm_delete(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *)) {
-    hm_help_rehashing(hmap);
-    if (HNode **from = h_lookup(&hmap->newer, key, eq)) {
-        return h_detach(&hmap->newer, from);
+// the smallest table below the load factor threshold
+static size_t h_cap_for(size_t n, size_t max_load) {
+    size_t cap = 4;
+    while (cap * max_load <= n) {
+        cap *= 2;
+    }
+    return cap;
+}
+
+// The table is sized as if it grew to `n` keys, and the keys already
+// in it migrate progressively like with a normal resize.
+void hm_reserve(HMap *hmap, size_t n) {
+    size_t cap = h_cap_for(n, k_max_load_factor);
+    if (cap <= hmap->newer.mask + 1) {
+        return;     // already large enough
+    }
+    if (!hmap->newer.tab) {
+        return h_init(&hmap->newer, cap);
     }
-    if (HNode **from = h_lookup(&hmap->older, key, eq)) {
-        return h_detach(&hmap->older, from);
+    while (hmap->older.tab) {
+        hm_help_rehashing(hmap);
     }
-    return NULL;
+    hm_trigger_rehashing(hmap, cap);
+}
+
+// Shrink to under half the load factor threshold, so that the size has
+// to change at least 2x again before the next resize.
+void hm_trigger_shrinking(HMap *hmap) {
+    hm_trigger_rehashing(hmap, h_cap_for(hmap->newer.size, k_max_load_factor / 2));
+}
+
+HNode *hm_delete(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *)) {
+    return hm_remove(hmap, key->hcode, [&](HNode *cur) { return eq(cur, key); });
 }
 
 void hm_clear(HMap *hmap) {
-    free(hmap->newer.tab);
-    free(hmap->older.tab);
+    hm_clear_with(hmap, free);
+}
+
+void hm_clear_with(HMap *hmap, void (*dealloc)(void *)) {
+    dealloc(hmap->newer.tab);
+    dealloc(hmap->older.tab);
     *hmap = HMap{};
 }
 
+// `*pos` runs over the slots of the older table, then the newer one.
+// Empty slots are skipped up to 8 per node taken.
+size_t hm_drain(HMap *hmap, size_t *pos, HNode **out, size_t n) {
+    size_t k = 0;
+    for (size_t visits = 0; k < n && visits < 8 * n; visits++) {
+        HTab *htab = &hmap->older;
+        size_t i = *pos;
+        size_t nolder = htab->tab ? htab->mask + 1 : 0;
+        if (i >= nolder) {
+            htab = &hmap->newer;
+            i -= nolder;
+        }
+        if (!htab->tab || i > htab->mask) {
+            break;  // done
+        }
+        HNode **from = &htab->tab[i];
+        while (*from && k < n) {
+            out[k++] = h_detach(htab, from);
+        }
+        if (!*from) {
+            (*pos)++;
+        }
+    }
+    return k;
+}
+
 size_t hm_size(HMap *hmap) {
     return hmap->newer.size + hmap->older.size;
 }
+
+static bool h_foreach(HTab *htab, bool (*f)(HNode *, void *), void *arg) {
+    for (size_t i = 0; htab->tab && i <= htab->mask; i++) {
+        for (HNode *node = htab->tab[i]; node != NULL; node = node->next) {
+            if (!f(node, arg)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void hm_foreach(HMap *hmap, bool (*f)(HNode *, void *), void *arg) {
+    if (h_foreach(&hmap->newer, f, arg)) {
+        h_foreach(&hmap->older, f, arg);
+    }
+}
+
+#endif  // HM_SWISS
@@ -4,21 +4,40 @@
 #include <stdint.h>
 
 
+// Two engines share this interface, selected at build time:
+//  - hashtable.cpp: chaining with intrusive linked lists (the default).
+//  - hashtable_swiss.cpp: open addressing with per-slot hash tags,
+//    probed 16 slots at a time with SIMD (build with -DHM_SWISS).
+
 // hashtable node, should be embedded into the payload
 struct HNode {
+#ifndef HM_SWISS
     HNode *next = NULL;
+#endif
     uint64_t hcode = 0;
 };
 
+#ifndef HM_SWISS
 // a simple fixed-sized hashtable
 struct HTab {
     HNode **tab = NULL; // array of slots
     size_t mask = 0;    // power of 2 array size, 2^n - 1
     size_t size = 0;    // number of keys
 };
+#else
+// an open-addressing table, groups of 16 slots
+struct HTab {
+    uint8_t *ctrl = NULL;   // per slot: empty, deleted, or 7 bits of the hash
+    HNode **slots = NULL;   // shares the allocation with `ctrl`
+    size_t mask = 0;        // power of 2 array size, 2^n - 1
+    size_t size = 0;        // number of keys
+    size_t tombs = 0;       // number of deleted slots
+};
+#endif
 
 // the real hashtable interface.
-// it uses 2 hashtables for progressive rehashing.
+// it uses 2 hashtables for progressive rehashing,
+// to grow on inserts and to shrink on deletes.
 struct HMap {
     HTab newer;
     HTab older;
@@ -29,4 +48,20 @@ HNode *hm_lookup(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *));
 void   hm_insert(HMap *hmap, HNode *node);
 HNode *hm_delete(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *));
 void   hm_clear(HMap *hmap);
+// the same, the slot arrays are passed to `dealloc()` instead of free()
+void   hm_clear_with(HMap *hmap, void (*dealloc)(void *));
 size_t hm_size(HMap *hmap);
+// make room for `n` keys without more resizing, e.g. before a bulk load
+void   hm_reserve(HMap *hmap, size_t n);
+// move up to `n` keys of a resize in progress, returns the number moved
+size_t hm_migrate(HMap *hmap, size_t n);
+// keys moved by each operation during a resize, in the calling thread,
+// clamped to [16, 1024], 128 by default
+void   hm_set_rehash_work(size_t n);
+// Take up to `n` nodes out into `out`, to free a map in steps: `*pos`
+// starts at 0, and it's empty when `hm_size()` is 0. No other operation
+// may be used on it meanwhile, except `hm_clear()` at the end.
+size_t hm_drain(HMap *hmap, size_t *pos, HNode **out, size_t n);
+// visit all nodes until `f` returns false, the map must not change meanwhile
+void   hm_foreach(HMap *hmap, bool (*f)(HNode *, void *), void *arg);
+// see `hm_scan()` in hashtable_t.h to walk it in steps while it changes
@@ -0,0 +1,221 @@
+// the open-addressing engine, selected with -DHM_SWISS
+#ifdef HM_SWISS
+
+#include <assert.h>
+#include <stdlib.h>     // malloc(), free()
+#include <string.h>
+#include "hashtable_t.h"
+
+
+// bitmask of the empty or deleted slots in a group
+static uint32_t group_free(const uint8_t *ctrl) {
+#if defined(__SSE2__)
+    __m128i group = _mm_loadu_si128((const __m128i *)ctrl);
+    return (uint32_t)_mm_movemask_epi8(group);     // the high bits
+#else
+    uint32_t mask = 0;
+    for (size_t i = 0; i < k_group; i++) {
+        mask |= (uint32_t)(ctrl[i] >> 7) << i;
+    }
+    return mask;
+#endif
+}
+
+// n must be a power of 2, and at least one group
+static void h_init(HTab *htab, size_t n) {
+    assert(n >= k_group && ((n - 1) & n) == 0);
+    uint8_t *mem = (uint8_t *)malloc(n + n * sizeof(HNode *));
+    assert(mem);
+    memset(mem, k_ctrl_empty, n);
+    htab->ctrl = mem;
+    htab->slots = (HNode **)(mem + n);
+    htab->mask = n - 1;
+    htab->size = 0;
+    htab->tombs = 0;
+}
+
+// keep at least 1/8 of the slots empty, so that every probe terminates
+static size_t h_max_used(const HTab *htab) {
+    size_t n = htab->mask + 1;
+    return n - n / 8;
+}
+
+// hashtable insertion, the key must not exist.
+// Groups are visited in triangular steps, which covers all of them.
+static void h_insert(HTab *htab, HNode *node) {
+    size_t gmask = htab->mask / k_group;
+    size_t g = h_home(htab, node->hcode);
+    for (size_t step = 1; ; step++) {
+        uint8_t *ctrl = &htab->ctrl[g * k_group];
+        if (uint32_t mask = group_free(ctrl)) {
+            size_t pos = g * k_group + (size_t)__builtin_ctz(mask);
+            if (htab->ctrl[pos] == k_ctrl_deleted) {
+                htab->tombs--;
+            }
+            htab->ctrl[pos] = h_tag(node->hcode);
+            htab->slots[pos] = node;
+            htab->size++;
+            return;
+        }
+        g = (g + step) & gmask;
+    }
+}
+
+// work per operation, tuned by the event loop, see `hm_set_rehash_work()`
+const size_t k_rehashing_work = 128;
+const size_t k_rehashing_work_min = 16;
+const size_t k_rehashing_work_max = 1024;
+static thread_local size_t t_rehashing_work = k_rehashing_work;
+
+void hm_set_rehash_work(size_t n) {
+    n = n < k_rehashing_work_min ? k_rehashing_work_min : n;
+    t_rehashing_work = n > k_rehashing_work_max ? k_rehashing_work_max : n;
+}
+
+size_t hm_migrate(HMap *hmap, size_t n) {
+    size_t nwork = 0;
+    while (nwork < n && hmap->older.size > 0) {
+        // find a full slot
+        size_t pos = hmap->migrate_pos;
+        assert(pos <= hmap->older.mask);
+        if (hmap->older.ctrl[pos] & 0x80) {
+            hmap->migrate_pos++;
+            continue;   // empty or deleted slot
+        }
+        // move it to the newer table
+        h_insert(&hmap->newer, h_detach(&hmap->older, pos));
+        hmap->migrate_pos++;
+        nwork++;
+    }
+    // discard the old table if done
+    if (hmap->older.size == 0 && hmap->older.ctrl) {
+        free(hmap->older.ctrl);
+        hmap->older = HTab{};
+    }
+    return nwork;
+}
+
+void hm_help_rehashing(HMap *hmap) {
+    hm_migrate(hmap, t_rehashing_work);
+}
+
+static void hm_trigger_rehashing(HMap *hmap, size_t n) {
+    assert(hmap->older.ctrl == NULL);
+    // (newer, older) <- (new_table, newer)
+    hmap->older = hmap->newer;
+    h_init(&hmap->newer, n);
+    hmap->migrate_pos = 0;
+}
+
+// the C-style interface, see hashtable_t.h for the inlined one
+HNode *hm_lookup(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *)) {
+    return hm_find(hmap, key->hcode, [&](HNode *cur) { return eq(cur, key); });
+}
+
+void hm_insert(HMap *hmap, HNode *node) {
+    if (!hmap->newer.ctrl) {
+        h_init(&hmap->newer, k_group);  // initialize it if empty
+    }
+    if (hmap->newer.size + hmap->newer.tombs >= h_max_used(&hmap->newer)) {
+        // The newer table is at least twice as large as the older one,
+        // so it cannot fill up before the migration ends, unless the
+        // last rehash only dropped tombstones. Then finish it first.
+        while (hmap->older.ctrl) {
+            hm_help_rehashing(hmap);
+        }
+        // grow if mostly full of keys, otherwise just drop the tombstones
+        size_t n = hmap->newer.mask + 1;
+        hm_trigger_rehashing(hmap, hmap->newer.size >= n / 2 ? n * 2 : n);
+    }
+    h_insert(&hmap->newer, node);   // always insert to the newer table
+    hm_help_rehashing(hmap);        // migrate some keys
+}
+
+// The table is sized to hold `n` keys within the load limit, and the
+// keys already in it migrate progressively like with a normal resize.
+void hm_reserve(HMap *hmap, size_t n) {
+    size_t cap = k_group;
+    while (cap - cap / 8 <= n) {
+        cap *= 2;
+    }
+    if (cap <= hmap->newer.mask + 1) {
+        return;     // already large enough
+    }
+    if (!hmap->newer.ctrl) {
+        return h_init(&hmap->newer, cap);
+    }
+    while (hmap->older.ctrl) {
+        hm_help_rehashing(hmap);
+    }
+    hm_trigger_rehashing(hmap, cap);
+}
+
+// Shrink to under 1/2 full. The migration moves 16+ keys per call, so
+// the newer table gets far fewer inserts than the keys it takes over,
+// and cannot fill up before the older one is gone.
+void hm_trigger_shrinking(HMap *hmap) {
+    size_t cap = k_group;
+    while (cap / 2 <= hmap->newer.size) {
+        cap *= 2;
+    }
+    hm_trigger_rehashing(hmap, cap);
+}
+
+HNode *hm_delete(HMap *hmap, HNode *key, bool (*eq)(HNode *, HNode *)) {
+    return hm_remove(hmap, key->hcode, [&](HNode *cur) { return eq(cur, key); });
+}
+
+void hm_clear(HMap *hmap) {
+    hm_clear_with(hmap, free);
+}
+
+void hm_clear_with(HMap *hmap, void (*dealloc)(void *)) {
+    dealloc(hmap->newer.ctrl);
+    dealloc(hmap->older.ctrl);
+    *hmap = HMap{};
+}
+
+// `*pos` runs over the slots of the older table, then the newer one.
+// Empty slots are skipped up to 8 per node taken. The control bytes are
+// left alone, a drained map is only freed.
+size_t hm_drain(HMap *hmap, size_t *pos, HNode **out, size_t n) {
+    size_t k = 0;
+    for (size_t visits = 0; k < n && visits < 8 * n; visits++, (*pos)++) {
+        HTab *htab = &hmap->older;
+        size_t i = *pos;
+        size_t nolder = htab->ctrl ? htab->mask + 1 : 0;
+        if (i >= nolder) {
+            htab = &hmap->newer;
+            i -= nolder;
+        }
+        if (!htab->ctrl || i > htab->mask) {
+            break;  // done
+        }
+        if (!(htab->ctrl[i] & 0x80)) {
+            out[k++] = htab->slots[i];
+            htab->size--;
+        }
+    }
+    return k;
+}
+
+size_t hm_size(HMap *hmap) {
+    return hmap->newer.size + hmap->older.size;
+}
+
+static bool h_foreach(HTab *htab, bool (*f)(HNode *, void *), void *arg) {
+    for (size_t i = 0; htab->ctrl && i <= htab->mask; i++) {
+        if (!(htab->ctrl[i] & 0x80) && !f(htab->slots[i], arg)) {
+            return false;   // a full slot
+        }
+    }
+    return true;
+}
+
+void hm_foreach(HMap *hmap, bool (*f)(HNode *, void *), void *arg) {
+    if (h_foreach(&hmap->newer, f, arg)) {
+        h_foreach(&hmap->older, f, arg);
+    }
+}
+
+#endif  // HM_SWISS
@@ -0,0 +1,433 @@
+#pragma once
+
+// A header-only, typed version of the hashtable interface.
+// The probe loop is instantiated for the equality of each payload type,
+// so the comparison is inlined instead of called through a pointer, and
+// it is only reached after the full 64-bit `hcode` matched.
+
+#include <assert.h>
+#include <utility>      // std::swap()
+#include "hashtable.h"
+#if defined(HM_SWISS) && defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+
+// internal: move some keys from the older table to the newer one
+void hm_help_rehashing(HMap *hmap);
+// internal: start moving the keys to a smaller table
+void hm_trigger_shrinking(HMap *hmap);
+
+#ifndef HM_SWISS
+
+inline bool hm_rehashing(const HMap *hmap) {
+    return hmap->older.tab != NULL;
+}
+
+// less than 1 key per slot, a grown table has at least 4
+inline bool h_shrink_due(const HTab *htab) {
+    return htab->size <= htab->mask && htab->mask + 1 > 4;
+}
+
+// hashtable look up subroutine.
+// Pay attention to the return value. It returns the address of
+// the parent pointer that owns the target node,
+// which can be used to delete the target node.
+template <class Eq>
+inline HNode **h_lookup(HTab *htab, uint64_t hcode, Eq &eq) {
+    if (!htab->tab) {
+        return NULL;
+    }
+
+    size_t pos = hcode & htab->mask;
+    HNode **from = &htab->tab[pos];     // incoming pointer to the target
+    for (HNode *cur; (cur = *from) != NULL; from = &cur->next) {
+        if (cur->hcode == hcode && eq(cur)) {
+            return from;                // may be a node, may be a slot
+        }
+    }
+    return NULL;
+}
+
+// remove a node from the chain
+inline HNode *h_detach(HTab *htab, HNode **from) {
+    HNode *node = *from;    // the target node
+    *from = node->next;     // update the incoming pointer to the target
+    htab->size--;
+    return node;
+}
+
+// `eq(HNode *)` tells whether a node with the same `hcode` is the target
+template <class Eq>
+inline HNode *hm_find(HMap *hmap, uint64_t hcode, Eq eq) {
+    if (hm_rehashing(hmap)) {
+        hm_help_rehashing(hmap);
+    }
+    HNode **from = h_lookup(&hmap->newer, hcode, eq);
+    if (!from) {
+        from = h_lookup(&hmap->older, hcode, eq);
+    }
+    return from ? *from : NULL;
+}
+
+// Batched lookups prefetch in 2 steps, each over all keys of the batch:
+// first the slots, then the first node of each chain.
+inline void h_prefetch(const HTab *htab, uint64_t hcode) {
+    if (htab->tab) {
+        __builtin_prefetch(&htab->tab[hcode & htab->mask]);
+    }
+}
+
+inline void h_prefetch_node(const HTab *htab, uint64_t hcode) {
+    if (htab->tab) {
+        if (HNode *node = htab->tab[hcode & htab->mask]) {
+            __builtin_prefetch(node);
+        }
+    }
+}
+
+template <class Eq>
+inline HNode *hm_remove(HMap *hmap, uint64_t hcode, Eq eq) {
+    if (hm_rehashing(hmap)) {
+        hm_help_rehashing(hmap);
+    } else if (h_shrink_due(&hmap->newer)) {
+        hm_trigger_shrinking(hmap);     // the keys migrate like when growing
+    }
+    if (HNode **from = h_lookup(&hmap->newer, hcode, eq)) {
+        return h_detach(&hmap->newer, from);
+    }
+    if (HNode **from = h_lookup(&hmap->older, hcode, eq)) {
+        return h_detach(&hmap->older, from);
+    }
+    return NULL;
+}
+
+// scan: a bucket is a slot
+inline size_t h_scan_mask(const HTab *htab) {
+    return htab->mask;
+}
+
+template <class F>
+inline void h_scan_bucket(HTab *htab, size_t b, F &f) {
+    for (HNode *node = htab->tab ? htab->tab[b] : NULL; node; node = node->next) {
+        f(node);
+    }
+}
+
+// a random key: the first non-empty slot from a random one, then a random
+// node of its chain. The table must not be empty.
+inline HNode *h_sample(const HTab *htab, uint64_t r) {
+    size_t pos = r & htab->mask;
+    while (!htab->tab[pos]) {
+        pos = (pos + 1) & htab->mask;
+    }
+    size_t len = 0;
+    for (HNode *node = htab->tab[pos]; node; node = node->next) {
+        len++;
+    }
+    HNode *node = htab->tab[pos];
+    for (size_t i = (size_t)(r >> 32) % len; i > 0; i--) {
+        node = node->next;
+    }
+    return node;
+}
+
+inline size_t h_bytes(const HTab *htab) {
+    return htab->tab ? (htab->mask + 1) * sizeof(HNode *) : 0;
+}
+
+#else   // HM_SWISS
+
+// control bytes. A full slot stores the low 7 bits of its hash,
+// so both special values have the high bit set.
+const uint8_t k_ctrl_empty = 0x80;
+const uint8_t k_ctrl_deleted = 0xFE;
+
+const size_t k_group = 16;      // slots probed at once
+const size_t k_npos = (size_t)-1;
+
+inline bool hm_rehashing(const HMap *hmap) {
+    return hmap->older.ctrl != NULL;
+}
+
+// less than 1/8 of the slots used, a grown table has at least 1/2
+inline bool h_shrink_due(const HTab *htab) {
+    size_t n = htab->mask + 1;
+    return htab->size < n / 8 && n > k_group;
+}
+
+inline uint8_t h_tag(uint64_t hcode) {
+    return (uint8_t)(hcode & 0x7F);
+}
+
+// the first group to probe, from the bits above the tag
+inline size_t h_home(const HTab *htab, uint64_t hcode) {
+    return (size_t)(hcode >> 7) & (htab->mask / k_group);
+}
+
+// bitmask of the slots in a group whose control byte is `c`
+inline uint32_t group_match(const uint8_t *ctrl, uint8_t c) {
+#if defined(__SSE2__)
+    __m128i group = _mm_loadu_si128((const __m128i *)ctrl);
+    __m128i match = _mm_cmpeq_epi8(group, _mm_set1_epi8((char)c));
+    return (uint32_t)_mm_movemask_epi8(match);
+#else
+    uint32_t mask = 0;
+    for (size_t i = 0; i < k_group; i++) {
+        mask |= (uint32_t)(ctrl[i] == c) << i;
+    }
+    return mask;
+#endif
+}
+
+// hashtable look up subroutine, returns the slot of the target node.
+// The tags filter out almost all mismatches before `eq` is called,
+// and a group with an empty slot ends the probe.
+template <class Eq>
+inline size_t h_lookup(HTab *htab, uint64_t hcode, Eq &eq) {
+    if (!htab->ctrl) {
+        return k_npos;
+    }
+
+    size_t gmask = htab->mask / k_group;
+    size_t g = h_home(htab, hcode);
+    uint8_t tag = h_tag(hcode);
+    for (size_t step = 1; ; step++) {
+        const uint8_t *ctrl = &htab->ctrl[g * k_group];
+        for (uint32_t mask = group_match(ctrl, tag); mask; mask &= mask - 1) {
+            size_t pos = g * k_group + (size_t)__builtin_ctz(mask);
+            HNode *cur = htab->slots[pos];
+            if (cur->hcode == hcode && eq(cur)) {
+                return pos;
+            }
+        }
+        if (group_match(ctrl, k_ctrl_empty)) {
+            return k_npos;
+        }
+        g = (g + step) & gmask;
+    }
+}
+
+// Batched lookups prefetch in 2 steps, each over all keys of the batch:
+// first the control bytes and slots of the home group, then the first
+// node whose tag matches.
+inline void h_prefetch(const HTab *htab, uint64_t hcode) {
+    if (htab->ctrl) {
+        size_t pos = h_home(htab, hcode) * k_group;
+        __builtin_prefetch(&htab->ctrl[pos]);
+        __builtin_prefetch(&htab->slots[pos]);
+        __builtin_prefetch(&htab->slots[pos + k_group / 2]);
+    }
+}
+
+inline void h_prefetch_node(const HTab *htab, uint64_t hcode) {
+    if (htab->ctrl) {
+        size_t pos = h_home(htab, hcode) * k_group;
+        if (uint32_t mask = group_match(&htab->ctrl[pos], h_tag(hcode))) {
+            __builtin_prefetch(htab->slots[pos + (size_t)__builtin_ctz(mask)]);
+        }
+    }
+}
+
+// remove a node from its slot
+inline HNode *h_detach(HTab *htab, size_t pos) {
+    HNode *node = htab->slots[pos];
+    // A probe never continues past a group with an empty slot, so no other
+    // key depends on this group being full: the slot can be emptied.
+    // Otherwise leave a tombstone to keep the probe sequences intact.
+    if (group_match(&htab->ctrl[pos & ~(k_group - 1)], k_ctrl_empty)) {
+        htab->ctrl[pos] = k_ctrl_empty;
+    } else {
+        htab->ctrl[pos] = k_ctrl_deleted;
+        htab->tombs++;
+    }
+    htab->size--;
+    return node;
+}
+
+// `eq(HNode *)` tells whether a node with the same `hcode` is the target
+template <class Eq>
+inline HNode *hm_find(HMap *hmap, uint64_t hcode, Eq eq) {
+    if (hm_rehashing(hmap)) {
+        hm_help_rehashing(hmap);
+    }
+    size_t pos = h_lookup(&hmap->newer, hcode, eq);
+    if (pos != k_npos) {
+        return hmap->newer.slots[pos];
+    }
+    pos = h_lookup(&hmap->older, hcode, eq);
+    return pos != k_npos ? hmap->older.slots[pos] : NULL;
+}
+
+template <class Eq>
+inline HNode *hm_remove(HMap *hmap, uint64_t hcode, Eq eq) {
+    if (hm_rehashing(hmap)) {
+        hm_help_rehashing(hmap);
+    } else if (h_shrink_due(&hmap->newer)) {
+        hm_trigger_shrinking(hmap);     // the keys migrate like when growing
+    }
+    size_t pos = h_lookup(&hmap->newer, hcode, eq);
+    if (pos != k_npos) {
+        return h_detach(&hmap->newer, pos);
+    }
+    pos = h_lookup(&hmap->older, hcode, eq);
+    if (pos != k_npos) {
+        return h_detach(&hmap->older, pos);
+    }
+    return NULL;
+}
+
+// scan: a bucket is the keys whose home is a group. Like for a lookup,
+// they are all on the probe sequence from it, up to a group with an
+// empty slot, so a key is in the same bucket wherever it was placed.
+inline size_t h_scan_mask(const HTab *htab) {
+    return htab->mask / k_group;
+}
+
+template <class F>
+inline void h_scan_bucket(HTab *htab, size_t b, F &f) {
+    if (!htab->ctrl) {
+        return;
+    }
+    size_t gmask = htab->mask / k_group;
+    size_t g = b;
+    for (size_t step = 1; ; step++) {
+        const uint8_t *ctrl = &htab->ctrl[g * k_group];
+        for (size_t i = 0; i < k_group; i++) {
+            HNode *node = htab->slots[g * k_group + i];
+            if (!(ctrl[i] & 0x80) && h_home(htab, node->hcode) == b) {
+                f(node);
+            }
+        }
+        if (group_match(ctrl, k_ctrl_empty)) {
+            return;
+        }
+        g = (g + step) & gmask;
+    }
+}
+
+// a random key: the first full slot from a random one.
+// The table must not be empty.
+inline HNode *h_sample(const HTab *htab, uint64_t r) {
+    size_t pos = r & htab->mask;
+    while (htab->ctrl[pos] & 0x80) {
+        pos = (pos + 1) & htab->mask;
+    }
+    return htab->slots[pos];
+}
+
+inline size_t h_bytes(const HTab *htab) {
+    return htab->ctrl ? (htab->mask + 1) * (1 + sizeof(HNode *)) : 0;
+}
+
+#endif  // HM_SWISS
+
+inline void hm_prefetch(const HMap *hmap, uint64_t hcode) {
+    h_prefetch(&hmap->newer, hcode);
+    h_prefetch(&hmap->older, hcode);
+}
+
+inline void hm_prefetch_node(const HMap *hmap, uint64_t hcode) {
+    h_prefetch_node(&hmap->newer, hcode);
+    h_prefetch_node(&hmap->older, hcode);
+}
+
+// A random key from the 64 random bits `r`, NULL if empty, for sampling.
+// Keys after empty slots are more likely, which is fine for eviction.
+inline HNode *hm_sample(const HMap *hmap, uint64_t r) {
+    size_t n0 = hmap->newer.size, n1 = hmap->older.size;
+    if (n0 + n1 == 0) {
+        return NULL;
+    }
+    // pick a table in proportion to its keys
+    bool older = (size_t)(r >> 40) % (n0 + n1) >= n0;
+    return h_sample(older ? &hmap->older : &hmap->newer, r);
+}
+
+// the memory of the slot arrays
+inline size_t hm_bytes(const HMap *hmap) {
+    return h_bytes(&hmap->newer) + h_bytes(&hmap->older);
+}
+
+inline uint64_t h_rev_bits(uint64_t v) {
+    v = ((v >> 1) & 0x5555555555555555ull) | ((v & 0x5555555555555555ull) << 1);
+    v = ((v >> 2) & 0x3333333333333333ull) | ((v & 0x3333333333333333ull) << 2);
+    v = ((v >> 4) & 0x0F0F0F0F0F0F0F0Full) | ((v & 0x0F0F0F0F0F0F0F0Full) << 4);
+    return __builtin_bswap64(v);
+}
+
+// the next bucket, counting with the bits of the mask reversed
+inline uint64_t h_scan_next(uint64_t cursor, size_t mask) {
+    cursor |= ~(uint64_t)mask;
+    return h_rev_bits(h_rev_bits(cursor) + 1);
+}
+
+// Visit one bucket of a scan, `f(HNode *)` for each key, and return the
+// cursor of the next one: 0 to start, 0 again when done. The cursor is
+// incremented from its high bits, like in Redis, so the buckets already
+// visited map to buckets already visited in a table of any other size.
+// Every key present for the whole scan is visited, some maybe twice,
+// even while the map resizes between the steps. During a resize a
+// bucket of the smaller table is visited with all the buckets it
+// expands to in the larger one. `f` must not change the map.
+template <class F>
+inline uint64_t hm_scan(HMap *hmap, uint64_t cursor, F f) {
+    HTab *t0 = &hmap->newer;
+    HTab *t1 = &hmap->older;
+    if (!hm_rehashing(hmap)) {
+        size_t m0 = h_scan_mask(t0);
+        h_scan_bucket(t0, cursor & m0, f);
+        return h_scan_next(cursor, m0);
+    }
+    if (h_scan_mask(t0) > h_scan_mask(t1)) {
+        std::swap(t0, t1);
+    }
+    size_t m0 = h_scan_mask(t0), m1 = h_scan_mask(t1);
+    h_scan_bucket(t0, cursor & m0, f);
+    do {
+        h_scan_bucket(t1, cursor & m1, f);
+        cursor = h_scan_next(cursor, m1);
+    } while (cursor & (m0 ^ m1));
+    return cursor;
+}
+
+// The typed interface. `T` describes the payload:
+//
+//  struct T {
+//      typedef ... Entry;  // the payload that embeds the `HNode`
+//      typedef ... Key;    // what it is looked up by
+//      static Entry *entry(HNode *node);           // container_of
+//      static uint64_t hash(const Key &key);
+//      static bool eq(const Entry *ent, const Key &key);
+//  };
+//
+// `hcode` must be `T::hash(key)`, it is passed in so that the caller
+// can reuse it for `hm_insert()` or sharding.
+
+template <class T>
+inline typename T::Entry *
+hm_lookup(HMap *hmap, const typename T::Key &key, uint64_t hcode) {
+    HNode *node = hm_find(hmap, hcode, [&](HNode *cur) {
+        return T::eq(T::entry(cur), key);
+    });
+    return node ? T::entry(node) : NULL;
+}
+
+template <class T>
+inline typename T::Entry *
+hm_delete(HMap *hmap, const typename T::Key &key, uint64_t hcode) {
+    HNode *node = hm_remove(hmap, hcode, [&](HNode *cur) {
+        return T::eq(T::entry(cur), key);
+    });
+    return node ? T::entry(node) : NULL;
+}
+
+template <class T>
+inline typename T::Entry *hm_lookup(HMap *hmap, const typename T::Key &key) {
+    return hm_lookup<T>(hmap, key, T::hash(key));
+}
+
+template <class T>
+inline typename T::Entry *hm_delete(HMap *hmap, const typename T::Key &key) {
+    return hm_delete<T>(hmap, key, T::hash(key));
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+// a min-heap item. `ref` points back into the payload, where the item's
+// current position is kept up to date, so the payload can be found in
+// the heap in O(1) to update or remove it.
+struct HeapItem {
+    uint64_t val = 0;
+    size_t *ref = NULL;
+};
+
+// restore the heap property after `a[pos].val` was changed
+void heap_update(HeapItem *a, size_t pos, size_t len);
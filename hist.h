@@ -0,0 +1,82 @@
+#pragma once
+
+// Log-linear histogram in the style of HdrHistogram: values below 16 are
+// exact, above that each power of 2 is split into 8 buckets, so a bucket
+// is within 12.5% of its values. Only the owning thread adds to it, the
+// counters are atomic so that other threads can read them at any time.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+
+const size_t k_hist_sub = 8;            // buckets per power of 2
+const size_t k_hist_max_bits = 40;      // larger values are clamped
+const size_t k_hist_buckets = 2 * k_hist_sub + (k_hist_max_bits - 4) * k_hist_sub;
+
+struct Hist {
+    std::atomic<uint64_t> counts[k_hist_buckets] = {};
+    std::atomic<uint64_t> sum{0};
+};
+
+inline size_t hist_bucket(uint64_t v) {
+    if (v < 2 * k_hist_sub) {
+        return (size_t)v;
+    }
+    if (v >> k_hist_max_bits) {
+        v = ((uint64_t)1 << k_hist_max_bits) - 1;
+    }
+    size_t msb = 63 - (size_t)__builtin_clzll(v);   // >= 4
+    size_t frac = (size_t)(v >> (msb - 3)) & (k_hist_sub - 1);
+    return 2 * k_hist_sub + (msb - 4) * k_hist_sub + frac;
+}
+
+// the smallest value of a bucket
+inline uint64_t hist_lower(size_t b) {
+    if (b < 2 * k_hist_sub) {
+        return b;
+    }
+    size_t msb = (b - 2 * k_hist_sub) / k_hist_sub + 4;
+    uint64_t frac = (b - 2 * k_hist_sub) % k_hist_sub;
+    return (k_hist_sub + frac) << (msb - 3);
+}
+
+inline void hist_add(Hist &h, uint64_t v) {
+    std::atomic<uint64_t> &c = h.counts[hist_bucket(v)];
+    c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    h.sum.store(h.sum.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+}
+
+// a plain copy, for merging the histograms of several threads
+struct HistSum {
+    uint64_t counts[k_hist_buckets] = {};
+    uint64_t sum = 0;
+    uint64_t total = 0;
+};
+
+inline void hist_merge(HistSum &out, const Hist &h) {
+    for (size_t b = 0; b < k_hist_buckets; b++) {
+        uint64_t n = h.counts[b].load(std::memory_order_relaxed);
+        out.counts[b] += n;
+        out.total += n;
+    }
+    out.sum += h.sum.load(std::memory_order_relaxed);
+}
+
+// the largest value of the bucket that holds the quantile `q`, 0 if empty
+inline uint64_t hist_quantile(const HistSum &h, double q) {
+    if (h.total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(q * (double)h.total);
+    rank = rank < h.total ? rank : h.total - 1;
+    uint64_t seen = 0;
+    size_t b = 0;
+    for (; b + 1 < k_hist_buckets; b++) {
+        seen += h.counts[b];
+        if (seen > rank) {
+            break;
+        }
+    }
+    return b + 1 < k_hist_buckets ? hist_lower(b + 1) - 1 : hist_lower(b);
+}
@@ -0,0 +1,222 @@
+#pragma once
+
+// RESP, the protocol of the Redis clients, parsed incrementally: the state
+// is kept between reads, so a partial request is not scanned again from
+// its start, and the bulk strings are skipped by their length. Both forms
+// are accepted: arrays of bulk strings, `*2\r\n$3\r\nget\r\n$1\r\nk\r\n`,
+// and inline commands split by spaces, `get k\r\n`, as typed in telnet.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+
+const size_t k_resp_max_inline = 64 * 1024;    // an inline command, or a header line
+
+// an argument, by offset from the start of the request
+struct RespArg {
+    size_t off = 0;
+    size_t len = 0;
+};
+
+struct RespParser {
+    size_t pos = 0;         // parsed so far, or the request length once done
+    size_t scan = 0;        // searched for `\n` so far
+    int64_t nargs = -1;     // the array length, -1 until known
+    int64_t bulk = -1;      // the length of the next bulk string, -1 until known
+    size_t need = 0;        // the bytes the request needs at least
+    size_t taken = 0;       // bytes taken out of the buffer, see `resp_take_bulk()`
+    bool crlf = false;      // the CRLF of a taken bulk string is next
+    const char *err = NULL; // the request is invalid
+    std::vector<RespArg> args;
+};
+
+enum {
+    RESP_MORE = 0,      // incomplete
+    RESP_DONE = 1,      // `args` is the request, `pos` its length
+    RESP_ERROR = -1,    // invalid, see `err`
+};
+
+inline void resp_reset(RespParser &p) {
+    p.pos = p.scan = p.need = p.taken = 0;
+    p.nargs = p.bulk = -1;
+    p.crlf = false;
+    p.err = NULL;
+    p.args.clear();
+}
+
+// the first `\n` in [p, end), 16 bytes at a time with SSE2
+inline const uint8_t *resp_find_lf(const uint8_t *p, const uint8_t *end) {
+#if defined(__SSE2__)
+    const __m128i lf = _mm_set1_epi8('\n');
+    for (; end - p >= 16; p += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, lf));
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for (; p < end; p++) {
+        if (*p == '\n') {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+inline int resp_fail(RespParser &p, const char *err) {
+    p.err = err;
+    return RESP_ERROR;
+}
+
+// `<type><integer>\r\n` at `pos`, the search continues from `scan`
+inline int resp_line(RespParser &p, const uint8_t *data, size_t size, int64_t &val) {
+    size_t from = p.scan > p.pos ? p.scan : p.pos;
+    const uint8_t *lf = resp_find_lf(data + from, data + size);
+    if (!lf) {
+        p.scan = size;
+        return size - p.pos > k_resp_max_inline
+            ? resp_fail(p, "too big header") : RESP_MORE;
+    }
+    size_t end = (size_t)(lf - data);   // at `\n`
+    const uint8_t *cur = data + p.pos + 1;
+    bool neg = cur < lf && *cur == '-';
+    cur += neg;
+    if (end < p.pos + 3 || data[end - 1] != '\r' || cur == data + end - 1) {
+        return resp_fail(p, "invalid header");
+    }
+    uint64_t v = 0;
+    for (; cur < data + end - 1; cur++) {
+        if (*cur < '0' || *cur > '9' || v > ((uint64_t)1 << 40)) {
+            return resp_fail(p, "invalid length");
+        }
+        v = v * 10 + (uint64_t)(*cur - '0');
+    }
+    val = neg ? -(int64_t)v : (int64_t)v;
+    p.pos = p.scan = end + 1;
+    return RESP_DONE;
+}
+
+// words separated by spaces or tabs, up to `\n`
+inline int resp_inline(RespParser &p, const uint8_t *data, size_t size) {
+    const uint8_t *lf = resp_find_lf(data + p.scan, data + size);
+    if (!lf) {
+        p.scan = size;
+        return size > k_resp_max_inline ? resp_fail(p, "too big inline request") : RESP_MORE;
+    }
+    size_t end = (size_t)(lf - data);
+    size_t stop = end > 0 && data[end - 1] == '\r' ? end - 1 : end;
+    for (size_t i = 0; i < stop; ) {
+        if (data[i] == ' ' || data[i] == '\t') {
+            i++;
+            continue;
+        }
+        RespArg arg;
+        arg.off = i;
+        while (i < stop && data[i] != ' ' && data[i] != '\t') {
+            i++;
+        }
+        arg.len = i - arg.off;
+        p.args.push_back(arg);
+    }
+    p.nargs = (int64_t)p.args.size();
+    p.pos = p.scan = end + 1;
+    return RESP_DONE;
+}
+
+// Parse the request at `data`, continuing from the last call. `max_args`
+// and `max_size` limit the array and the whole request. An empty request,
+// like a blank line, is done with no `args`.
+inline int resp_parse(RespParser &p, const uint8_t *data, size_t size,
+    size_t max_args, size_t max_size)
+{
+    if (p.err) {
+        return RESP_ERROR;
+    }
+    if (p.nargs >= 0 && p.args.size() == (size_t)p.nargs && !p.crlf) {
+        return RESP_DONE;
+    }
+    if (size == 0) {
+        return RESP_MORE;
+    }
+    if (p.nargs < 0) {
+        if (data[0] != '*') {
+            return resp_inline(p, data, size);
+        }
+        int64_t n = 0;
+        int rv = resp_line(p, data, size, n);
+        if (rv != RESP_DONE) {
+            return rv;
+        }
+        if (n > (int64_t)max_args) {
+            return resp_fail(p, "too many arguments");
+        }
+        p.nargs = n < 0 ? 0 : n;    // `*-1`, a null array, is ignored
+        p.args.reserve(p.nargs < 1024 ? (size_t)p.nargs : 1024);
+    }
+    if (p.crlf) {
+        if (size - p.pos < 2) {
+            return RESP_MORE;
+        }
+        if (data[p.pos] != '\r' || data[p.pos + 1] != '\n') {
+            return resp_fail(p, "expected CRLF");
+        }
+        p.pos = p.scan = p.pos + 2;
+        p.crlf = false;
+    }
+    while (p.args.size() < (size_t)p.nargs) {
+        if (p.bulk < 0) {
+            if (p.pos >= size) {
+                return RESP_MORE;
+            }
+            if (data[p.pos] != '$') {
+                return resp_fail(p, "expected '$'");
+            }
+            int64_t n = 0;
+            int rv = resp_line(p, data, size, n);
+            if (rv != RESP_DONE) {
+                return rv;
+            }
+            if (n < 0) {
+                return resp_fail(p, "invalid bulk length");
+            }
+            size_t used = p.pos + p.taken;
+            if (used > max_size || (uint64_t)n + 2 > max_size - used) {
+                return resp_fail(p, "too big request");
+            }
+            p.bulk = n;
+        }
+        size_t len = (size_t)p.bulk;
+        if (size - p.pos < len + 2) {
+            p.need = p.pos + len + 2;   // the rest is skipped, not scanned
+            return RESP_MORE;
+        }
+        if (data[p.pos + len] != '\r' || data[p.pos + len + 1] != '\n') {
+            return resp_fail(p, "expected CRLF");
+        }
+        RespArg arg;
+        arg.off = p.pos;
+        arg.len = len;
+        p.args.push_back(arg);
+        p.pos = p.scan = p.pos + len + 2;
+        p.bulk = -1;
+    }
+    return RESP_DONE;
+}
+
+// The caller takes the bulk string being received out of the buffer and
+// receives it elsewhere. It's left as an argument of no bytes at `pos`,
+// followed by its CRLF.
+inline void resp_take_bulk(RespParser &p) {
+    RespArg arg;
+    arg.off = p.pos;
+    p.args.push_back(arg);
+    p.taken += (size_t)p.bulk;
+    p.bulk = -1;
+    p.need = 0;
+    p.crlf = true;
+}
@@ -5,18 +5,52 @@
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <poll.h>
+#include <math.h>
+#include <time.h>
 // system
 #include <fcntl.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <netdb.h>
 #include <netinet/ip.h>
+#include <linux/errqueue.h>
+#include <sys/uio.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 // C++
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
 #include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>  // __rdtsc()
+#endif
 // proj
-#include "hashtable.h"
+#include "crc32c.h"
+#include "hash.h"
+#include "hashtable_t.h"
+#include "heap.h"
+#include "hist.h"
+#include "list.h"
+#include "resp.h"
+#include "slab.h"
+#include "uring.h"
+#include "zset.h"
 #include <netinet/tcp.h>  // Required for TCP_NODELAY
 
 #define container_of(ptr, T, member) \
@@ -55,49 +89,357 @@ static void fd_set_nb(int fd) {
 
 const size_t k_max_msg = 32 << 20;  // likely larger than the kernel buffer
 
+// a FIFO byte buffer. Consuming from the front only moves `data_begin`,
+// the space before it is reclaimed lazily when the back runs out of room.
+struct Buffer {
+    uint8_t *buffer_begin = NULL;
+    uint8_t *buffer_end = NULL;
+    uint8_t *data_begin = NULL;
+    uint8_t *data_end = NULL;
+
+    Buffer() = default;
+    Buffer(const Buffer &) = delete;
+    Buffer &operator=(const Buffer &) = delete;
+    ~Buffer() { free(buffer_begin); }
+};
+
+static uint8_t *buf_data(Buffer &buf) {
+    return buf.data_begin;
+}
+
+static size_t buf_size(const Buffer &buf) {
+    return (size_t)(buf.data_end - buf.data_begin);
+}
+
+// make room for at least `n` more bytes at the back
+static void buf_reserve(Buffer &buf, size_t n) {
+    if ((size_t)(buf.buffer_end - buf.data_end) >= n) {
+        return;
+    }
+    size_t size = buf_size(buf);
+    size_t cap = (size_t)(buf.buffer_end - buf.buffer_begin);
+    size_t front = (size_t)(buf.data_begin - buf.buffer_begin);
+    // compact only when the move is paid for by the consumed bytes,
+    // so each byte is moved at most once on average.
+    if (cap - size >= n && front >= size) {
+        memmove(buf.buffer_begin, buf.data_begin, size);
+    } else {
+        size_t newcap = cap ? cap * 2 : 4096;
+        while (newcap < size + n) {
+            newcap *= 2;
+        }
+        uint8_t *mem = (uint8_t *)malloc(newcap);
+        if (!mem) {
+            die("out of memory");
+        }
+        if (size) {
+            memcpy(mem, buf.data_begin, size);
+        }
+        free(buf.buffer_begin);
+        buf.buffer_begin = mem;
+        buf.buffer_end = mem + newcap;
+    }
+    buf.data_begin = buf.buffer_begin;
+    buf.data_end = buf.buffer_begin + size;
+}
+
+// the free space at the back, to be filled directly, e.g. by `read()`
+static uint8_t *buf_tail(Buffer &buf) {
+    return buf.data_end;
+}
+
+static size_t buf_tail_size(const Buffer &buf) {
+    return (size_t)(buf.buffer_end - buf.data_end);
+}
+
+// the caller has filled `n` bytes of the tail
+static void buf_commit(Buffer &buf, size_t n) {
+    assert(n <= buf_tail_size(buf));
+    buf.data_end += n;
+}
+
+// append to the back
+static void buf_append(Buffer &buf, const uint8_t *data, size_t len) {
+    buf_reserve(buf, len);
+    memcpy(buf.data_end, data, len);
+    buf.data_end += len;
+}
+
+// remove from the front
+static void buf_consume(Buffer &buf, size_t n) {
+    assert(n <= buf_size(buf));
+    buf.data_begin += n;
+    if (buf.data_begin == buf.data_end) {
+        // empty, rewind for free
+        buf.data_begin = buf.data_end = buf.buffer_begin;
+    }
+}
+
+static void buf_clear(Buffer &buf) {
+    buf.data_begin = buf.data_end = buf.buffer_begin;
+}
+
+static void buf_swap(Buffer &a, Buffer &b) {
+    std::swap(a.buffer_begin, b.buffer_begin);
+    std::swap(a.buffer_end, b.buffer_end);
+    std::swap(a.data_begin, b.data_begin);
+    std::swap(a.data_end, b.data_end);
+}
+
+// give back the memory of a buffer that grew beyond `cap`
+static void buf_trim(Buffer &buf, size_t cap) {
+    if ((size_t)(buf.buffer_end - buf.buffer_begin) > cap) {
+        free(buf.buffer_begin);
+        buf.buffer_begin = buf.buffer_end = NULL;
+        buf.data_begin = buf.data_end = NULL;
+        buf_reserve(buf, cap);
+    }
+}
+
+// Lazy freeing: a large free() can stall the event loop for milliseconds
+// while the pages are unmapped, so the large blobs and the slot arrays of
+// the dropped tables are freed by a background thread. They are pushed
+// onto a lock-free stack, linked through their own first bytes, and the
+// thread is woken by the push that finds it empty. The slab memory of the
+// keys belongs to the workers, it's freed in steps, see `lazy_step()`.
+struct LazyObj {
+    LazyObj *next;
+};
+static std::atomic<LazyObj *> g_lazy_stack{NULL};
+static int g_lazy_fd = -1;                  // eventfd
+static thread_local uint64_t t_lazy_objs;   // handed over by this thread
+
+// not for the slab objects, see `slab_disown()`
+static void lazy_free(void *ptr) {
+    if (!ptr) {
+        return;
+    }
+    LazyObj *obj = (LazyObj *)ptr;
+    LazyObj *head = g_lazy_stack.load(std::memory_order_relaxed);
+    do {
+        obj->next = head;
+    } while (!g_lazy_stack.compare_exchange_weak(head, obj,
+        std::memory_order_release, std::memory_order_relaxed));
+    t_lazy_objs++;
+    uint64_t one = 1;
+    if (!head && write(g_lazy_fd, &one, sizeof(one)) < 0) {
+        abort();
+    }
+}
+
+static void lazy_run() {
+    while (true) {
+        uint64_t n = 0;
+        if (read(g_lazy_fd, &n, sizeof(n)) < 0 && errno != EINTR) {
+            abort();
+        }
+        LazyObj *obj = g_lazy_stack.exchange(NULL, std::memory_order_acquire);
+        while (obj) {
+            LazyObj *next = obj->next;
+            free(obj);
+            obj = next;
+        }
+    }
+}
+
+// freed by the background thread from this size
+const size_t k_lazy_min_bytes = 256 * 1024;
+
+// values this large are stored in a `Blob` and sent without copying
+const size_t k_blob_min = 64 * 1024;
+
+// A large string value, shared by its entry and the responses still
+// sending it. It's immutable while shared: setting the key meanwhile
+// allocates a new one. Only used by the worker owning the key.
+struct Blob {
+    uint32_t refs = 1;
+    uint32_t cap = 0;   // bytes after the header
+};
+
+static uint8_t *blob_data(Blob *blob) {
+    return (uint8_t *)(blob + 1);
+}
+
+static Blob *blob_new(size_t cap) {
+    Blob *blob = new (slab_alloc(sizeof(Blob) + cap)) Blob();
+    blob->cap = (uint32_t)cap;
+    return blob;
+}
+
+static void blob_unref(Blob *blob) {
+    if (--blob->refs == 0) {
+        size_t size = sizeof(Blob) + blob->cap;
+        blob->~Blob();
+        if (size >= k_lazy_min_bytes) {
+            slab_disown(size);
+            lazy_free(blob);
+        } else {
+            slab_free(blob, size);
+        }
+    }
+}
+
+// a value sent straight from its blob, spliced into the output stream
+// right before the byte at stream offset `at`
+struct OutRef {
+    uint64_t at = 0;
+    Blob *blob = NULL;
+    const uint8_t *data = NULL;     // the part not sent yet
+    size_t len = 0;
+};
+
+struct Forward;
+struct ReplLink;
+
+// a sampled request, timestamped in TSC cycles, see `trace_sample()`
+enum {
+    TR_READ = 0,    // the read that completed it
+    TR_PARSE = 1,   // parsed, after the requests before it in the read
+    TR_EXEC = 2,    // `do_request()` returned
+    TR_SERIALIZE = 3,   // the response header is done
+    TR_WRITE = 4,   // its last byte was sent
+    TR_NUM = 5,
+};
+
+struct Trace {
+    uint64_t tsc[TR_NUM] = {};
+    char cmd[16] = {};
+};
+
+// the protocol of a connection, told by its first bytes, see `conn_sniff()`
+enum {
+    PROTO_BINARY = 0,   // length-prefixed frames
+    PROTO_RESP2 = 2,    // Redis clients
+    PROTO_RESP3 = 3,    // after `hello 3`
+};
+
+// a large binary request parsed as it arrives, see `conn_parse_frame()`
+struct FrameParser {
+    bool on = false;
+    uint32_t len = 0;       // of the body, from the header
+    size_t pos = 0;         // parsed so far, from the header
+    int64_t nargs = -1;     // -1 until known
+    int64_t bulk = -1;      // the length of the next argument, -1 until known
+    std::vector<RespArg> args;
+};
+
+static void frame_reset(FrameParser &fp) {
+    fp.on = false;
+    fp.len = 0;
+    fp.pos = 0;
+    fp.nargs = fp.bulk = -1;
+    fp.args.clear();
+}
+
 struct Conn {
     int fd = -1;
     // application's intention, for the event loop
     bool want_read = false;
     bool want_write = false;
     bool want_close = false;
+    uint32_t epoll_mask = 0;    // the events registered in epoll
     // buffered input and output
-    std::vector<uint8_t> incoming;  // data to be parsed by the application
-    std::vector<uint8_t> outgoing;  // responses generated by the application
+    Buffer incoming;    // data to be parsed by the application
+    Buffer outgoing;    // responses generated by the application
+    // large values referenced by the responses, in the stream order
+    std::deque<OutRef> outrefs;
+    uint64_t out_base = 0;  // stream offset of the front of `outgoing`, or `sending`
+    // a sampled request whose response isn't sent yet
+    Trace trace;
+    uint64_t trace_end = 0; // the stream offset after the response, 0 for none
+    // MSG_ZEROCOPY: the kernel reads the blobs even after `sendmsg()`
+    // returns, they stay pinned until it reports the send as complete.
+    bool zerocopy = false;  // SO_ZEROCOPY is enabled
+    uint32_t zc_next = 0;   // id of the next zerocopy send
+    std::deque<std::pair<uint32_t, Blob *>> zc_pins;
+    int zc_fd = -1;         // closed with pins, kept for them, see `conn_close()`
+    // requests forwarded to other shards, in the order of arrival.
+    // responses are appended to `outgoing` strictly from the front.
+    std::deque<Forward *> inflight;
+    // timer
+    uint64_t last_active_ms = 0;
+    DList idle_node;    // in the idle list of the worker, oldest first
+    // fair scheduling, see `conn_process()`
+    uint32_t budget = 0;        // requests left for this loop iteration
+    uint64_t budget_iter = 0;   // the iteration it's for
+    bool read_stopped = false;  // stopped reading before the socket was drained
+    DList ready_node;           // in the ready list: requests left over
+    // io_uring: the kernel may still refer to the `Conn` after it's closed
+    uint32_t uring_ops = 0; // submitted operations not yet completed
+    Buffer sending;         // `outgoing` being sent, swapped out of the way
+    // AOF with fsync always: the output waits for the log to be synced
+    bool aof_wait = false;
+    // the link of a replica after `psync`, see `repl_fill()`
+    ReplLink *repl = NULL;
+    // cluster: the last request was `asking`, see `cluster_redirect()`
+    bool asking = false;
+    uint8_t proto = PROTO_BINARY;
+    bool sniffed = false;
+    RespParser resp;    // the request being parsed, for RESP
+    FrameParser frame;  // for large binary requests
+    // a large argument, received straight into the blob the value will be
+    // kept in. `incoming` has the rest of the request, without it.
+    Blob *sink = NULL;
+    size_t sink_got = 0;    // received so far, of `sink->cap`
+    size_t sink_arg = 0;    // its index in the request
 };
 
-// append to the back
-static void
-buf_append(std::vector<uint8_t> &buf, const uint8_t *data, size_t len) {
-    buf.insert(buf.end(), data, data + len);
+static bool conn_has_output(const Conn *conn) {
+    return buf_size(conn->outgoing) > 0 || !conn->outrefs.empty();
 }
 
-// remove from the front
-static void buf_consume(std::vector<uint8_t> &buf, size_t n) {
-    buf.erase(buf.begin(), buf.begin() + n);
+// The zerocopy pins are gone by the release, see `conn_zc_linger()`,
+// unless the server is going down.
+static void conn_drop_refs(Conn *conn) {
+    for (OutRef &ref : conn->outrefs) {
+        blob_unref(ref.blob);
+    }
+    conn->outrefs.clear();
+    for (std::pair<uint32_t, Blob *> &pin : conn->zc_pins) {
+        blob_unref(pin.second);
+    }
+    conn->zc_pins.clear();
+}
+
+// counters written by one thread and read by any
+static void stat_add(std::atomic<uint64_t> &v, uint64_t n) {
+    v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+static void stat_inc(std::atomic<uint64_t> &v) {
+    stat_add(v, 1);
 }
 
-// Global pool
-std::vector<Conn*> conn_pool;
+// Per-worker pool
+static thread_local std::vector<Conn*> conn_pool;
+static thread_local struct PoolStats {
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};    // allocated a new `Conn`
+} pool_stats;
 const size_t k_pool_size = 10000;
+const size_t k_conn_buf = 64 * 1024;    // initial size of both buffers
 
 void init_pool() {
     conn_pool.reserve(k_pool_size);
     for (size_t i = 0; i < k_pool_size; ++i) {
         Conn *c = new Conn();
-        c->incoming.reserve(64 * 1024);
-        c->outgoing.reserve(64 * 1024);
+        buf_reserve(c->incoming, k_conn_buf);
+        buf_reserve(c->outgoing, k_conn_buf);
         conn_pool.push_back(c);
     }
 }
 
 Conn* acquire_conn() {
     if (conn_pool.empty()) {
+        stat_inc(pool_stats.misses);
         Conn *c = new Conn();
-        c->incoming.reserve(64 * 1024);
-        c->outgoing.reserve(64 * 1024);
+        buf_reserve(c->incoming, k_conn_buf);
+        buf_reserve(c->outgoing, k_conn_buf);
+        dlist_init(&c->idle_node);
+        dlist_init(&c->ready_node);
         return c;
     }
+    stat_inc(pool_stats.hits);
     Conn *c = conn_pool.back();
     conn_pool.pop_back();
     // Reset state
@@ -105,36 +447,80 @@ Conn* acquire_conn() {
     c->want_read = false;
     c->want_write = false;
     c->want_close = false;
-    c->incoming.clear();
-    c->outgoing.clear();
+    c->epoll_mask = 0;
+    buf_clear(c->incoming);
+    buf_clear(c->outgoing);
+    buf_clear(c->sending);
+    c->out_base = 0;
+    c->trace_end = 0;
+    c->budget_iter = 0;
+    c->read_stopped = false;
+    c->zerocopy = false;
+    c->zc_next = 0;
+    assert(c->zc_fd < 0);
+    c->proto = PROTO_BINARY;
+    c->sniffed = false;
+    resp_reset(c->resp);
+    frame_reset(c->frame);
+    assert(!c->sink);
+    assert(c->outrefs.empty() && c->zc_pins.empty());
+    assert(!c->repl);
+    assert(c->inflight.empty());
+    assert(c->uring_ops == 0);
+    assert(!c->aof_wait);
+    dlist_init(&c->idle_node);
+    dlist_init(&c->ready_node);
     return c;
 }
 
 void release_conn(Conn *c) {
+    conn_drop_refs(c);
+    if (c->sink) {
+        blob_unref(c->sink);    // closed while receiving it
+        c->sink = NULL;
+    }
     if (conn_pool.size() < k_pool_size) {
+        // don't keep a large message's buffers around in the pool
+        buf_trim(c->incoming, k_conn_buf);
+        buf_trim(c->outgoing, k_conn_buf);
+        buf_trim(c->sending, k_conn_buf);
         conn_pool.push_back(c);
     } else {
         delete c;
     }
 }
 
-// update epoll events for a connection
-static void conn_update_epoll(int epoll_fd, Conn *conn) {
-    struct epoll_event ev = {};
-    ev.data.ptr = conn;
-    ev.events = EPOLLERR;  // always monitor for errors
-    
+// edge-triggered epoll (`--io epoll-et`): each connection is registered
+// once for both directions, and the socket is drained until EAGAIN.
+static bool g_epoll_et = false;
+
+// the epoll events a connection should be registered for
+static uint32_t conn_epoll_mask(const Conn *conn) {
+    if (g_epoll_et) {
+        return EPOLLIN | EPOLLOUT | EPOLLET | EPOLLERR;     // never changes
+    }
+    uint32_t events = EPOLLERR;     // always monitor for errors
     if (conn->want_read) {
-        ev.events |= EPOLLIN;
+        events |= EPOLLIN;
     }
     if (conn->want_write) {
-        ev.events |= EPOLLOUT;
-    }
-    
-    // Use EPOLL_CTL_MOD to update the existing registration
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) < 0) {
-        msg_errno("epoll_ctl MOD error");
+        events |= EPOLLOUT;
     }
+    return events;
+}
+
+// `--zerocopy`: blobs are sent with MSG_ZEROCOPY, with epoll only
+static bool g_zerocopy = false;
+
+static Conn *conn_new(int connfd) {
+    // set the new connection fd to nonblocking mode
+    fd_set_nb(connfd);
+
+    // create a `struct Conn`
+    Conn *conn = acquire_conn();
+    conn->fd = connfd;
+    conn->want_read = true;
+    return conn;
 }
 
 // application callback when the listening socket is ready
@@ -154,19 +540,19 @@ static Conn *handle_accept(int epoll_fd, int fd) {
     //     ntohs(client_addr.sin_port)
     // );
 
-    // set the new connection fd to nonblocking mode
-    fd_set_nb(connfd);
+    Conn *conn = conn_new(connfd);
+    if (g_zerocopy) {
+        int val = 1;
+        if (setsockopt(connfd, SOL_SOCKET, SO_ZEROCOPY, &val, sizeof(val)) < 0) {
+            msg_errno("setsockopt SO_ZEROCOPY error");
+        } else {
+            conn->zerocopy = true;
+        }
+    }
 
-    // create a `struct Conn`
-    Conn *conn = acquire_conn();
-    conn->fd = connfd;
-    conn->incoming.reserve(64 * 1024);   // Pre-allocate 64KB
-    conn->outgoing.reserve(64 * 1024);   // Pre-allocate 64KB
-    conn->want_read = true;
-    
     // add to epoll
     struct epoll_event ev = {};
-    ev.events = EPOLLIN | EPOLLERR;
+    ev.events = conn->epoll_mask = conn_epoll_mask(conn);
     ev.data.ptr = conn;
     if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, connfd, &ev) < 0) {
         msg_errno("epoll_ctl ADD error");
@@ -189,12 +575,23 @@ static bool read_u32(const uint8_t *&cur, const uint8_t *end, uint32_t &out) {
     return true;
 }
 
-static bool
-read_str(const uint8_t *&cur, const uint8_t *end, size_t n, std::string &out) {
-    if (cur + n > end) {
+static bool read_u64(const uint8_t *&cur, const uint8_t *end, uint64_t &out) {
+    if (cur + 8 > end) {
+        return false;
+    }
+    memcpy(&out, cur, 8);
+    cur += 8;
+    return true;
+}
+
+// the view points into the input buffer, no copying
+static bool read_str(
+    const uint8_t *&cur, const uint8_t *end, size_t n, std::string_view &out)
+{
+    if (n > (size_t)(end - cur)) {
         return false;
     }
-    out.assign(cur, cur + n);
+    out = std::string_view((const char *)cur, n);
     cur += n;
     return true;
 }
@@ -203,8 +600,10 @@ read_str(const uint8_t *&cur, const uint8_t *end, size_t n, std::string &out) {
 // | nstr | len | str1 | len | str2 | ... | len | strn |
 // +------+-----+------+-----+------+-----+-----+------+
 
+// the output views are only valid until the input buffer is consumed
 static int32_t
-parse_req(const uint8_t *data, size_t size, std::vector<std::string> &out) {
+parse_req(const uint8_t *data, size_t size, std::vector<std::string_view> &out) {
+    out.clear();
     const uint8_t *end = data + size;
     uint32_t nstr = 0;
     if (!read_u32(data, end, nstr)) {
@@ -219,7 +618,7 @@ parse_req(const uint8_t *data, size_t size, std::vector<std::string> &out) {
         if (!read_u32(data, end, len)) {
             return -1;
         }
-        out.push_back(std::string());
+        out.emplace_back();
         if (!read_str(data, end, len, out.back())) {
             return -1;
         }
@@ -235,320 +634,5461 @@ enum {
     RES_OK = 0,
     RES_ERR = 1,    // error
     RES_NX = 2,     // key not found
+    RES_MOVED = 3,  // cluster: "<slot> <host:port>", the slot is served there
+    RES_ASK = 4,    // cluster: ditto for this request only, see `cluster_redirect()`
 };
 
-// +--------+---------+
-// | status | data... |
-// +--------+---------+
+// A response is built in place at the back of the output buffer, the
+// length is patched in by `response_end()`.
+// +-----+--------+---------+
+// | len | status | data... |
+// +-----+--------+---------+
+// Written into `conn->outgoing`, large values are only referenced.
+// For RESP there is no header, the status is turned into the reply type
+// by `resp_end()`.
 struct Response {
-    uint32_t status = 0;
-    std::vector<uint8_t> data;
+    Buffer *buf = NULL;
+    size_t header = 0;      // offset of `len` from `buf_data()`
+    Conn *conn = NULL;      // set if `buf` is its `outgoing`
+    size_t refbytes = 0;    // bytes of the referenced values
+    uint8_t proto = PROTO_BINARY;
+    uint32_t status = RES_OK;
 };
 
-// global states
-static struct {
-    HMap db;    // top-level hashtable
-} g_data;
+static void response_begin(Response &out, Buffer &buf, uint8_t proto = PROTO_BINARY) {
+    out.buf = &buf;
+    out.header = buf_size(buf);
+    out.refbytes = 0;
+    out.proto = proto;
+    out.status = RES_OK;
+    if (proto == PROTO_BINARY) {
+        uint32_t header[2] = {0, RES_OK};
+        buf_append(buf, (const uint8_t *)header, sizeof(header));
+    }
+}
 
-// KV pair for the top-level hashtable
-struct Entry {
-    struct HNode node;  // hashtable node
-    std::string key;
-    std::string val;
-};
+// offset of the data from `buf_data()`
+static size_t response_body(const Response &out) {
+    return out.header + (out.proto == PROTO_BINARY ? 8 : 0);
+}
 
-// equality comparison for `struct Entry`
-static bool entry_eq(HNode *lhs, HNode *rhs) {
-    struct Entry *le = container_of(lhs, struct Entry, node);
-    struct Entry *re = container_of(rhs, struct Entry, node);
-    return le->key == re->key;
+static size_t response_size(const Response &out) {
+    return buf_size(*out.buf) - response_body(out) + out.refbytes;
 }
 
-// FNV hash
-static uint64_t str_hash(const uint8_t *data, size_t len) {
-    uint32_t h = 0x811C9DC5;
-    for (size_t i = 0; i < len; i++) {
-        h = (h + data[i]) * 0x01000193;
+static void out_status(Response &out, uint32_t status) {
+    out.status = status;
+    if (out.proto == PROTO_BINARY) {
+        memcpy(buf_data(*out.buf) + out.header + 4, &status, 4);
     }
-    return h;
 }
 
-static void do_get(std::vector<std::string> &cmd, Response &out) {
-    // a dummy `Entry` just for the lookup
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-    // hashtable lookup
-    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
-    if (!node) {
-        out.status = RES_NX;
-        return;
-    }
-    // copy the value
-    const std::string &val = container_of(node, Entry, node)->val;
-    assert(val.size() <= k_max_msg);
-    out.data.assign(val.begin(), val.end());
+static void out_append(Response &out, const void *data, size_t len) {
+    buf_append(*out.buf, (const uint8_t *)data, len);
 }
 
-static void do_set(std::vector<std::string> &cmd, Response &) {
-    // a dummy `Entry` just for the lookup
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-    // hashtable lookup
-    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
-    if (node) {
-        // found, update the value
-        container_of(node, Entry, node)->val.swap(cmd[2]);
-    } else {
-        // not found, allocate & insert a new pair
-        Entry *ent = new Entry();
-        ent->key.swap(key.key);
-        ent->node.hcode = key.node.hcode;
-        ent->val.swap(cmd[2]);
-        hm_insert(&g_data.db, &ent->node);
+// RESP: a type byte and a number, `:42\r\n`
+static void resp_head(Response &out, char type, int64_t n) {
+    char text[24];
+    text[0] = type;
+    char *end = std::to_chars(text + 1, text + sizeof(text) - 2, n).ptr;
+    *end++ = '\r';
+    *end++ = '\n';
+    out_append(out, text, (size_t)(end - text));
+}
+
+// raw bytes, referenced rather than copied if they are in a blob
+static void out_ref(Response &out, std::string_view val, Blob *blob) {
+    if (!blob || !out.conn) {
+        return out_append(out, val.data(), val.size());
     }
+    assert(out.buf == &out.conn->outgoing);
+    blob->refs++;
+    OutRef ref;
+    ref.at = out.conn->out_base + buf_size(*out.buf);
+    ref.blob = blob;
+    ref.data = (const uint8_t *)val.data();
+    ref.len = val.size();
+    out.conn->outrefs.push_back(ref);
+    out.refbytes += val.size();
 }
 
-static void do_del(std::vector<std::string> &cmd, Response &) {
-    // a dummy `Entry` just for the lookup
-    Entry key;
-    key.key.swap(cmd[1]);
-    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
-    // hashtable delete
-    HNode *node = hm_delete(&g_data.db, &key.node, &entry_eq);
-    if (node) { // deallocate the pair
-        delete container_of(node, Entry, node);
+// a string value, the whole data of a binary response
+static void out_val(Response &out, std::string_view val, Blob *blob) {
+    if (out.proto == PROTO_BINARY) {
+        return out_ref(out, val, blob);
     }
+    resp_head(out, '$', (int64_t)val.size());
+    out_ref(out, val, blob);
+    out_append(out, "\r\n", 2);
 }
 
-static void do_request(std::vector<std::string> &cmd, Response &out) {
-    if (cmd.size() == 2 && cmd[0] == "get") {
-        return do_get(cmd, out);
-    } else if (cmd.size() == 3 && cmd[0] == "set") {
-        return do_set(cmd, out);
-    } else if (cmd.size() == 2 && cmd[0] == "del") {
-        return do_del(cmd, out);
-    } else {
-        out.status = RES_ERR;       // unrecognized command
+// array responses:
+// +---+------+------+-----+------+------+
+// | n | len1 | str1 | ... | lenn | strn |
+// +---+------+------+-----+------+------+
+// a nil element is a `len` of 0xFFFFFFFF without bytes.
+static void out_u32(Response &out, uint32_t v) {
+    out_append(out, &v, 4);
+}
+
+static void out_arr(Response &out, uint32_t n) {
+    if (out.proto == PROTO_BINARY) {
+        return out_u32(out, n);
     }
+    resp_head(out, '*', n);
 }
 
-static void make_response(const Response &resp, std::vector<uint8_t> &out) {
-    uint32_t resp_len = 4 + (uint32_t)resp.data.size();
-    buf_append(out, (const uint8_t *)&resp_len, 4);
-    buf_append(out, (const uint8_t *)&resp.status, 4);
-    buf_append(out, resp.data.data(), resp.data.size());
+// key-value pairs, a flat array but with RESP3
+static void out_map(Response &out, uint32_t n) {
+    if (out.proto != PROTO_RESP3) {
+        return out_arr(out, 2 * n);
+    }
+    resp_head(out, '%', n);
 }
 
-// process 1 request if there is enough data
-static bool try_one_request(Conn *conn) {
-    // try to parse the protocol: message header
-    if (conn->incoming.size() < 4) {
-        return false;   // want read
+// an array element
+static void out_bulk(Response &out, std::string_view val, Blob *blob) {
+    if (out.proto != PROTO_BINARY) {
+        return out_val(out, val, blob);
     }
-    uint32_t len = 0;
-    memcpy(&len, conn->incoming.data(), 4);
-    if (len > k_max_msg) {
-        msg("too long");
-        conn->want_close = true;
-        return false;   // want close
+    out_u32(out, (uint32_t)val.size());
+    out_ref(out, val, blob);
+}
+
+static void out_str(Response &out, std::string_view str) {
+    out_bulk(out, str, NULL);
+}
+
+static void out_nil(Response &out) {
+    if (out.proto == PROTO_RESP3) {
+        return out_append(out, "_\r\n", 3);
+    } else if (out.proto == PROTO_RESP2) {
+        return out_append(out, "$-1\r\n", 5);
     }
-    // message body
-    if (4 + len > conn->incoming.size()) {
-        return false;   // want read
+    out_u32(out, 0xFFFFFFFF);
+}
+
+// an integer response is 8 bytes of data
+static void out_int(Response &out, int64_t val) {
+    if (out.proto != PROTO_BINARY) {
+        return resp_head(out, ':', val);
     }
-    const uint8_t *request = &conn->incoming[4];
+    out_append(out, &val, 8);
+}
 
-    // got one request, do some application logic
-    std::vector<std::string> cmd;
-    if (parse_req(request, len, cmd) < 0) {
-        msg("bad request");
-        conn->want_close = true;
-        return false;   // want close
+// a status text like `PONG`, the data of a binary response
+static void out_simple(Response &out, std::string_view str) {
+    if (out.proto == PROTO_BINARY) {
+        return out_append(out, str.data(), str.size());
     }
-    Response resp;
-    do_request(cmd, resp);
-    make_response(resp, conn->outgoing);
+    out_append(out, "+", 1);
+    out_append(out, str.data(), str.size());
+    out_append(out, "\r\n", 2);
+}
 
-    // application logic done! remove the request message.
-    buf_consume(conn->incoming, 4 + len);
-    // Q: Why not just empty the buffer? See the explanation of "pipelining".
-    return true;        // success
+// a score is sent as text, like in Redis
+static std::string_view dbl2str(char (&text)[32], double val) {
+    int n = snprintf(text, sizeof(text), "%.17g", val);
+    return std::string_view(text, (size_t)n);
 }
 
-// application callback when the socket is writable
-static void handle_write(int epoll_fd, Conn *conn) {
-    assert(conn->outgoing.size() > 0);
-    ssize_t rv = write(conn->fd, &conn->outgoing[0], conn->outgoing.size());
-    if (rv < 0 && errno == EAGAIN) {
-        return; // actually not ready
-    }
-    if (rv < 0) {
-        msg_errno("write() error");
-        conn->want_close = true;    // error handling
-        return;
+static void out_dbl(Response &out, double val) {
+    char text[32];
+    out_str(out, dbl2str(text, val));
+}
+
+// replaces whatever was written so far
+static void out_err(Response &out, std::string_view msg) {
+    out.buf->data_end = buf_data(*out.buf) + response_body(out);
+    if (out.conn) {
+        // the values referenced by this response are spliced after its header
+        std::deque<OutRef> &refs = out.conn->outrefs;
+        while (!refs.empty() && refs.back().at > out.conn->out_base + out.header) {
+            blob_unref(refs.back().blob);
+            refs.pop_back();
+        }
     }
+    out.refbytes = 0;
+    out_status(out, RES_ERR);
+    out_append(out, msg.data(), msg.size());
+}
 
-    // remove written data from `outgoing`
-    buf_consume(conn->outgoing, (size_t)rv);
+// an error text that starts with its code, like `WRONGTYPE ...`
+static bool err_has_code(std::string_view msg) {
+    size_t n = 0;
+    while (n < msg.size() && msg[n] >= 'A' && msg[n] <= 'Z') {
+        n++;
+    }
+    return n > 0 && (n == msg.size() || msg[n] == ' ');
+}
 
-    // update the readiness intention
-    if (conn->outgoing.size() == 0) {   // all data written
-        conn->want_read = true;
-        conn->want_write = false;
-    } // else: want write
-    
-    // update epoll registration
-    conn_update_epoll(epoll_fd, conn);
+// RESP: nothing written is `+OK`, RES_NX a nil, and the errors get their
+// code in front, `ERR` by default.
+static void resp_end(Response &out) {
+    size_t size = buf_size(*out.buf) - out.header;
+    if (out.status == RES_OK) {
+        if (size == 0 && out.refbytes == 0) {
+            out_append(out, "+OK\r\n", 5);
+        }
+        return;
+    } else if (out.status == RES_NX) {
+        return out_nil(out);
+    }
+    std::string text = "-";
+    std::string_view msg((const char *)buf_data(*out.buf) + out.header, size);
+    if (out.status == RES_MOVED) {
+        text += "MOVED ";
+    } else if (out.status == RES_ASK) {
+        text += "ASK ";
+    } else if (msg.empty()) {
+        text += "ERR unknown command";
+    } else if (!err_has_code(msg)) {
+        text += "ERR ";
+    }
+    for (char c : msg) {
+        text.push_back(c == '\r' || c == '\n' ? ' ' : c);
+    }
+    text += "\r\n";
+    out.buf->data_end = buf_data(*out.buf) + out.header;
+    out_append(out, text.data(), text.size());
 }
 
-// application callback when the socket is readable
-static void handle_read(int epoll_fd, Conn *conn) {
-    // read some data
-    uint8_t buf[256 * 1024];
-    ssize_t rv = read(conn->fd, buf, sizeof(buf));
-    if (rv < 0 && errno == EAGAIN) {
-        return; // actually not ready
-    }
-    // handle IO error
-    if (rv < 0) {
-        msg_errno("read() error");
-        conn->want_close = true;
-        return; // want close
+static void response_end(Response &out) {
+    if (response_size(out) > k_max_msg) {
+        out_err(out, "response is too big");
     }
-    // handle EOF
-    if (rv == 0) {
-        if (conn->incoming.size() == 0) {
-            // msg("client closed");
-        } else {
-            msg("unexpected EOF");
+    if (out.proto != PROTO_BINARY) {
+        return resp_end(out);
+    }
+    uint32_t len = 4 + (uint32_t)response_size(out);
+    memcpy(buf_data(*out.buf) + out.header, &len, 4);
+}
+
+// the command handlers, see `k_cmds`
+typedef void (*CmdFn)(std::vector<std::string_view> &cmd, Response &out);
+static void do_get(std::vector<std::string_view> &cmd, Response &out);
+static void do_set(std::vector<std::string_view> &cmd, Response &out);
+static void do_del(std::vector<std::string_view> &cmd, Response &out);
+static void do_mget(std::vector<std::string_view> &cmd, Response &out);
+static void do_mset(std::vector<std::string_view> &cmd, Response &out);
+static void do_mdel(std::vector<std::string_view> &cmd, Response &out);
+static void do_expire(std::vector<std::string_view> &cmd, Response &out);
+static void do_pexpire(std::vector<std::string_view> &cmd, Response &out);
+static void do_pexpireat(std::vector<std::string_view> &cmd, Response &out);
+static void do_ttl(std::vector<std::string_view> &cmd, Response &out);
+static void do_pttl(std::vector<std::string_view> &cmd, Response &out);
+static void do_zadd(std::vector<std::string_view> &cmd, Response &out);
+static void do_zrem(std::vector<std::string_view> &cmd, Response &out);
+static void do_zscore(std::vector<std::string_view> &cmd, Response &out);
+static void do_zrank(std::vector<std::string_view> &cmd, Response &out);
+static void do_zcard(std::vector<std::string_view> &cmd, Response &out);
+static void do_zrange(std::vector<std::string_view> &cmd, Response &out);
+static void do_memstats(std::vector<std::string_view> &cmd, Response &out);
+static void do_stats(std::vector<std::string_view> &cmd, Response &out);
+static void do_bgrewriteaof(std::vector<std::string_view> &cmd, Response &out);
+static void do_bgsave(std::vector<std::string_view> &cmd, Response &out);
+static void do_slowlog(std::vector<std::string_view> &cmd, Response &out);
+static void do_trace(std::vector<std::string_view> &cmd, Response &out);
+static void do_scan(std::vector<std::string_view> &cmd, Response &out);
+static void do_cluster(std::vector<std::string_view> &cmd, Response &out);
+static void do_flushall(std::vector<std::string_view> &cmd, Response &out);
+static void do_ping(std::vector<std::string_view> &cmd, Response &out);
+static void do_echo(std::vector<std::string_view> &cmd, Response &out);
+static void do_select(std::vector<std::string_view> &cmd, Response &out);
+static void do_hello(std::vector<std::string_view> &cmd, Response &out);
+static void do_asking(std::vector<std::string_view> &cmd, Response &out);
+
+// Cmd::flags
+enum {
+    CMD_WRITE = 1,      // refused by a replica, logged to the AOF and the replicas
+    CMD_GROW = 2,       // refused over `--maxmemory` without an eviction policy
+    CMD_KEY = 4,        // `cmd[1]` is a key, it decides the shard and the slot
+    CMD_KEYS = 8,       // and so are all the arguments after it
+    CMD_PAIRS = 16,     // or every other one, in key-value pairs
+    CMD_SLOT = 32,      // a subcommand about the slot `cmd[2]`, see `cmd_shard()`
+    CMD_CURSOR = 64,    // run in the shard named by the cursor `cmd[1]`
+    CMD_LOG_TTL = 128,  // a write followed by the TTL of `cmd[1]`, see `aof_feed()`
+    CMD_LOG_SELF = 256, // a write logged by the handler instead
+    CMD_ALL = 512,      // run in every shard, see `conn_forward()`
+    // the keys of a batch may be in several shards, see `conn_split()`
+    CMD_CONCAT = 1024,  // the elements of the parts are put back in key order
+    CMD_SUM = 2048,     // the counts of the parts are added up
+};
+
+const uint32_t k_log_all = UINT32_MAX;  // Cmd::log_args
+
+struct Cmd {
+    std::string_view name;
+    CmdFn fn;
+    uint32_t min_args;  // with the name
+    uint32_t max_args;  // 0 for no limit
+    uint32_t flags;
+    uint32_t keywords;  // bits of the argument positions lowercased over RESP
+    uint32_t log_args;  // a write is logged as its first N arguments
+};
+
+// The commands, also counted by `stats` in this order, followed by the
+// others. The handlers check the arguments beyond their number.
+static constexpr Cmd k_cmds[] = {
+    {"get", do_get, 2, 2, CMD_KEY, 0, 0},
+    // without `ex`/`px`, which also removes the TTL
+    {"set", do_set, 3, 5, CMD_WRITE | CMD_GROW | CMD_KEY | CMD_LOG_TTL, 1 << 3, 3},
+    {"del", do_del, 2, 2, CMD_WRITE | CMD_KEY, 0, k_log_all},
+    {"mget", do_mget, 2, 0, CMD_KEY | CMD_KEYS | CMD_CONCAT, 0, 0},
+    {"mset", do_mset, 3, 0, CMD_WRITE | CMD_GROW | CMD_KEY | CMD_PAIRS, 0, k_log_all},
+    {"mdel", do_mdel, 2, 0, CMD_WRITE | CMD_KEY | CMD_KEYS | CMD_SUM, 0, k_log_all},
+    {"expire", do_expire, 3, 3, CMD_WRITE | CMD_KEY | CMD_LOG_TTL, 0, 0},
+    {"pexpire", do_pexpire, 3, 3, CMD_WRITE | CMD_KEY | CMD_LOG_TTL, 0, 0},
+    {"pexpireat", do_pexpireat, 3, 3, CMD_WRITE | CMD_KEY | CMD_LOG_TTL, 0, 0},
+    {"ttl", do_ttl, 2, 2, CMD_KEY, 0, 0},
+    {"pttl", do_pttl, 2, 2, CMD_KEY, 0, 0},
+    {"zadd", do_zadd, 4, 4, CMD_WRITE | CMD_GROW | CMD_KEY, 0, k_log_all},
+    {"zrem", do_zrem, 3, 3, CMD_WRITE | CMD_KEY, 0, k_log_all},
+    {"zscore", do_zscore, 3, 3, CMD_KEY, 0, 0},
+    {"zrank", do_zrank, 3, 3, CMD_KEY, 0, 0},
+    {"zcard", do_zcard, 2, 2, CMD_KEY, 0, 0},
+    {"zrange", do_zrange, 4, 5, CMD_KEY, 1 << 4, 0},
+    {"memstats", do_memstats, 1, 1, 0, 0, 0},
+    {"stats", do_stats, 1, 2, 0, 1 << 1, 0},
+    {"bgrewriteaof", do_bgrewriteaof, 1, 1, 0, 0, 0},
+    {"bgsave", do_bgsave, 1, 1, 0, 0, 0},
+    {"slowlog", do_slowlog, 2, 3, 0, 1 << 1, 0},
+    {"trace", do_trace, 1, 2, 0, 1 << 1, 0},
+    {"scan", do_scan, 2, 0, CMD_CURSOR, 1 << 2 | 1 << 4, 0},
+    {"cluster", do_cluster, 2, 0, CMD_SLOT, 1 << 1, 0},
+    // by `shard_flush()` in each shard
+    {"flushall", do_flushall, 1, 2, CMD_WRITE | CMD_LOG_SELF | CMD_ALL, 1 << 1, 0},
+    {"ping", do_ping, 1, 2, 0, 0, 0},
+    {"info", do_stats, 1, 2, 0, 1 << 1, 0},
+    {"echo", do_echo, 2, 2, 0, 0, 0},
+    {"select", do_select, 2, 2, 0, 0, 0},
+    {"hello", do_hello, 1, 0, 0, 0, 0},
+    {"asking", do_asking, 1, 1, 0, 0, 0},
+};
+const size_t k_ncmd = sizeof(k_cmds) / sizeof(k_cmds[0]) + 1;  // and the others
+
+// a write that logs nothing would be lost by a restart or a replica
+constexpr bool cmd_logs_ok() {
+    for (const Cmd &c : k_cmds) {
+        bool logged = c.log_args || (c.flags & (CMD_LOG_TTL | CMD_LOG_SELF));
+        if ((c.flags & CMD_WRITE) && !logged) {
+            return false;
         }
-        conn->want_close = true;
-        return; // want close
     }
-    // got some new data
-    buf_append(conn->incoming, buf, (size_t)rv);
+    return true;
+}
+static_assert(cmd_logs_ok(), "a write command is not logged");
 
-    // parse requests and generate responses
-    while (try_one_request(conn)) {}
-    // Q: Why calling this in a loop? See the explanation of "pipelining".
+static std::string_view cmd_stat_name(size_t c) {
+    return c + 1 < k_ncmd ? k_cmds[c].name : "other";
+}
 
-    // update the readiness intention
-    if (conn->outgoing.size() > 0) {    // has a response
-        conn->want_read = false;
-        conn->want_write = true;
-        // update epoll before trying to write
-        conn_update_epoll(epoll_fd, conn);
-        // The socket is likely ready to write in a request-response protocol,
-        // try to write it without waiting for the next iteration.
-        return handle_write(epoll_fd, conn);
-    }   // else: want read
+// The names are found with a perfect hash: the seed is searched for at
+// compile time, so that each name has a slot of its own and a lookup is
+// a hash and a comparison.
+const size_t k_cmd_slots = 256;
+
+constexpr uint32_t cmd_hash(std::string_view name, uint32_t seed) {
+    uint32_t h = seed;
+    for (char c : name) {
+        h = (h ^ (uint8_t)c) * 16777619u;   // FNV-1a
+    }
+    return h & (k_cmd_slots - 1);
 }
 
-int main() {
-    // the listening socket
-    int fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (fd < 0) {
-        die("socket()");
+constexpr bool cmd_seed_ok(uint32_t seed) {
+    bool used[k_cmd_slots] = {};
+    for (const Cmd &c : k_cmds) {
+        uint32_t h = cmd_hash(c.name, seed);
+        if (used[h]) {
+            return false;
+        }
+        used[h] = true;
     }
-    int val = 1;
-    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+    return true;
+}
 
-    // bind
-    struct sockaddr_in addr = {};
-    addr.sin_family = AF_INET;
-    addr.sin_port = ntohs(1234);
-    addr.sin_addr.s_addr = ntohl(0);    // wildcard address 0.0.0.0
-    int rv = bind(fd, (const sockaddr *)&addr, sizeof(addr));
-    if (rv) {
-        die("bind()");
+constexpr uint32_t cmd_find_seed() {
+    uint32_t seed = 2166136261u;
+    while (!cmd_seed_ok(seed)) {
+        seed++;
     }
+    return seed;
+}
 
-    // set the listen fd to nonblocking mode
-    fd_set_nb(fd);
+static constexpr uint32_t k_cmd_seed = cmd_find_seed();
 
-    // listen
-    rv = listen(fd, SOMAXCONN);
-    if (rv) {
-        die("listen()");
-    }
+struct CmdSlots {
+    uint8_t idx[k_cmd_slots];   // into `k_cmds`, 0xFF for none
+};
 
-    // create epoll instance
-    int epoll_fd = epoll_create1(0);
-    if (epoll_fd < 0) {
-        die("epoll_create1()");
+constexpr CmdSlots cmd_make_slots() {
+    CmdSlots slots = {};
+    for (size_t i = 0; i < k_cmd_slots; i++) {
+        slots.idx[i] = 0xFF;
     }
+    for (size_t i = 0; i + 1 < k_ncmd; i++) {
+        slots.idx[cmd_hash(k_cmds[i].name, k_cmd_seed)] = (uint8_t)i;
+    }
+    return slots;
+}
 
-    // add the listening socket to epoll
-    struct epoll_event ev = {};
-    ev.events = EPOLLIN;
-    ev.data.fd = fd;  // use fd directly for the listening socket
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
-        die("epoll_ctl() for listening socket");
+static constexpr CmdSlots k_cmd_index = cmd_make_slots();
+static_assert(k_ncmd <= 0xFF, "too many commands for the slots");
+
+// NULL for an unknown command
+static const Cmd *cmd_lookup(std::string_view name) {
+    uint8_t i = k_cmd_index.idx[cmd_hash(name, k_cmd_seed)];
+    return i != 0xFF && k_cmds[i].name == name ? &k_cmds[i] : NULL;
+}
+
+struct CmdStats {
+    std::atomic<uint64_t> calls{0};
+    std::atomic<uint64_t> ops_sec{0};   // calls in the last second
+    uint64_t calls_last = 0;            // at the start of that second
+    Hist time_ns;                       // in `do_request()`
+};
+
+// a request that took longer than `--slowlog-us`
+struct SlowEntry {
+    uint64_t id = 0;
+    uint64_t time_ms = 0;   // wall clock
+    uint64_t dur_ns = 0;    // in `do_request()`
+    std::string args;       // printable, truncated
+};
+
+struct Worker;
+
+// A full resync of a replica, from a snapshot taken by the shard's worker
+// into a memfd. It's shared with the worker that holds the link.
+struct ReplSync {
+    Worker *origin = NULL;          // holds the link, woken when it's done
+    std::atomic<bool> done{false};  // the fields below are set
+    int fd = -1;                    // the snapshot, -1 if it failed
+    size_t size = 0;
+    uint64_t offset = 0;            // where the stream continues after it
+    ~ReplSync() {
+        if (fd >= 0) {
+            close(fd);
+        }
     }
+};
+
+// a replica streaming one shard, from any worker
+struct ReplLink {
+    Worker *shard = NULL;
+    uint64_t pos = 0;       // the stream offset of the next byte to send
+    uint64_t ack = 0;       // applied by the replica, see `repl_ack()`
+    std::shared_ptr<ReplSync> sync;     // sending the snapshot first
+    size_t sync_pos = 0;
+};
 
+// an event loop thread. Each worker owns its own epoll instance,
+// its own listening socket, and a disjoint shard of the keyspace.
+struct Worker {
+    size_t id = 0;
+    int epoll_fd = -1;
+    int listen_fd = -1;
+    int wake_fd = -1;   // eventfd, signaled when the inbox becomes non-empty
+    // lock-free MPSC stack of messages from other workers
+    std::atomic<Forward *> inbox{NULL};
+    std::vector<Forward *> fwd_free;    // spare, see `forward_new()`
     // a map of all client connections, keyed by fd
     std::vector<Conn *> fd2conn;
-    
-    // events buffer for epoll_wait
-    const int k_max_events = 10000;
-    struct epoll_event events[k_max_events];
-    
-    // the event loop
+    // counters, only written by the worker itself
+    std::atomic<uint64_t> epoll_ctl_mod{0};     // calls to update the interests
+    std::atomic<uint64_t> epoll_ctl_saved{0};   // updates skipped, nothing changed
+    std::atomic<uint64_t> rehash_count{0};      // db resizes, see `rehash_step()`
+    std::atomic<uint64_t> rehash_live_ms{0};    // time with 2 tables, when done
+    std::atomic<uint64_t> rehash_idle_keys{0};  // moved while idle
+    std::atomic<uint64_t> rehash_pending{0};    // keys left in the older table
+    std::atomic<uint64_t> db_keys{0};
+    std::atomic<uint64_t> db_slots{0};
+    std::atomic<uint64_t> bytes_in{0};
+    std::atomic<uint64_t> bytes_out{0};
+    std::atomic<uint64_t> sink_bytes{0};    // received into blobs, see `conn_sink()`
+    std::atomic<uint64_t> wakeups{0};   // returns from `epoll_wait()` or `io_uring_enter()`
+    std::atomic<uint64_t> events{0};    // the events or completions they returned
+    std::atomic<uint64_t> idle_closed{0};   // by `--idle-timeout`
+    Hist pipeline;                      // requests per `conn_process()`
+    CmdStats cmds[k_ncmd];
+    PoolStats *pool = NULL;             // the thread-local pool counters
+    // the slowlog and the finished traces, newest first, read by any worker
+    std::mutex log_lock;
+    std::deque<SlowEntry> slowlog;
+    uint64_t slowlog_next = 0;
+    std::deque<Trace> traces;
+    // the io_uring backend, used instead of `epoll_fd`
+    URing ring;
+    UBufs pbuf;         // provided buffers for the multishot receives
+    // the append-only file of this shard, see `aof_flush()`
+    int aof_fd = -1;
+    Buffer aof_buf;             // the writes of this loop iteration
+    size_t aof_size = 0;        // of the file
+    size_t aof_base_size = 0;   // after the last rewrite
+    std::vector<Forward *> aof_replies; // held until the log is synced
+    std::vector<Conn *> aof_waiting;    // ditto
+    pid_t aof_child = -1;       // the rewrite in progress
+    Buffer aof_rwbuf;           // the writes since the child forked
+    std::atomic<bool> aof_rewrite{false};   // requested by `bgrewriteaof`
+    // shared with the background thread
+    std::mutex aof_lock;        // protects `aof_fd` swaps and `aof_old_fd`
+    std::atomic<bool> aof_dirty{false};     // written since the last fsync
+    int aof_old_fd = -1;        // replaced by a rewrite, closed in the background
+    // snapshot, see `snap_save_child()`
+    pid_t snap_child = -1;
+    std::atomic<uint64_t> snap_gen{0};  // requested by `bgsave`, 0 for none
+    // replication, the primary side. The stream of this shard is the same
+    // records as the AOF, the last `--repl-backlog` bytes are kept in the
+    // ring for the workers that hold the links, see `repl_fill()`.
+    std::mutex repl_lock;                   // protects the ring and the syncs
+    std::vector<uint8_t> repl_ring;
+    std::atomic<uint64_t> repl_offset{0};   // the end of the stream
+    std::atomic<bool> repl_on{false};       // recorded since the first `psync`
+    std::vector<std::shared_ptr<ReplSync>> repl_syncs;  // the next snapshot
+    std::vector<std::shared_ptr<ReplSync>> repl_forked; // the one in progress
+    pid_t repl_child = -1;
+    int repl_memfd = -1;
+    uint64_t repl_child_offset = 0;
+    std::vector<Conn *> repl_conns;         // the links held by this worker
+    std::atomic<uint64_t> repl_links{0};
+    std::atomic<uint64_t> repl_lag_bytes{0};        // not acked by their replicas
+    std::atomic<uint64_t> repl_full_syncs{0};
+    std::atomic<uint64_t> repl_partial_syncs{0};
+    // the replica side, see `repl_run()`
+    std::atomic<uint64_t> repl_queued{0};   // received, not applied yet
+    std::atomic<uint64_t> repl_applied{0};  // the stream offset
+    std::atomic<uint64_t> repl_link_up{0};
+    std::atomic<uint64_t> repl_lag_ms{0};   // of the last `replping`
+    std::atomic<uint64_t> lazy_pending{0};  // see `lazy_step()`
+    std::atomic<uint64_t> lazy_objects{0};  // freed by the background thread
+    // cluster mode, see `migrate_step()`
+    std::atomic<uint64_t> migrated_keys{0};
+    // see `evict_step()`
+    std::atomic<uint64_t> used_memory{0};
+    std::atomic<uint64_t> evicted_keys{0};
+    std::thread thread;
+};
+
+// all workers, immutable after startup
+static std::vector<Worker *> g_workers;
+
+static void worker_wake(Worker *w) {
+    uint64_t one = 1;
+    if (write(w->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        msg_errno("eventfd write() error");
+    }
+}
+
+// the event loop backend, epoll unless `--io uring`
+static bool g_uring = false;
+
+// a dropped table, its keys are freed in steps, see `lazy_step()`
+struct LazyTable {
+    HMap map;
+    size_t pos = 0;     // see `hm_drain()`
+};
+
+// per-worker states
+static thread_local struct {
+    HMap db;    // top-level hashtable, only the keys owned by this shard
+    Worker *worker = NULL;
+    // timers
+    uint64_t now_ms = 0;            // monotonic, updated once per loop iteration
+    std::vector<HeapItem> heap;     // TTLs of the keys, the earliest first
+    DList idle_list;                // connections, the least recently active first
+    DList ready_list;               // connections with requests left over
+    uint64_t iter = 0;              // loop iterations
+    // resizing, see `rehash_step()`
+    uint64_t nreq = 0;              // requests in this loop iteration
+    bool rehashing = false;
+    uint64_t rehash_since_ms = 0;
+    uint64_t stats_tick_ms = 0;     // the last update of the rates
+    // tracing, see `trace_sample()`
+    uint64_t read_tsc = 0;          // of the last read
+    uint64_t trace_countdown = 0;   // requests until the next sample
+    // replication
+    bool repl_applying = false;     // the writes come from the primary
+    uint64_t repl_ping_ms = 0;      // the last `replping` into the stream
+    // cluster mode
+    std::vector<DList> slot_keys;   // the keys of each slot, see `db_insert()`
+    std::vector<uint32_t> slot_nkeys;
+    bool asking = false;            // the request follows an `asking`
+    int migrate_slot = -1;          // moving away, see `migrate_step()`
+    int migrate_fd = -1;            // to the target node
+    // eviction, see `evict_step()`
+    size_t mem_used = 0;            // of the pairs, see `shard_mem()`
+    uint64_t rand_state = 0;        // see `rand_u64()`
+    bool loading = false;           // replaying the AOF
+    // lazy freeing, see `lazy_step()`
+    std::vector<LazyTable> lazy_dbs;
+    std::vector<ZSet *> lazy_zsets;
+    // the blob an argument of this request was received into, see `conn_sink()`
+    Blob *req_blob = NULL;
+} g_data;
+
+// 0 disables the idle timeout
+static uint64_t g_idle_timeout_ms = 300 * 1000;
+
+static uint64_t get_monotonic_nsec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000000 + tv.tv_nsec;
+}
+
+// a timestamp for the traces, TSC cycles on x86, nanoseconds otherwise
+static uint64_t cycles_now() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return get_monotonic_nsec();
+#endif
+}
+
+static uint64_t get_monotonic_usec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000000 + tv.tv_nsec / 1000;
+}
+
+static uint64_t get_monotonic_msec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return uint64_t(tv.tv_sec) * 1000 + tv.tv_nsec / 1000 / 1000;
+}
+
+// the wall clock, for the TTLs saved to disk
+static uint64_t get_realtime_msec() {
+    struct timespec tv = {0, 0};
+    clock_gettime(CLOCK_REALTIME, &tv);
+    return uint64_t(tv.tv_sec) * 1000 + tv.tv_nsec / 1000 / 1000;
+}
+
+// a request executed by the shard that owns its key on behalf of a
+// connection in another worker. It travels origin -> owner -> origin.
+struct Forward {
+    Forward *next = NULL;   // inbox link
+    Worker *origin = NULL;
+    Conn *conn = NULL;
+    bool done = false;      // `resp` is ready, only touched by the origin
+    std::vector<uint8_t> req;   // a copy of the request body, parsed by the owner
+    Buffer resp;                // the serialized response
+    // from the replication thread, without an origin, see `repl_apply()`
+    uint32_t repl = 0;
+    uint32_t nrec = 0;          // REPL_CHUNK: records in `req`
+    uint64_t repl_offset = 0;   // REPL_STREAM: the offset after `req`
+    bool asking = false;        // after an `asking` of the connection
+    uint8_t proto = PROTO_BINARY;   // of the response
+    // a `CMD_ALL` request is answered by the origin once every part is back
+    Forward *whole = NULL;      // of a part
+    uint32_t parts = 0;         // of the whole, not replied yet
+    // a batch split by `conn_split()`, answered by `split_merge()`
+    const Cmd *split = NULL;
+    std::vector<uint32_t> key_shards;   // of each key in the request order
+    std::vector<Forward *> split_parts; // by shard, NULL for none
+};
+
+// Cluster mode, `--cluster HOST:PORT`: the keyspace is split into
+// `k_nslots` hash slots by the CRC-32C of the key, or of its `{tag}`, so
+// that all nodes agree on them whatever their `--hash-seed`. The slot map
+// tells which node serves each slot, node 0 being this one under the
+// address it was started with. The map is shared by the workers: the
+// node list only grows, and a slot holds an atomic index into it.
+const size_t k_nslots = 16384;
+const size_t k_max_nodes = 1024;
+static bool g_cluster = false;
+static std::string g_nodes[k_max_nodes];    // HOST:PORT, published before use
+static std::atomic<uint32_t> g_nnodes{1};
+static std::mutex g_nodes_lock;             // for adding nodes
+static std::atomic<uint16_t> g_slot_node[k_nslots];         // the owner
+static std::atomic<uint16_t> g_slot_migrating[k_nslots];    // target + 1, or 0
+
+// `{tag}` of a key if it has one. Keys sharing a tag are kept together,
+// like the hash tags of Redis Cluster.
+static std::string_view key_tag(std::string_view key) {
+    size_t l = key.find('{');
+    if (l != key.npos) {
+        size_t r = key.find('}', l + 1);
+        if (r != key.npos && r > l + 1) {
+            key = key.substr(l + 1, r - l - 1);
+        }
+    }
+    return key;
+}
+
+static uint32_t key_slot(std::string_view key) {
+    key = key_tag(key);
+    return crc32c(0, (const uint8_t *)key.data(), key.size()) & (k_nslots - 1);
+}
+
+// the node index of an address, added if new, -1 if the list is full
+static int cluster_node(std::string_view addr) {
+    std::lock_guard<std::mutex> guard(g_nodes_lock);
+    uint32_t n = g_nnodes.load(std::memory_order_relaxed);
+    for (uint32_t i = 0; i < n; i++) {
+        if (g_nodes[i] == addr) {
+            return (int)i;
+        }
+    }
+    if (n == k_max_nodes) {
+        return -1;
+    }
+    g_nodes[n] = std::string(addr);
+    g_nnodes.store(n + 1, std::memory_order_release);
+    return (int)n;
+}
+
+// value types
+enum {
+    T_STR = 0,      // string
+    T_ZSET = 1,     // sorted set
+};
+
+// KV pair for the top-level hashtable
+// allocated from the slab with the key stored right after the header,
+// followed by the string value when it fits in the rest of the size class.
+// Values of `k_blob_min` or more are always in a separate `Blob`.
+// In cluster mode the object starts with the `DList` linking the key into
+// `g_data.slot_keys[slot]`, see `db_insert()`, which the others don't pay for.
+struct Entry {
+    struct HNode node;  // hashtable node
+    uint16_t type = T_STR;
+    uint16_t slot = 0;      // cluster mode, in the padding before `klen`
+    uint32_t klen = 0;
+    // T_STR
+    uint32_t vlen = 0;
+    uint32_t vcap = 0;      // capacity of the value storage
+    uint32_t icap = 0;      // capacity of the inline value storage
+    uint32_t access = 0;    // for the eviction, see `entry_touch()`
+    union {
+        uint8_t *val = NULL;    // the inline storage, or a separate allocation
+        ZSet *zset;             // T_ZSET
+    };
+    size_t heap_idx = -1;   // position in the TTL heap, -1 if no TTL
+};
+
+// the bytes before the `Entry` in its slab object
+static size_t entry_prefix() {
+    return g_cluster ? sizeof(DList) : 0;
+}
+
+// cluster mode only
+static DList *entry_slot_node(Entry *ent) {
+    return (DList *)ent - 1;
+}
+
+static Entry *slot_node_entry(DList *node) {
+    return (Entry *)(node + 1);
+}
+
+static uint8_t *entry_inline(Entry *ent) {
+    return (uint8_t *)(ent + 1) + ent->klen;
+}
+
+static std::string_view entry_key(const Entry *ent) {
+    return std::string_view((const char *)(ent + 1), ent->klen);
+}
+
+static std::string_view entry_val(const Entry *ent) {
+    return std::string_view((const char *)ent->val, ent->vlen);
+}
+
+// a separate allocation is a blob if it's large enough
+static Blob *entry_blob(Entry *ent) {
+    if (ent->val == entry_inline(ent) || ent->vcap < k_blob_min) {
+        return NULL;
+    }
+    return (Blob *)ent->val - 1;
+}
+
+static void entry_free_val(Entry *ent) {
+    if (ent->val != entry_inline(ent)) {
+        g_data.mem_used -= ent->vcap;
+    }
+    if (Blob *blob = entry_blob(ent)) {
+        blob_unref(blob);
+    } else if (ent->val != entry_inline(ent)) {
+        slab_free(ent->val, ent->vcap);
+    }
+}
+
+// the blob `val` was received into, if it was, see `conn_sink()`
+static Blob *req_blob_of(std::string_view val) {
+    Blob *blob = g_data.req_blob;
+    bool same = blob && (const uint8_t *)val.data() == blob_data(blob)
+        && val.size() == blob->cap;
+    return same ? blob : NULL;
+}
+
+static void entry_set_val(Entry *ent, std::string_view val) {
+    uint8_t *inl = entry_inline(ent);
+    Blob *blob = entry_blob(ent);
+    Blob *req = req_blob_of(val);   // taken over rather than copied
+    if (val.size() <= ent->icap) {
+        // move back inline
+        if (ent->val != inl) {
+            entry_free_val(ent);
+            ent->val = inl;
+            ent->vcap = ent->icap;
+        }
+    } else if (req || ent->val == inl || val.size() > ent->vcap
+        || val.size() * 2 <= ent->vcap || (blob && blob->refs > 1))
+    {
+        // a separate allocation, reused while it is not too oversized,
+        // and not while a response is still sending it (copy-on-write)
+        entry_free_val(ent);
+        if (req) {
+            req->refs++;
+            ent->vcap = req->cap;
+            ent->val = blob_data(req);
+        } else if (val.size() >= k_blob_min) {
+            blob = blob_new(val.size());
+            ent->vcap = blob->cap;
+            ent->val = blob_data(blob);
+        } else {
+            ent->vcap = (uint32_t)slab_usable(val.size());
+            ent->val = (uint8_t *)slab_alloc(ent->vcap);
+        }
+        g_data.mem_used += ent->vcap;
+    }
+    if (val.size() && !req) {
+        memcpy(ent->val, val.data(), val.size());
+    }
+    ent->vlen = (uint32_t)val.size();
+}
+
+static Entry *entry_new(std::string_view key, std::string_view val) {
+    size_t inl = val.size() < k_blob_min ? val.size() : 0;
+    size_t pre = entry_prefix();
+    size_t size = slab_usable(pre + sizeof(Entry) + key.size() + inl);
+    uint8_t *obj = (uint8_t *)slab_alloc(size);
+    Entry *ent = new (obj + pre) Entry();
+    g_data.mem_used += size;
+    ent->klen = (uint32_t)key.size();
+    ent->icap = (uint32_t)(size - pre - sizeof(Entry) - key.size());
+    ent->val = entry_inline(ent);
+    ent->vcap = ent->icap;
+    if (pre) {
+        dlist_init(entry_slot_node(ent));
+    }
+    memcpy(ent + 1, key.data(), key.size());
+    entry_set_val(ent, val);
+    return ent;
+}
+
+static void heap_delete(std::vector<HeapItem> &a, size_t pos) {
+    // swap the erased item with the last item
+    a[pos] = a.back();
+    a.pop_back();
+    // update the swapped item
+    if (pos < a.size()) {
+        heap_update(a.data(), pos, a.size());
+    }
+}
+
+static void heap_upsert(std::vector<HeapItem> &a, size_t pos, HeapItem t) {
+    if (pos < a.size()) {
+        a[pos] = t;         // update an existing item
+    } else {
+        pos = a.size();
+        a.push_back(t);     // or add a new item
+    }
+    heap_update(a.data(), pos, a.size());
+}
+
+// set or remove the TTL
+static void entry_set_ttl(Entry *ent, int64_t ttl_ms) {
+    if (ttl_ms < 0 && ent->heap_idx != (size_t)-1) {
+        // setting a negative TTL means removing the TTL
+        heap_delete(g_data.heap, ent->heap_idx);
+        ent->heap_idx = -1;
+    } else if (ttl_ms >= 0) {
+        // add or update the heap data structure
+        uint64_t expire_at = g_data.now_ms + (uint64_t)ttl_ms;
+        HeapItem item = {expire_at, &ent->heap_idx};
+        heap_upsert(g_data.heap, ent->heap_idx, item);
+    }
+}
+
+static bool entry_expired(const Entry *ent) {
+    return ent->heap_idx != (size_t)-1
+        && g_data.heap[ent->heap_idx].val <= g_data.now_ms;
+}
+
+// sets this large are freed in steps, see `lazy_step()`
+const size_t k_lazy_min_members = 1024;
+
+// turn the value back into an empty string
+static void entry_reset(Entry *ent) {
+    if (ent->type == T_ZSET) {
+        g_data.mem_used -= sizeof(ZSet) + ent->zset->bytes;
+        if (zset_size(ent->zset) >= k_lazy_min_members) {
+            g_data.lazy_zsets.push_back(ent->zset);
+        } else {
+            zset_clear(ent->zset);
+            delete ent->zset;
+        }
+        ent->type = T_STR;
+        ent->val = entry_inline(ent);
+        ent->vcap = ent->icap;
+        ent->vlen = 0;
+    }
+}
+
+static void entry_del(Entry *ent) {
+    size_t pre = entry_prefix();
+    if (pre && !dlist_empty(entry_slot_node(ent))) {
+        dlist_detach(entry_slot_node(ent));
+        g_data.slot_nkeys[ent->slot]--;
+    }
+    entry_set_ttl(ent, -1);     // remove from the heap
+    entry_reset(ent);
+    entry_free_val(ent);
+    size_t size = pre + sizeof(Entry) + ent->klen + ent->icap;
+    g_data.mem_used -= size;
+    ent->~Entry();
+    slab_free((uint8_t *)ent - pre, size);
+}
+
+// the zset nodes are counted by the set itself
+static void entry_make_zset(Entry *ent) {
+    ent->type = T_ZSET;
+    ent->zset = new ZSet();
+    g_data.mem_used += sizeof(ZSet);
+}
+
+static bool entry_zadd(Entry *ent, std::string_view name, double score) {
+    size_t bytes = ent->zset->bytes;
+    bool added = zset_insert(ent->zset, name, score);
+    g_data.mem_used += ent->zset->bytes - bytes;
+    return added;
+}
+
+static void entry_zrem(Entry *ent, ZNode *znode) {
+    size_t bytes = ent->zset->bytes;
+    zset_delete(ent->zset, znode);
+    g_data.mem_used -= bytes - ent->zset->bytes;
+}
+
+// Eviction, `--maxmemory`: each shard keeps under its share of the limit
+// by evicting keys, sampled like in Redis. The memory is what the pairs
+// allocated from the slab, plus the slots of the table and the TTL heap.
+enum {
+    EVICT_NO = 0,   // refuse the writes that add data instead
+    EVICT_LRU = 1,  // the least recently used of the samples
+    EVICT_LFU = 2,  // the least frequently used of the samples
+};
+static int g_evict_policy = EVICT_NO;
+static size_t g_maxmemory = 0;      // 0 for no limit
+static size_t g_shard_maxmemory = 0;
+
+static size_t shard_mem() {
+    return g_data.mem_used + hm_bytes(&g_data.db)
+        + g_data.heap.capacity() * sizeof(HeapItem);
+}
+
+static bool mem_over() {
+    return g_shard_maxmemory && shard_mem() > g_shard_maxmemory;
+}
+
+// splitmix64
+static uint64_t rand_u64() {
+    uint64_t z = (g_data.rand_state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+// LRU: `Entry::access` is the time of the last access, in 16ms ticks
+const uint64_t k_lru_tick_ms = 16;
+
+static uint32_t lru_clock() {
+    return (uint32_t)(g_data.now_ms / k_lru_tick_ms);
+}
+
+// LFU: `Entry::access` is | minutes (16 bits) | counter (8 bits) |.
+// The counter grows logarithmically, like in Redis: the chance of an
+// increment is 1 / ((counter - init) * factor + 1), so factor 10 takes
+// about a million accesses to 255. It decays by 1 for each idle minute,
+// and starts from `init` so that a new key isn't evicted right away.
+const uint32_t k_lfu_init = 5;
+const uint32_t k_lfu_log_factor = 10;
+const uint64_t k_lfu_decay_ms = 60 * 1000;
+
+static uint32_t lfu_minutes() {
+    return (uint32_t)(g_data.now_ms / k_lfu_decay_ms) & 0xFFFF;
+}
+
+static uint32_t lfu_counter(const Entry *ent) {
+    uint32_t idle = (lfu_minutes() - (ent->access >> 8)) & 0xFFFF;
+    uint32_t counter = ent->access & 0xFF;
+    return idle < counter ? counter - idle : 0;
+}
+
+static void entry_touch(Entry *ent) {
+    if (g_evict_policy == EVICT_LRU) {
+        ent->access = lru_clock();
+    } else if (g_evict_policy == EVICT_LFU) {
+        uint32_t counter = lfu_counter(ent);
+        uint32_t base = counter > k_lfu_init ? counter - k_lfu_init : 0;
+        if (counter < 255 && rand_u64() % (base * k_lfu_log_factor + 1) == 0) {
+            counter++;
+        }
+        ent->access = lfu_minutes() << 8 | counter;
+    }
+}
+
+// the higher the better to evict
+static uint64_t evict_score(const Entry *ent) {
+    if (entry_expired(ent)) {
+        return UINT64_MAX;
+    }
+    if (g_evict_policy == EVICT_LRU) {
+        return (uint32_t)(lru_clock() - ent->access);  // the idle time
+    }
+    return 255 - lfu_counter(ent);
+}
+
+// the top-level hashtable: `Entry` looked up by a view of the key
+struct EntryTraits {
+    typedef ::Entry Entry;
+    typedef std::string_view Key;
+    static Entry *entry(HNode *node) {
+        return container_of(node, Entry, node);
+    }
+    static uint64_t hash(std::string_view key) {
+        return str_hash((const uint8_t *)key.data(), key.size());
+    }
+    // compares the length in the header before touching the key bytes
+    static bool eq(const Entry *ent, std::string_view key) {
+        return entry_key(ent) == key;
+    }
+};
+
+// add a new pair, and in cluster mode index it by slot, so that a slot
+// can be listed or migrated without a scan of the table
+static void db_insert(Entry *ent) {
+    if (g_evict_policy == EVICT_LFU) {
+        ent->access = lfu_minutes() << 8 | k_lfu_init;
+    } else {
+        ent->access = lru_clock();
+    }
+    hm_insert(&g_data.db, &ent->node);
+    if (g_cluster) {
+        ent->slot = (uint16_t)key_slot(entry_key(ent));
+        dlist_insert_before(&g_data.slot_keys[ent->slot], entry_slot_node(ent));
+        g_data.slot_nkeys[ent->slot]++;
+    }
+}
+
+// remove and free a pair found earlier, by identity rather than by key
+static void db_remove(Entry *ent) {
+    HNode *node = hm_remove(&g_data.db, ent->node.hcode,
+        [&](HNode *cur) { return cur == &ent->node; });
+    assert(node == &ent->node);
+    (void)node;
+    entry_del(ent);
+}
+
+// expired keys are treated as missing even before the timer removes them
+static Entry *db_lookup(std::string_view key, uint64_t hcode) {
+    Entry *ent = hm_lookup<EntryTraits>(&g_data.db, key, hcode);
+    if (ent && entry_expired(ent)) {
+        db_remove(ent);
+        return NULL;
+    }
+    if (ent) {
+        entry_touch(ent);
+    }
+    return ent;
+}
+
+// the only place where request bytes are copied: into the stored pair.
+// Like Redis, setting a value also replaces its TTL, -1 for none.
+static void db_set(std::string_view key, std::string_view val, uint64_t hcode,
+    int64_t ttl_ms = -1)
+{
+    // hashtable lookup
+    Entry *ent = db_lookup(key, hcode);
+    if (ent) {
+        // found, update the value, reusing its storage
+        entry_reset(ent);
+        entry_set_val(ent, val);
+    } else {
+        // not found, allocate & insert a new pair
+        ent = entry_new(key, val);
+        ent->node.hcode = hcode;
+        db_insert(ent);
+    }
+    entry_set_ttl(ent, ttl_ms);
+}
+
+static bool db_del(std::string_view key, uint64_t hcode) {
+    // hashtable delete
+    Entry *ent = hm_delete<EntryTraits>(&g_data.db, key, hcode);
+    if (ent) {  // deallocate the pair
+        entry_del(ent);
+    }
+    return ent != NULL;
+}
+
+// Drop all keys of this shard: the table is swapped for an empty one,
+// and its keys are freed by `lazy_step()` later.
+static void db_flush() {
+    g_data.lazy_dbs.push_back(LazyTable{g_data.db, 0});
+    g_data.db = HMap{};
+    g_data.mem_used = 0;    // all of it was in the table
+    std::vector<HeapItem>().swap(g_data.heap);
+    for (DList &head : g_data.slot_keys) {
+        dlist_init(&head);
+    }
+    std::fill(g_data.slot_nkeys.begin(), g_data.slot_nkeys.end(), 0);
+}
+
+// Free up to about `n` keys or zset members of the dropped tables and
+// sets, and return the work done. The oldest go last, it doesn't matter.
+static size_t lazy_work(size_t n) {
+    const size_t k_batch = 256;
+    size_t done = 0;
+    while (done < n && !g_data.lazy_dbs.empty()) {
+        LazyTable &lt = g_data.lazy_dbs.back();
+        HNode *nodes[k_batch];
+        size_t k = hm_drain(&lt.map, &lt.pos, nodes, std::min(k_batch, n - done));
+        for (size_t i = 0; i < k; i++) {
+            // the heap and the slot lists were dropped with the table
+            Entry *ent = container_of(nodes[i], Entry, node);
+            ent->heap_idx = -1;
+            if (g_cluster) {
+                dlist_init(entry_slot_node(ent));
+            }
+            size_t mem = g_data.mem_used;
+            entry_del(ent);
+            g_data.mem_used = mem;  // not counted since `db_flush()`
+        }
+        done += k + 1;  // a call may only skip empty slots
+        if (hm_size(&lt.map) == 0) {
+            hm_clear_with(&lt.map, lazy_free);
+            g_data.lazy_dbs.pop_back();
+        }
+    }
+    while (done < n && !g_data.lazy_zsets.empty()) {
+        ZSet *zset = g_data.lazy_zsets.back();
+        done += zset_dispose(zset, n - done, lazy_free) + 1;
+        if (!zset->root) {
+            delete zset;
+            g_data.lazy_zsets.pop_back();
+        }
+    }
+    return done;
+}
+
+static bool lazy_due() {
+    return !g_data.lazy_dbs.empty() || !g_data.lazy_zsets.empty();
+}
+
+static void do_get(std::vector<std::string_view> &cmd, Response &out) {
+    Entry *ent = db_lookup(cmd[1], EntryTraits::hash(cmd[1]));
+    if (!ent) {
+        return out_status(out, RES_NX);
+    }
+    if (ent->type != T_STR) {
+        return out_err(out, "WRONGTYPE not a string value");
+    }
+    // copy the value, or reference its blob
+    std::string_view val = entry_val(ent);
+    assert(val.size() <= k_max_msg);
+    out_val(out, val, entry_blob(ent));
+}
+
+static bool str2int(std::string_view s, int64_t &out) {
+    const char *end = s.data() + s.size();
+    std::from_chars_result r = std::from_chars(s.data(), end, out);
+    return r.ec == std::errc() && r.ptr == end;
+}
+
+// set key value [ex seconds | px milliseconds]
+static void do_set(std::vector<std::string_view> &cmd, Response &out) {
+    if (cmd.size() == 4) {
+        return out_err(out, "expect set key value [ex|px n]");
+    }
+    int64_t ttl_ms = -1;
+    if (cmd.size() == 5) {
+        int64_t n = 0;
+        if (!str2int(cmd[4], n) || n <= 0 || n > INT64_MAX / 1000) {
+            return out_err(out, "expect positive int");
+        }
+        if (cmd[3] == "ex") {
+            ttl_ms = n * 1000;
+        } else if (cmd[3] == "px") {
+            ttl_ms = n;
+        } else {
+            return out_err(out, "expect ex or px");
+        }
+    }
+    db_set(cmd[1], cmd[2], EntryTraits::hash(cmd[1]), ttl_ms);
+}
+
+// Responds 1 if the key exists. Anything in the past expires it now.
+static void expire_key(std::string_view key, int64_t ttl_ms, Response &out) {
+    Entry *ent = db_lookup(key, EntryTraits::hash(key));
+    if (ent) {
+        entry_set_ttl(ent, ttl_ms < 0 ? 0 : ttl_ms);
+    }
+    out_int(out, ent ? 1 : 0);
+}
+
+// the times are saturated rather than overflowed
+static bool expire_arg(std::string_view arg, int64_t &n, Response &out) {
+    if (!str2int(arg, n) || n > INT64_MAX / 1000) {
+        out_err(out, "expect int");
+        return false;
+    }
+    return true;
+}
+
+// expire key seconds
+static void do_expire(std::vector<std::string_view> &cmd, Response &out) {
+    int64_t n = 0;
+    if (expire_arg(cmd[2], n, out)) {
+        expire_key(cmd[1], n < INT64_MIN / 1000 ? -1 : n * 1000, out);
+    }
+}
+
+// pexpire key milliseconds
+static void do_pexpire(std::vector<std::string_view> &cmd, Response &out) {
+    int64_t n = 0;
+    if (expire_arg(cmd[2], n, out)) {
+        expire_key(cmd[1], n, out);
+    }
+}
+
+// pexpireat key unix-ms
+static void do_pexpireat(std::vector<std::string_view> &cmd, Response &out) {
+    int64_t n = 0;
+    if (expire_arg(cmd[2], n, out)) {
+        expire_key(cmd[1], n < 0 ? -1 : n - (int64_t)get_realtime_msec(), out);
+    }
+}
+
+// the TTL in ms, -2 for no key, -1 for no TTL
+static int64_t key_pttl(std::string_view key) {
+    Entry *ent = db_lookup(key, EntryTraits::hash(key));
+    if (!ent) {
+        return -2;
+    }
+    if (ent->heap_idx == (size_t)-1) {
+        return -1;
+    }
+    uint64_t expire_at = g_data.heap[ent->heap_idx].val;
+    return (int64_t)(expire_at - g_data.now_ms);    // not expired yet
+}
+
+// ttl key, in seconds rounded up
+static void do_ttl(std::vector<std::string_view> &cmd, Response &out) {
+    int64_t ms = key_pttl(cmd[1]);
+    out_int(out, ms < 0 ? ms : (ms + 999) / 1000);
+}
+
+// pttl key
+static void do_pttl(std::vector<std::string_view> &cmd, Response &out) {
+    out_int(out, key_pttl(cmd[1]));
+}
+
+static void do_del(std::vector<std::string_view> &cmd, Response &) {
+    db_del(cmd[1], EntryTraits::hash(cmd[1]));
+}
+
+// keys are probed in windows: hash the keys of a window, prefetch
+// their slots, then their first nodes, then probe them one by one.
+// The cache misses of different keys overlap instead of adding up.
+const size_t k_batch_window = 16;
+
+// `fn(i, hcode)` for the keys `cmd[1]`, `cmd[1 + step]`, ...
+template <class F>
+static void for_each_key(std::vector<std::string_view> &cmd, size_t step, F fn) {
+    uint64_t hcodes[k_batch_window];
+    for (size_t base = 1; base < cmd.size(); base += step * k_batch_window) {
+        size_t n = 0;
+        for (size_t i = base; i < cmd.size() && n < k_batch_window; i += step) {
+            hcodes[n] = EntryTraits::hash(cmd[i]);
+            hm_prefetch(&g_data.db, hcodes[n]);
+            n++;
+        }
+        for (size_t j = 0; j < n; j++) {
+            hm_prefetch_node(&g_data.db, hcodes[j]);
+        }
+        for (size_t j = 0; j < n; j++) {
+            fn(base + j * step, hcodes[j]);
+        }
+    }
+}
+
+static void do_mget(std::vector<std::string_view> &cmd, Response &out) {
+    out_arr(out, (uint32_t)(cmd.size() - 1));
+    for_each_key(cmd, 1, [&](size_t i, uint64_t hcode) {
+        Entry *ent = db_lookup(cmd[i], hcode);
+        if (ent && ent->type == T_STR) {
+            out_bulk(out, entry_val(ent), entry_blob(ent));
+        } else {
+            out_nil(out);
+        }
+    });
+}
+
+static void do_mset(std::vector<std::string_view> &cmd, Response &out) {
+    if (cmd.size() % 2 == 0) {
+        return out_err(out, "expect mset key value [key value ...]");
+    }
+    for_each_key(cmd, 2, [&](size_t i, uint64_t hcode) {
+        db_set(cmd[i], cmd[i + 1], hcode);
+    });
+}
+
+// responds with the number of deleted keys
+static void do_mdel(std::vector<std::string_view> &cmd, Response &out) {
+    uint32_t ndel = 0;
+    for_each_key(cmd, 1, [&](size_t i, uint64_t hcode) {
+        ndel += db_del(cmd[i], hcode);
+    });
+    out_int(out, ndel);
+}
+
+static bool str2dbl(std::string_view s, double &out) {
+    const char *end = s.data() + s.size();
+    std::from_chars_result r = std::from_chars(s.data(), end, out);
+    return r.ec == std::errc() && r.ptr == end && !isnan(out);
+}
+
+// the sorted set of a key. NULL for no key, `ok` is false for a wrong type.
+static ZSet *expect_zset(std::string_view key, bool &ok) {
+    Entry *ent = db_lookup(key, EntryTraits::hash(key));
+    ok = !ent || ent->type == T_ZSET;
+    return ent && ok ? ent->zset : NULL;
+}
+
+// zadd zset score name. Responds 1 if the name is new.
+static void do_zadd(std::vector<std::string_view> &cmd, Response &out) {
+    double score = 0;
+    if (!str2dbl(cmd[2], score)) {
+        return out_err(out, "expect float");
+    }
+    // look up or create the zset
+    uint64_t hcode = EntryTraits::hash(cmd[1]);
+    Entry *ent = db_lookup(cmd[1], hcode);
+    if (!ent) {
+        ent = entry_new(cmd[1], "");
+        ent->node.hcode = hcode;
+        entry_make_zset(ent);
+        db_insert(ent);
+    } else if (ent->type != T_ZSET) {
+        return out_err(out, "WRONGTYPE expect zset");
+    }
+    bool added = entry_zadd(ent, cmd[3], score);
+    out_int(out, added ? 1 : 0);
+}
+
+// zrem zset name. Responds 1 if removed. The key goes away with the last name.
+static void do_zrem(std::vector<std::string_view> &cmd, Response &out) {
+    uint64_t hcode = EntryTraits::hash(cmd[1]);
+    Entry *ent = db_lookup(cmd[1], hcode);
+    if (ent && ent->type != T_ZSET) {
+        return out_err(out, "WRONGTYPE expect zset");
+    }
+    ZNode *znode = ent ? zset_lookup(ent->zset, cmd[2]) : NULL;
+    if (znode) {
+        entry_zrem(ent, znode);
+        if (zset_size(ent->zset) == 0) {
+            db_remove(ent);
+        }
+    }
+    out_int(out, znode ? 1 : 0);
+}
+
+// zscore zset name
+static void do_zscore(std::vector<std::string_view> &cmd, Response &out) {
+    bool ok = true;
+    ZSet *zset = expect_zset(cmd[1], ok);
+    if (!ok) {
+        return out_err(out, "WRONGTYPE expect zset");
+    }
+    ZNode *znode = zset ? zset_lookup(zset, cmd[2]) : NULL;
+    if (!znode) {
+        return out_status(out, RES_NX);
+    }
+    char text[32];
+    out_val(out, dbl2str(text, znode->score), NULL);
+}
+
+// zrank zset name. The rank is from 0, by (score, name).
+static void do_zrank(std::vector<std::string_view> &cmd, Response &out) {
+    bool ok = true;
+    ZSet *zset = expect_zset(cmd[1], ok);
+    if (!ok) {
+        return out_err(out, "WRONGTYPE expect zset");
+    }
+    ZNode *znode = zset ? zset_lookup(zset, cmd[2]) : NULL;
+    if (!znode) {
+        return out_status(out, RES_NX);
+    }
+    out_int(out, zset_rank(znode));
+}
+
+static void do_zcard(std::vector<std::string_view> &cmd, Response &out) {
+    bool ok = true;
+    ZSet *zset = expect_zset(cmd[1], ok);
+    if (!ok) {
+        return out_err(out, "WRONGTYPE expect zset");
+    }
+    out_int(out, zset ? (int64_t)zset_size(zset) : 0);
+}
+
+// zrange zset start stop [withscores]
+// Ranks are inclusive, negative ones count from the end, like in Redis.
+// Responds with an array of names, each followed by its score.
+static void do_zrange(std::vector<std::string_view> &cmd, Response &out) {
+    int64_t start = 0, stop = 0;
+    if (!str2int(cmd[2], start) || !str2int(cmd[3], stop)) {
+        return out_err(out, "expect int");
+    }
+    bool withscores = cmd.size() == 5;
+    if (withscores && cmd[4] != "withscores") {
+        return out_err(out, "expect withscores");
+    }
+    bool ok = true;
+    ZSet *zset = expect_zset(cmd[1], ok);
+    if (!ok) {
+        return out_err(out, "WRONGTYPE expect zset");
+    }
+    int64_t size = zset ? (int64_t)zset_size(zset) : 0;
+    if (start < 0) {
+        start = start + size < 0 ? 0 : start + size;
+    }
+    if (stop < 0) {
+        stop += size;
+    }
+    if (stop >= size) {
+        stop = size - 1;
+    }
+    int64_t n = start <= stop ? stop - start + 1 : 0;
+    // seek to the start, then walk in order
+    out_arr(out, (uint32_t)(withscores ? 2 * n : n));
+    ZNode *znode = n ? zset_at(zset, start) : NULL;
+    for (int64_t i = 0; i < n; i++) {
+        out_str(out, znode_name(znode));
+        if (withscores) {
+            out_dbl(out, znode->score);
+        }
+        znode = znode_offset(znode, +1);
+    }
+}
+
+static void do_memstats(std::vector<std::string_view> &, Response &out) {
+    std::string text;
+    slab_stats(text);
+    char line[64];
+    snprintf(line, sizeof(line), "entry header=%zu slot_link=%zu\n",
+        sizeof(Entry), entry_prefix());
+    text.append(line);
+    out_val(out, text, NULL);
+}
+
+// the counters summed over the workers, in the output order
+struct StatField {
+    const char *name;
+    bool counter;   // or a gauge
+    std::atomic<uint64_t> Worker::*field;
+    bool max = false;   // the largest of the workers, not the sum
+};
+
+static const StatField k_stat_fields[] = {
+    {"epoll_ctl_mod", true, &Worker::epoll_ctl_mod},
+    {"epoll_ctl_saved", true, &Worker::epoll_ctl_saved},
+    {"rehash_count", true, &Worker::rehash_count},
+    {"rehash_live_ms", true, &Worker::rehash_live_ms},
+    {"rehash_idle_keys", true, &Worker::rehash_idle_keys},
+    {"rehash_pending", false, &Worker::rehash_pending},
+    {"db_keys", false, &Worker::db_keys},
+    {"db_slots", false, &Worker::db_slots},
+    {"bytes_in", true, &Worker::bytes_in},
+    {"bytes_out", true, &Worker::bytes_out},
+    {"sink_bytes", true, &Worker::sink_bytes},
+    {"wakeups", true, &Worker::wakeups},
+    {"events", true, &Worker::events},
+    {"idle_closed", true, &Worker::idle_closed},
+    {"repl_links", false, &Worker::repl_links},
+    {"repl_lag_bytes", false, &Worker::repl_lag_bytes},
+    {"repl_full_syncs", true, &Worker::repl_full_syncs},
+    {"repl_partial_syncs", true, &Worker::repl_partial_syncs},
+    {"repl_link_up", false, &Worker::repl_link_up},
+    {"repl_applied", false, &Worker::repl_applied},
+    {"repl_lag_ms", false, &Worker::repl_lag_ms, true},
+    {"migrated_keys", true, &Worker::migrated_keys},
+    {"used_memory", false, &Worker::used_memory},
+    {"evicted_keys", true, &Worker::evicted_keys},
+    {"lazy_pending", false, &Worker::lazy_pending},
+    {"lazy_objects", true, &Worker::lazy_objects},
+};
+const size_t k_nstat = sizeof(k_stat_fields) / sizeof(k_stat_fields[0]);
+
+static void stats_text(std::string &text, const uint64_t *sums,
+    const uint64_t *pool, const HistSum &pipeline, const HistSum *cmds,
+    const uint64_t *ops_sec)
+{
+    char line[256];
+    for (size_t i = 0; i < k_nstat; i++) {
+        snprintf(line, sizeof(line), "%s=%llu\n",
+            k_stat_fields[i].name, (unsigned long long)sums[i]);
+        text.append(line);
+    }
+    auto ratio = [](uint64_t a, uint64_t b) { return b ? (double)a / (double)b : 0.0; };
+    auto sum_of = [&](std::atomic<uint64_t> Worker::*field) {
+        size_t i = 0;
+        while (k_stat_fields[i].field != field) {
+            i++;
+        }
+        return sums[i];
+    };
+    snprintf(line, sizeof(line),
+        "db_load_factor=%.3f\nevents_per_wakeup=%.2f\n"
+        "conn_pool_hits=%llu\nconn_pool_misses=%llu\n"
+        "pipeline_reads=%llu\npipeline_avg=%.2f\n"
+        "pipeline_p99=%llu\npipeline_max=%llu\n",
+        ratio(sum_of(&Worker::db_keys), sum_of(&Worker::db_slots)),
+        ratio(sum_of(&Worker::events), sum_of(&Worker::wakeups)),
+        (unsigned long long)pool[0], (unsigned long long)pool[1],
+        (unsigned long long)pipeline.total, ratio(pipeline.sum, pipeline.total),
+        (unsigned long long)hist_quantile(pipeline, 0.99),
+        (unsigned long long)hist_quantile(pipeline, 1));
+    text.append(line);
+    for (size_t c = 0; c < k_ncmd; c++) {
+        const HistSum &h = cmds[c];
+        if (!h.total) {
+            continue;
+        }
+        std::string_view name = cmd_stat_name(c);
+        snprintf(line, sizeof(line),
+            "cmd_%.*s=calls:%llu,ops_sec:%llu,avg_ns:%llu,"
+            "p50_ns:%llu,p90_ns:%llu,p99_ns:%llu,p999_ns:%llu\n",
+            (int)name.size(), name.data(), (unsigned long long)h.total,
+            (unsigned long long)ops_sec[c], (unsigned long long)(h.sum / h.total),
+            (unsigned long long)hist_quantile(h, 0.5),
+            (unsigned long long)hist_quantile(h, 0.9),
+            (unsigned long long)hist_quantile(h, 0.99),
+            (unsigned long long)hist_quantile(h, 0.999));
+        text.append(line);
+    }
+}
+
+// The Prometheus text format. The histogram buckets are cumulative, only
+// the powers of 2 are output as the bounds.
+static void stats_prometheus(std::string &text, const uint64_t *sums,
+    const uint64_t *pool, const HistSum *cmds)
+{
+    char line[256];
+    for (size_t i = 0; i < k_nstat; i++) {
+        const StatField &f = k_stat_fields[i];
+        const char *suffix = f.counter ? "_total" : "";
+        snprintf(line, sizeof(line), "# TYPE kv_%s%s %s\nkv_%s%s %llu\n",
+            f.name, suffix, f.counter ? "counter" : "gauge",
+            f.name, suffix, (unsigned long long)sums[i]);
+        text.append(line);
+    }
+    snprintf(line, sizeof(line),
+        "# TYPE kv_conn_pool_hits_total counter\nkv_conn_pool_hits_total %llu\n"
+        "# TYPE kv_conn_pool_misses_total counter\nkv_conn_pool_misses_total %llu\n"
+        "# TYPE kv_command_duration_seconds histogram\n",
+        (unsigned long long)pool[0], (unsigned long long)pool[1]);
+    text.append(line);
+    for (size_t c = 0; c < k_ncmd; c++) {
+        const HistSum &h = cmds[c];
+        if (!h.total) {
+            continue;
+        }
+        int nlen = (int)cmd_stat_name(c).size();
+        const char *name = cmd_stat_name(c).data();
+        uint64_t cum = 0;
+        size_t b = 0;
+        for (uint64_t le = 128; cum < h.total; le *= 2) {
+            for (; b < k_hist_buckets && hist_lower(b) < le; b++) {
+                cum += h.counts[b];
+            }
+            snprintf(line, sizeof(line),
+                "kv_command_duration_seconds_bucket{cmd=\"%.*s\",le=\"%g\"} %llu\n",
+                nlen, name, (double)le * 1e-9, (unsigned long long)cum);
+            text.append(line);
+        }
+        snprintf(line, sizeof(line),
+            "kv_command_duration_seconds_bucket{cmd=\"%.*s\",le=\"+Inf\"} %llu\n"
+            "kv_command_duration_seconds_sum{cmd=\"%.*s\"} %.9f\n"
+            "kv_command_duration_seconds_count{cmd=\"%.*s\"} %llu\n",
+            nlen, name, (unsigned long long)h.total,
+            nlen, name, (double)h.sum * 1e-9,
+            nlen, name, (unsigned long long)h.total);
+        text.append(line);
+    }
+}
+
+// counters of all workers, as `name=value` lines, or for Prometheus
+static void do_stats(std::vector<std::string_view> &cmd, Response &out) {
+    if (cmd.size() == 2 && cmd[1] != "prometheus") {
+        return out_err(out, "expect prometheus");
+    }
+    uint64_t sums[k_nstat] = {};
+    uint64_t pool[2] = {};
+    uint64_t ops_sec[k_ncmd] = {};
+    HistSum pipeline;
+    std::vector<HistSum> cmds(k_ncmd);
+    for (Worker *w : g_workers) {
+        for (size_t i = 0; i < k_nstat; i++) {
+            const StatField &f = k_stat_fields[i];
+            uint64_t v = (w->*f.field).load(std::memory_order_relaxed);
+            sums[i] = f.max ? std::max(sums[i], v) : sums[i] + v;
+        }
+        pool[0] += w->pool ? w->pool->hits.load(std::memory_order_relaxed) : 0;
+        pool[1] += w->pool ? w->pool->misses.load(std::memory_order_relaxed) : 0;
+        hist_merge(pipeline, w->pipeline);
+        for (size_t c = 0; c < k_ncmd; c++) {
+            hist_merge(cmds[c], w->cmds[c].time_ns);
+            ops_sec[c] += w->cmds[c].ops_sec.load(std::memory_order_relaxed);
+        }
+    }
+    std::string text;
+    if (cmd.size() == 2) {
+        stats_prometheus(text, sums, pool, cmds.data());
+    } else {
+        stats_text(text, sums, pool, pipeline, cmds.data(), ops_sec);
+    }
+    out_val(out, text, NULL);
+}
+
+// Slowlog: the requests slower than `--slowlog-us` in `do_request()`,
+// the last `k_slowlog_len` of each worker. Recording takes a lock, which
+// is fine for something that should be rare.
+static uint64_t g_slowlog_ns = 10 * 1000 * 1000;    // -1 for off
+const size_t k_slowlog_len = 128;
+const size_t k_slowlog_args = 8;        // logged per request
+const size_t k_slowlog_arg_len = 32;    // bytes logged per argument
+
+static void slowlog_add(Worker *w, const std::vector<std::string_view> &cmd, uint64_t dur_ns) {
+    SlowEntry ent;
+    ent.time_ms = get_realtime_msec();
+    ent.dur_ns = dur_ns;
+    for (size_t i = 0; i < cmd.size() && i < k_slowlog_args; i++) {
+        std::string_view arg = cmd[i].substr(0, k_slowlog_arg_len);
+        if (i > 0) {
+            ent.args.push_back(' ');
+        }
+        for (char ch : arg) {
+            if (ch >= 0x21 && ch < 0x7F && ch != '\\') {
+                ent.args.push_back(ch);
+            } else {
+                char hex[8];
+                snprintf(hex, sizeof(hex), "\\x%02x", (uint8_t)ch);
+                ent.args.append(hex);
+            }
+        }
+        if (arg.size() < cmd[i].size()) {
+            ent.args.append("...");
+        }
+    }
+    if (cmd.size() > k_slowlog_args) {
+        ent.args.append(" ...");
+    }
+    std::lock_guard<std::mutex> guard(w->log_lock);
+    ent.id = w->slowlog_next++;
+    w->slowlog.push_front(std::move(ent));
+    if (w->slowlog.size() > k_slowlog_len) {
+        w->slowlog.pop_back();
+    }
+}
+
+// `slowlog get [N]`, `slowlog len`, `slowlog reset`, over all workers
+static void do_slowlog(std::vector<std::string_view> &cmd, Response &out) {
+    int64_t limit = 10;
+    if (cmd.size() == 3 && (cmd[1] != "get" || !str2int(cmd[2], limit))) {
+        return out_err(out, "expect slowlog get N");
+    }
+    if (cmd[1] == "reset") {
+        for (Worker *w : g_workers) {
+            std::lock_guard<std::mutex> guard(w->log_lock);
+            w->slowlog.clear();
+        }
+        return;
+    }
+    if (cmd[1] != "get" && cmd[1] != "len") {
+        return out_err(out, "expect get, len or reset");
+    }
+    std::vector<std::pair<size_t, SlowEntry>> all;
+    for (Worker *w : g_workers) {
+        std::lock_guard<std::mutex> guard(w->log_lock);
+        for (const SlowEntry &ent : w->slowlog) {
+            all.emplace_back(w->id, ent);
+        }
+    }
+    if (cmd[1] == "len") {
+        return out_int(out, (int64_t)all.size());
+    }
+    // the newest first
+    std::stable_sort(all.begin(), all.end(), [](const auto &a, const auto &b) {
+        return a.second.time_ms > b.second.time_ms;
+    });
+    std::string text;
+    char line[128];
+    for (size_t i = 0; i < all.size() && (int64_t)i < limit; i++) {
+        const SlowEntry &ent = all[i].second;
+        snprintf(line, sizeof(line), "shard=%zu id=%llu time_ms=%llu dur_us=%llu cmd=",
+            all[i].first, (unsigned long long)ent.id,
+            (unsigned long long)ent.time_ms, (unsigned long long)(ent.dur_ns / 1000));
+        text.append(line);
+        text.append(ent.args);
+        text.push_back('\n');
+    }
+    out_val(out, text, NULL);
+}
+
+// Tracing, `--trace-sample N`: 1 in N requests executed by the shard that
+// read them is timestamped at each step, until its response is sent.
+// The last `k_trace_len` of each worker are kept for `trace`.
+static uint64_t g_trace_sample = 0;     // 0 for off
+const size_t k_trace_len = 256;
+
+// for converting the cycles, measured since the start
+static uint64_t g_cycles_base = 0;
+static uint64_t g_nsec_base = 0;
+
+static void trace_sample(Conn *conn, std::string_view name, uint64_t parsed, uint64_t executed) {
+    if (conn->trace_end) {
+        return;     // one at a time per connection
+    }
+    if (g_data.trace_countdown > 0) {
+        g_data.trace_countdown--;
+        return;
+    }
+    g_data.trace_countdown = g_trace_sample - 1;
+    Trace &tr = conn->trace;
+    tr.tsc[TR_READ] = g_data.read_tsc;
+    tr.tsc[TR_PARSE] = parsed;
+    tr.tsc[TR_EXEC] = executed;
+    tr.tsc[TR_SERIALIZE] = cycles_now();
+    tr.tsc[TR_WRITE] = 0;
+    size_t n = std::min(name.size(), sizeof(tr.cmd) - 1);
+    memcpy(tr.cmd, name.data(), n);
+    tr.cmd[n] = '\0';
+    conn->trace_end = conn->out_base + buf_size(conn->sending) + buf_size(conn->outgoing);
+}
+
+// finish the trace once its response is sent, after sending some output
+static void trace_check(Conn *conn) {
+    bool sent = conn->out_base > conn->trace_end
+        || (conn->out_base == conn->trace_end
+            && (conn->outrefs.empty() || conn->outrefs.front().at != conn->trace_end));
+    if (!sent) {
+        return;     // the response ends with a value not yet sent
+    }
+    conn->trace.tsc[TR_WRITE] = cycles_now();
+    conn->trace_end = 0;
+    Worker *w = g_data.worker;
+    std::lock_guard<std::mutex> guard(w->log_lock);
+    w->traces.push_front(conn->trace);
+    if (w->traces.size() > k_trace_len) {
+        w->traces.pop_back();
+    }
+}
+
+// `trace`: the step durations of the sampled requests, `trace reset`
+static void do_trace(std::vector<std::string_view> &cmd, Response &out) {
+    if (cmd.size() == 2 && cmd[1] != "reset") {
+        return out_err(out, "expect trace [reset]");
+    }
+    if (!g_trace_sample) {
+        return out_err(out, "tracing is off");
+    }
+    double ns_per_cycle = (double)(get_monotonic_nsec() - g_nsec_base)
+        / (double)std::max<uint64_t>(cycles_now() - g_cycles_base, 1);
+    std::string text;
+    char line[256];
+    for (Worker *w : g_workers) {
+        std::lock_guard<std::mutex> guard(w->log_lock);
+        if (cmd.size() == 2) {
+            w->traces.clear();
+            continue;
+        }
+        for (const Trace &tr : w->traces) {
+            auto ns = [&](int a, int b) {
+                return (unsigned long long)((double)(tr.tsc[b] - tr.tsc[a]) * ns_per_cycle);
+            };
+            snprintf(line, sizeof(line), "shard=%zu cmd=%s parse_ns=%llu exec_ns=%llu "
+                "serialize_ns=%llu write_ns=%llu total_ns=%llu\n",
+                w->id, tr.cmd, ns(TR_READ, TR_PARSE), ns(TR_PARSE, TR_EXEC),
+                ns(TR_EXEC, TR_SERIALIZE), ns(TR_SERIALIZE, TR_WRITE), ns(TR_READ, TR_WRITE));
+            text.append(line);
+        }
+    }
+    out_val(out, text, NULL);
+}
+
+// Append-only file, `--aof PATH`. Each shard logs to its own `PATH.<id>`,
+// in the request format of `parse_req()`, starting with a header:
+//  aof <version> <number of shards> <hash seed>
+// Only blind writes are logged (set, del, zadd, ...), so replaying a
+// record twice is harmless, and TTLs are logged as `pexpireat`.
+static const char *g_aof_path = NULL;
+
+enum {
+    FSYNC_NO = 0,       // left to the kernel
+    FSYNC_EVERYSEC = 1, // by the background thread
+    FSYNC_ALWAYS = 2,   // before the responses are sent
+};
+static int g_aof_fsync = FSYNC_EVERYSEC;
+
+// a request frame: | len | nstr | len | str1 | ... | len | strn |
+static void frame_append(Buffer &buf, const std::string_view *args, size_t n) {
+    uint32_t len = 4;
+    for (size_t i = 0; i < n; i++) {
+        len += 4 + (uint32_t)args[i].size();
+    }
+    uint32_t nstr = (uint32_t)n;
+    buf_append(buf, (const uint8_t *)&len, 4);
+    buf_append(buf, (const uint8_t *)&nstr, 4);
+    for (size_t i = 0; i < n; i++) {
+        uint32_t size = (uint32_t)args[i].size();
+        buf_append(buf, (const uint8_t *)&size, 4);
+        buf_append(buf, (const uint8_t *)args[i].data(), size);
+    }
+}
+
+static std::string_view int2str(char (&text)[24], int64_t val) {
+    char *end = std::to_chars(text, text + sizeof(text), val).ptr;
+    return std::string_view(text, (size_t)(end - text));
+}
+
+// the TTL of a key as a wall-clock time
+static void frame_pexpireat(Buffer &buf, Entry *ent, uint64_t now_real) {
+    uint64_t expire_at = g_data.heap[ent->heap_idx].val;
+    char text[24];
+    std::string_view args[3] = {
+        "pexpireat", entry_key(ent),
+        int2str(text, (int64_t)(now_real + (expire_at - g_data.now_ms))),
+    };
+    frame_append(buf, args, 3);
+}
+
+static uint32_t response_status(Response &out) {
+    return out.status;
+}
+
+// log a write as it was executed, the TTL as what it ended up to be
+// a write as told by `Cmd::log_args` and `CMD_LOG_TTL`
+static void aof_feed(std::vector<std::string_view> &cmd, const Cmd *def, Response &out) {
+    Worker *w = g_data.worker;
+    bool on = w->aof_fd >= 0 || w->repl_on.load(std::memory_order_relaxed);
+    if (!on || response_status(out) != RES_OK) {
+        return;     // not enabled, not loaded yet, or nothing changed
+    }
+    if (def->log_args) {
+        frame_append(w->aof_buf, cmd.data(), std::min<size_t>(def->log_args, cmd.size()));
+    }
+    if (def->flags & CMD_LOG_TTL) {
+        Entry *ent = db_lookup(cmd[1], EntryTraits::hash(cmd[1]));
+        if (!ent) {
+            std::string_view args[2] = {"del", cmd[1]};  // expired right away
+            frame_append(w->aof_buf, args, 2);
+        } else if (ent->heap_idx != (size_t)-1) {
+            frame_pexpireat(w->aof_buf, ent, get_realtime_msec());
+        }
+    }
+}
+
+// a key removed by the server itself, for the AOF and the replicas
+static void aof_feed_del(Worker *w, std::string_view key) {
+    if (w->aof_fd >= 0 || w->repl_on.load(std::memory_order_relaxed)) {
+        std::string_view args[2] = {"del", key};
+        frame_append(w->aof_buf, args, 2);
+    }
+}
+
+// `flushall` in one shard, logged as that for its AOF and replicas
+static void shard_flush(Worker *w, bool async) {
+    if (w->aof_fd >= 0 || w->repl_on.load(std::memory_order_relaxed)) {
+        std::string_view args[2] = {"flushall", async ? "async" : "sync"};
+        frame_append(w->aof_buf, args, 2);
+    }
+    db_flush();
+    if (!async) {
+        lazy_work(SIZE_MAX);
+    }
+}
+
+// Runs in every shard (`CMD_ALL`), each one after the requests the
+// connection forwarded to it before. The AOF and the replication streams
+// are per shard, so a shard loading or applying one flushes only itself.
+static void do_flushall(std::vector<std::string_view> &cmd, Response &out) {
+    bool async = cmd.size() == 2 && cmd[1] == "async";
+    if (cmd.size() == 2 && !async && cmd[1] != "sync") {
+        return out_err(out, "expect async or sync");
+    }
+    shard_flush(g_data.worker, async);
+}
+
+// rewrite the AOF of every shard in the background
+static void do_bgrewriteaof(std::vector<std::string_view> &, Response &out) {
+    if (!g_aof_path) {
+        return out_err(out, "AOF is off");
+    }
+    for (Worker *w : g_workers) {
+        w->aof_rewrite.store(true, std::memory_order_relaxed);
+        worker_wake(w);
+    }
+}
+
+static const char *g_snap_path = NULL;
+
+// replication, see `repl_psync()` on the primary and `repl_run()` on a replica
+static const char *g_replicaof = NULL;      // HOST:PORT of the primary
+static size_t g_repl_backlog = 16 << 20;    // per shard
+static uint64_t g_repl_id = 0;              // random, a restart is a new stream
+
+// a replica follows the evictions of its primary
+static bool evict_due() {
+    return g_evict_policy != EVICT_NO && !g_replicaof && mem_over();
+}
+
+// snapshot every shard in the background, as one generation of files
+static void do_bgsave(std::vector<std::string_view> &, Response &out) {
+    if (!g_snap_path) {
+        return out_err(out, "snapshot is off");
+    }
+    uint64_t gen = get_realtime_msec();
+    for (Worker *w : g_workers) {
+        w->snap_gen.store(gen, std::memory_order_relaxed);
+        worker_wake(w);
+    }
+}
+
+// `[...]` of a glob at `pat[p]`, `p` is moved past it
+static bool glob_class(std::string_view pat, size_t &p, uint8_t ch) {
+    p++;    // the '['
+    bool neg = p < pat.size() && pat[p] == '^';
+    p += neg;
+    bool hit = false;
+    while (p < pat.size() && pat[p] != ']') {
+        if (pat[p] == '\\' && p + 1 < pat.size()) {
+            p++;
+        }
+        uint8_t lo = (uint8_t)pat[p], hi = lo;
+        if (p + 2 < pat.size() && pat[p + 1] == '-' && pat[p + 2] != ']') {
+            hi = (uint8_t)pat[p + 2];
+            p += 2;
+        }
+        if (lo > hi) {
+            std::swap(lo, hi);
+        }
+        hit = hit || (lo <= ch && ch <= hi);
+        p++;
+    }
+    p += p < pat.size();    // the ']'
+    return hit != neg;
+}
+
+// `*`, `?`, `[a-z]`, `[^a-z]` and `\x`, like the MATCH of Redis.
+// A mismatch backtracks to the last `*` only, which is enough for globs.
+static bool glob_match(std::string_view pat, std::string_view str) {
+    size_t p = 0, s = 0;
+    size_t star = pat.npos, star_s = 0;
+    while (s < str.size()) {
+        bool ok = false;
+        size_t next = p;
+        if (p < pat.size() && pat[p] == '*') {
+            star = ++p;
+            star_s = s;
+            continue;
+        } else if (p < pat.size() && pat[p] == '?') {
+            ok = true;
+            next = p + 1;
+        } else if (p < pat.size() && pat[p] == '[') {
+            ok = glob_class(pat, next, (uint8_t)str[s]);
+        } else if (p < pat.size()) {
+            size_t q = p + (pat[p] == '\\' && p + 1 < pat.size());
+            ok = pat[q] == str[s];
+            next = q + 1;
+        }
+        if (ok) {
+            p = next;
+            s++;
+        } else if (star != pat.npos) {
+            p = star;       // the `*` takes one more byte
+            s = ++star_s;
+        } else {
+            return false;
+        }
+    }
+    while (p < pat.size() && pat[p] == '*') {
+        p++;
+    }
+    return p == pat.size();
+}
+
+// scan CURSOR [match PATTERN] [count N]
+// Visits the buckets of one shard until N keys are found, or 10 * N
+// buckets are visited, so a call is bounded even with a sparse pattern.
+// The reply is an array of the next cursor, 0 when done, then the keys.
+// The cursor is `bucket cursor * shards + shard`, see `hm_scan()`, and
+// a call runs in the shard it names. N is capped, a call must not take
+// over the event loop of its shard.
+const int64_t k_scan_count = 10;
+const int64_t k_scan_count_max = 1000;
+
+static void do_scan(std::vector<std::string_view> &cmd, Response &out) {
+    int64_t cursor = 0, count = k_scan_count;
+    std::string_view pattern = "*";
+    bool ok = cmd.size() % 2 == 0 && str2int(cmd[1], cursor) && cursor >= 0;
+    for (size_t i = 2; ok && i + 1 < cmd.size(); i += 2) {
+        if (cmd[i] == "match") {
+            pattern = cmd[i + 1];
+        } else {
+            ok = cmd[i] == "count" && str2int(cmd[i + 1], count) && count > 0;
+        }
+    }
+    if (!ok) {
+        return out_err(out, "expect scan cursor [match pattern] [count n]");
+    }
+    uint64_t nshards = g_workers.size();
+    uint64_t shard = (uint64_t)cursor % nshards;   // this one
+    uint64_t v = (uint64_t)cursor / nshards;
+    bool all = pattern == "*";
+    static thread_local std::vector<std::string_view> keys;
+    keys.clear();
+    count = count < k_scan_count_max ? count : k_scan_count_max;
+    uint64_t nbuckets = (uint64_t)count * 10;   // no wrap after the cap
+    do {
+        v = hm_scan(&g_data.db, v, [&](HNode *node) {
+            Entry *ent = container_of(node, Entry, node);
+            if (!entry_expired(ent) && (all || glob_match(pattern, entry_key(ent)))) {
+                keys.push_back(entry_key(ent));
+            }
+        });
+    } while (v != 0 && keys.size() < (uint64_t)count && --nbuckets > 0);
+    uint64_t next = v != 0 ? v * nshards + shard : (shard + 1) % nshards;
+    char text[24];
+    if (out.proto == PROTO_BINARY) {
+        out_arr(out, (uint32_t)keys.size() + 1);
+        out_str(out, int2str(text, (int64_t)next));
+    } else {
+        out_arr(out, 2);    // [cursor, [keys]] like in Redis
+        out_str(out, int2str(text, (int64_t)next));
+        out_arr(out, (uint32_t)keys.size());
+    }
+    for (std::string_view key : keys) {
+        out_str(out, key);
+    }
+}
+
+// ping [msg]
+static void do_ping(std::vector<std::string_view> &cmd, Response &out) {
+    if (cmd.size() == 2) {
+        return out_val(out, cmd[1], NULL);
+    }
+    out_simple(out, "PONG");
+}
+
+static void do_echo(std::vector<std::string_view> &cmd, Response &out) {
+    out_val(out, cmd[1], NULL);
+}
+
+// there is only the database 0, for the clients that select it anyway
+static void do_select(std::vector<std::string_view> &cmd, Response &out) {
+    if (cmd[1] != "0") {
+        return out_err(out, "DB index is out of range");
+    }
+}
+
+static int hello_version(std::string_view arg) {
+    return arg == "2" ? PROTO_RESP2 : arg == "3" ? PROTO_RESP3 : -1;
+}
+
+// hello [2|3], RESP only. The connection is switched to the version by
+// `try_one_request()` before this reply, which is a map in RESP3.
+static void do_hello(std::vector<std::string_view> &cmd, Response &out) {
+    if (out.proto == PROTO_BINARY) {
+        return out_err(out, "hello is for RESP connections");
+    }
+    if (cmd.size() >= 2 && hello_version(cmd[1]) < 0) {
+        return out_err(out, "NOPROTO unsupported protocol version");
+    }
+    out_map(out, 4);
+    out_str(out, "server");
+    out_str(out, "redis");
+    out_str(out, "proto");
+    out_int(out, out.proto);
+    out_str(out, "mode");
+    out_str(out, g_cluster ? "cluster" : "standalone");
+    out_str(out, "role");
+    out_str(out, g_replicaof ? "replica" : "master");
+}
+
+// for the next request only, see `try_one_request()`
+static void do_asking(std::vector<std::string_view> &, Response &) {}
+
+
+static void out_redirect(Response &out, uint32_t status, uint32_t slot, uint32_t node) {
+    char text[24];
+    std::string_view num = int2str(text, slot);
+    const std::string &addr = g_nodes[node];
+    out_status(out, status);
+    out_append(out, num.data(), num.size());
+    out_append(out, " ", 1);
+    out_append(out, addr.data(), addr.size());
+}
+
+// Cluster mode: a request for the keys of a slot served by another node
+// is answered with RES_MOVED. While a slot migrates away, a request for
+// the keys that already left, or for new keys, is answered with RES_ASK:
+// the target takes it after an `asking`. Multi-key requests need a
+// single slot.
+static bool cluster_redirect(std::vector<std::string_view> &cmd, const Cmd *def,
+    Response &out)
+{
+    if (!(def->flags & CMD_KEY)) {
+        return false;
+    }
+    bool multi = def->flags & (CMD_KEYS | CMD_PAIRS);
+    size_t step = def->flags & CMD_PAIRS ? 2 : 1;
+    size_t end = multi ? cmd.size() : 2;
+    uint32_t slot = key_slot(cmd[1]);
+    for (size_t i = 1 + step; i < end; i += step) {
+        if (key_slot(cmd[i]) != slot) {
+            out_err(out, "CROSSSLOT keys in request don't hash to the same slot");
+            return true;
+        }
+    }
+    if (g_data.asking) {
+        return false;   // sent here by an ASK
+    }
+    uint32_t owner = g_slot_node[slot].load(std::memory_order_acquire);
+    if (owner != 0) {
+        out_redirect(out, RES_MOVED, slot, owner);
+        return true;
+    }
+    uint32_t target = g_slot_migrating[slot].load(std::memory_order_relaxed);
+    for (size_t i = 1; target && i < end; i += step) {
+        if (!db_lookup(cmd[i], EntryTraits::hash(cmd[i]))) {
+            out_redirect(out, RES_ASK, slot, target - 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool cmd_arity_ok(const Cmd *def, size_t n) {
+    return n >= def->min_args && (!def->max_args || n <= def->max_args);
+}
+
+static void do_request(std::vector<std::string_view> &cmd, Response &out) {
+    const Cmd *def = cmd.empty() ? NULL : cmd_lookup(cmd[0]);
+    CmdStats &st = g_data.worker->cmds[def ? def - k_cmds : k_ncmd - 1];
+    uint64_t t0 = get_monotonic_nsec();
+    g_data.nreq++;
+    uint32_t flags = def ? def->flags : 0;
+    if (!def) {
+        out_status(out, RES_ERR);   // unrecognized command
+    } else if (!cmd_arity_ok(def, cmd.size())) {
+        out_err(out, "wrong number of arguments");
+    } else if (g_replicaof && !g_data.repl_applying && (flags & CMD_WRITE)) {
+        out_err(out, "read-only replica");
+    } else if (g_shard_maxmemory && g_evict_policy == EVICT_NO && !g_data.repl_applying
+        && !g_data.loading && (flags & CMD_GROW) && mem_over())
+    {
+        out_err(out, "OOM command not allowed when used memory > 'maxmemory'");
+    } else if (!g_cluster || g_data.repl_applying || !cluster_redirect(cmd, def, out)) {
+        def->fn(cmd, out);
+    }
+    if (flags & CMD_WRITE) {
+        aof_feed(cmd, def, out);
+    }
+    uint64_t dur_ns = get_monotonic_nsec() - t0;
+    hist_add(st.time_ns, dur_ns);
+    stat_inc(st.calls);
+    if (dur_ns > g_slowlog_ns) {
+        slowlog_add(g_data.worker, cmd, dur_ns);
+    }
+}
+
+// the table slot uses the low bits of the hash, the shard uses the high ones
+static size_t key_shard(uint64_t hcode) {
+    return (size_t)(((hcode >> 32) * g_workers.size()) >> 32);
+}
+
+// Keys containing a `{tag}` are sharded by the tag only, see `key_tag()`.
+// Multi-key commands need all keys in one shard. In cluster mode a shard
+// owns a range of slots instead, so that a slot is in a single shard.
+static size_t slot_shard(uint32_t slot) {
+    return slot * g_workers.size() / k_nslots;
+}
+
+static size_t key_shard_of(std::string_view key) {
+    if (g_cluster) {
+        return slot_shard(key_slot(key));
+    }
+    return key_shard(EntryTraits::hash(key_tag(key)));
+}
+
+// the `cluster` subcommands about a slot run in the shard owning it
+static bool cmd_has_slot(std::string_view sub) {
+    return sub == "countkeysinslot" || sub == "getkeysinslot" || sub == "migrate";
+}
+
+const size_t k_all_shards = SIZE_MAX;  // see `CMD_ALL`
+const size_t k_split_shards = SIZE_MAX - 1;     // see `conn_split()`
+
+// the shard owning the (first) key of a command; keyless commands run locally
+static size_t cmd_shard(const std::vector<std::string_view> &cmd) {
+    if (g_workers.size() <= 1 || cmd.empty()) {
+        return g_data.worker->id;
+    }
+    const Cmd *def = cmd_lookup(cmd[0]);
+    uint32_t flags = def ? def->flags : 0;
+    if (flags & CMD_ALL) {
+        return k_all_shards;
+    }
+    if (cmd.size() < 2) {
+        return g_data.worker->id;
+    }
+    // in cluster mode the keys of a batch share a slot, or it fails
+    bool pairs = flags & CMD_PAIRS;
+    if ((flags & (CMD_KEYS | CMD_PAIRS)) && !g_cluster && (!pairs || cmd.size() % 2)) {
+        size_t step = pairs ? 2 : 1;
+        size_t shard = key_shard_of(cmd[1]);
+        for (size_t i = 1 + step; i < cmd.size(); i += step) {
+            if (key_shard_of(cmd[i]) != shard) {
+                return k_split_shards;
+            }
+        }
+        return shard;
+    }
+    int64_t slot = -1;
+    if ((flags & CMD_SLOT) && cmd.size() >= 3 && cmd_has_slot(cmd[1])
+        && str2int(cmd[2], slot) && slot >= 0 && (size_t)slot < k_nslots)
+    {
+        return slot_shard((uint32_t)slot);     // by the shard owning the slot
+    }
+    int64_t cursor = -1;
+    if ((flags & CMD_CURSOR) && str2int(cmd[1], cursor) && cursor >= 0) {
+        return (size_t)((uint64_t)cursor % g_workers.size());   // see `do_scan()`
+    }
+    if (!(flags & CMD_KEY)) {
+        return g_data.worker->id;
+    }
+    return key_shard_of(cmd[1]);
+}
+
+// push a message to a worker. The consumer takes the whole stack at once,
+// so only the push onto an empty stack needs to wake it up.
+static void worker_send(Worker *w, Forward *f) {
+    Forward *head = w->inbox.load(std::memory_order_relaxed);
+    do {
+        f->next = head;
+    } while (!w->inbox.compare_exchange_weak(
+        head, f, std::memory_order_release, std::memory_order_relaxed));
+    if (!head) {
+        worker_wake(w);
+    }
+}
+
+// A forward always ends at its origin, which keeps it as a spare with
+// the capacity of its buffers, so that forwarding allocates nothing in
+// the steady state.
+const size_t k_fwd_spares = 1024;   // per worker
+const size_t k_fwd_keep = 4 << 10;  // bytes kept of each buffer
+
+static void forward_free(Forward *f) {
+    Worker *w = g_data.worker;
+    if (w->fwd_free.size() >= k_fwd_spares) {
+        delete f;
+        return;
+    }
+    if (f->req.capacity() > k_fwd_keep) {
+        std::vector<uint8_t>().swap(f->req);
+    }
+    buf_clear(f->resp);
+    buf_trim(f->resp, k_fwd_keep);
+    f->key_shards.clear();
+    f->split_parts.clear();
+    w->fwd_free.push_back(f);
+}
+
+static void split_merge(Conn *conn, Forward *f);
+
+// move finished responses to `outgoing`, keeping the request order
+static void conn_flush_inflight(Conn *conn) {
+    while (!conn->inflight.empty() && conn->inflight.front()->done) {
+        Forward *f = conn->inflight.front();
+        conn->inflight.pop_front();
+        if (f->split) {
+            split_merge(conn, f);
+        } else {
+            buf_append(conn->outgoing, buf_data(f->resp), buf_size(f->resp));
+        }
+        forward_free(f);
+    }
+}
+
+// execute a forwarded request. The views in `cmd` point into `f->req`.
+static void forward_execute(Forward *f) {
+    std::vector<std::string_view> cmd;
+    if (parse_req(f->req.data(), f->req.size(), cmd) < 0) {
+        assert(!"validated by the origin");
+    }
+    Response resp;
+    response_begin(resp, f->resp, f->proto);
+    g_data.asking = f->asking;
+    do_request(cmd, resp);
+    g_data.asking = false;
+    response_end(resp);
+}
+
+static Forward *forward_new(Conn *conn, const uint8_t *req, size_t len, bool asking) {
+    Worker *w = g_data.worker;
+    Forward *f = NULL;
+    if (w->fwd_free.empty()) {
+        f = new Forward();
+    } else {
+        f = w->fwd_free.back();
+        w->fwd_free.pop_back();
+        f->done = false;
+        f->whole = NULL;
+        f->parts = 0;
+        f->split = NULL;
+    }
+    f->origin = w;
+    f->conn = conn;
+    f->asking = asking;
+    f->proto = conn->proto;
+    f->req.assign(req, req + len);  // within the capacity of a spare
+    return f;
+}
+
+// queue a request behind the ones already in flight.
+// Once anything is in flight, local requests are queued too to keep the order.
+// A `CMD_ALL` request also goes to each other shard as a part, behind
+// what this connection forwarded to it before, and the response of this
+// shard waits for the replies of the parts.
+static void conn_forward(Conn *conn, const uint8_t *req, size_t len,
+    size_t shard, bool asking)
+{
+    Forward *f = forward_new(conn, req, len, asking);
+    conn->inflight.push_back(f);
+    if (shard == k_all_shards) {
+        for (Worker *w : g_workers) {
+            if (w != g_data.worker) {
+                Forward *part = forward_new(conn, req, len, asking);
+                part->whole = f;
+                f->parts++;
+                worker_send(w, part);
+            }
+        }
+        shard = g_data.worker->id;
+    }
+    if (shard == g_data.worker->id) {
+        forward_execute(f);
+        f->done = f->parts == 0;
+        conn_flush_inflight(conn);
+    } else {
+        worker_send(g_workers[shard], f);
+    }
+}
+
+// A batch whose keys are in several shards (not in cluster mode) is split
+// into a part for each of them, with its keys in the request order. The
+// parts answer in the binary format, and once all of them are back
+// `split_merge()` writes the response of the whole.
+static void conn_split(Conn *conn, std::vector<std::string_view> &cmd) {
+    const Cmd *def = cmd_lookup(cmd[0]);
+    size_t step = def->flags & CMD_PAIRS ? 2 : 1;
+    Forward *f = forward_new(conn, NULL, 0, false);
+    f->split = def;
+    f->split_parts.assign(g_workers.size(), NULL);
+    conn->inflight.push_back(f);
+    static thread_local std::vector<std::vector<std::string_view>> args;
+    args.resize(g_workers.size());
+    for (std::vector<std::string_view> &a : args) {
+        a.assign(1, cmd[0]);
+    }
+    for (size_t i = 1; i < cmd.size(); i += step) {
+        uint32_t shard = (uint32_t)key_shard_of(cmd[i]);
+        f->key_shards.push_back(shard);
+        args[shard].insert(args[shard].end(), &cmd[i], &cmd[i] + step);
+    }
+    static thread_local Buffer frame;
+    Forward *local = NULL;
+    for (size_t shard = 0; shard < g_workers.size(); shard++) {
+        if (args[shard].size() == 1) {
+            continue;   // none of the keys
+        }
+        buf_clear(frame);
+        frame_append(frame, args[shard].data(), args[shard].size());
+        Forward *part = forward_new(conn, buf_data(frame) + 4, buf_size(frame) - 4, false);
+        part->proto = PROTO_BINARY;
+        part->whole = f;
+        f->split_parts[shard] = part;
+        f->parts++;
+        if (shard == g_data.worker->id) {
+            local = part;   // after the others are on their way
+        } else {
+            worker_send(g_workers[shard], part);
+        }
+    }
+    if (local) {
+        forward_execute(local);
+        f->parts--;
+    }
+    if (f->parts == 0) {
+        f->done = true;     // all keys in this shard after all
+        conn_flush_inflight(conn);
+    }
+}
+
+// the binary response of a part
+static uint32_t part_status(Forward *part, std::string_view &data) {
+    uint32_t status = 0;
+    memcpy(&status, buf_data(part->resp) + 4, 4);
+    data = std::string_view((const char *)buf_data(part->resp) + 8, buf_size(part->resp) - 8);
+    return status;
+}
+
+// the response of a split batch, as told by `CMD_CONCAT` and `CMD_SUM`.
+// An error of any part is the response, like an OOM of `mset`.
+static void split_merge(Conn *conn, Forward *f) {
+    Response out;
+    response_begin(out, conn->outgoing, conn->proto);
+    std::string_view data;
+    int64_t sum = 0;
+    for (Forward *part : f->split_parts) {
+        if (!part) {
+            continue;
+        }
+        if (part_status(part, data) != RES_OK) {
+            out_err(out, data);
+            break;
+        }
+        int64_t n = 0;
+        if (f->split->flags & CMD_SUM) {
+            memcpy(&n, data.data(), 8);
+        }
+        sum += n;
+    }
+    if (out.status == RES_OK && (f->split->flags & CMD_SUM)) {
+        out_int(out, sum);
+    } else if (out.status == RES_OK && (f->split->flags & CMD_CONCAT)) {
+        // an array: a cursor into each part, past its `n`
+        static thread_local std::vector<size_t> pos;
+        pos.assign(g_workers.size(), 8 + 4);
+        out_arr(out, (uint32_t)f->key_shards.size());
+        for (uint32_t shard : f->key_shards) {
+            const uint8_t *p = buf_data(f->split_parts[shard]->resp) + pos[shard];
+            uint32_t len = 0;
+            memcpy(&len, p, 4);
+            if (len == 0xFFFFFFFF) {
+                out_nil(out);
+                pos[shard] += 4;
+            } else {
+                out_bulk(out, std::string_view((const char *)p + 4, len), NULL);
+                pos[shard] += 4 + len;
+            }
+        }
+    }
+    response_end(out);
+    for (Forward *part : f->split_parts) {
+        if (part) {
+            forward_free(part);
+        }
+    }
+}
+
+// Replication, the primary side. A replica links to each shard with
+// `psync <shard> <replid> <offset>`, on any worker, which streams it from
+// the ring of that shard. It continues from `offset` if the ring still
+// has it, otherwise it starts with a snapshot, see `repl_poll()`.
+// The reply is `["continue" | "full", replid]`, then comes the stream.
+const size_t k_repl_batch = 1 << 20;    // output queued per link
+
+static void repl_psync(Conn *conn, std::vector<std::string_view> &cmd) {
+    Worker *w = g_data.worker;
+    Response resp;
+    response_begin(resp, conn->outgoing);
+    int64_t shard = -1, offset = -1;
+    if (cmd.size() != 4 || !str2int(cmd[1], shard) || shard < 0
+        || (size_t)shard >= g_workers.size() || !str2int(cmd[3], offset)
+        || !conn->inflight.empty())
+    {
+        out_err(resp, "expect psync shard replid offset");
+        return response_end(resp);
+    }
+    Worker *owner = g_workers[shard];
+    char text[24];
+    std::string_view replid = int2str(text, (int64_t)g_repl_id);
+    ReplLink *link = new ReplLink();
+    link->shard = owner;
+    bool full = false;
+    {
+        std::lock_guard<std::mutex> guard(owner->repl_lock);
+        if (owner->repl_ring.empty()) {
+            owner->repl_ring.resize(g_repl_backlog);
+            owner->repl_on.store(true, std::memory_order_relaxed);
+        }
+        uint64_t end = owner->repl_offset.load(std::memory_order_relaxed);
+        uint64_t start = end - std::min<uint64_t>(end, owner->repl_ring.size());
+        full = cmd[2] != replid || (uint64_t)offset < start || (uint64_t)offset > end;
+        if (full) {
+            link->sync = std::make_shared<ReplSync>();
+            link->sync->origin = w;
+            owner->repl_syncs.push_back(link->sync);
+        }
+        link->pos = full ? 0 : (uint64_t)offset;
+        link->ack = full ? end : (uint64_t)offset;
+    }
+    if (full) {
+        worker_wake(owner);     // to take the snapshot
+    }
+    stat_inc(full ? w->repl_full_syncs : w->repl_partial_syncs);
+    out_arr(resp, 2);
+    out_str(resp, full ? "full" : "continue");
+    out_str(resp, replid);
+    response_end(resp);
+    conn->repl = link;
+    w->repl_conns.push_back(conn);
+    stat_inc(w->repl_links);
+}
+
+// `replconf ack <offset>`, once a second, the only request of a link
+static void repl_ack(Conn *conn, std::vector<std::string_view> &cmd) {
+    int64_t offset = 0;
+    if (cmd.size() == 3 && cmd[0] == "replconf" && cmd[1] == "ack"
+        && str2int(cmd[2], offset))
+    {
+        conn->repl->ack = (uint64_t)offset;
+    }
+}
+
+// Append the next part of the stream to the output, up to `k_repl_batch`:
+// the snapshot first if any, then the ring. A link that fell behind the
+// ring is dropped, the replica comes back for a full resync.
+static void repl_fill(Conn *conn) {
+    ReplLink *link = conn->repl;
+    size_t out = buf_size(conn->outgoing) + buf_size(conn->sending);
+    if (out >= k_repl_batch) {
+        return;
+    }
+    size_t room = k_repl_batch - out;
+    if (ReplSync *sync = link->sync.get()) {
+        if (!sync->done.load(std::memory_order_acquire)) {
+            return;     // not taken yet
+        }
+        if (sync->fd < 0) {
+            conn->want_close = true;
+            return;
+        }
+        size_t n = std::min(room, sync->size - link->sync_pos);
+        buf_reserve(conn->outgoing, n);
+        ssize_t rv = pread(sync->fd, buf_tail(conn->outgoing), n, (off_t)link->sync_pos);
+        if (rv < 0 || (size_t)rv != n) {
+            msg_errno("replication snapshot pread() error");
+            conn->want_close = true;
+            return;
+        }
+        buf_commit(conn->outgoing, n);
+        link->sync_pos += n;
+        room -= n;
+        if (link->sync_pos < sync->size) {
+            return;
+        }
+        link->pos = sync->offset;
+        link->sync.reset();
+    }
+    Worker *owner = link->shard;
+    std::lock_guard<std::mutex> guard(owner->repl_lock);
+    uint64_t end = owner->repl_offset.load(std::memory_order_relaxed);
+    const std::vector<uint8_t> &ring = owner->repl_ring;
+    if (end - link->pos > ring.size()) {
+        msg("replica fell behind the backlog");
+        conn->want_close = true;
+        return;
+    }
+    size_t n = (size_t)std::min<uint64_t>(room, end - link->pos);
+    buf_reserve(conn->outgoing, n);
+    size_t at = (size_t)(link->pos % ring.size());
+    size_t first = std::min(n, ring.size() - at);   // wraps around
+    memcpy(buf_tail(conn->outgoing), &ring[at], first);
+    memcpy(buf_tail(conn->outgoing) + first, &ring[0], n - first);
+    buf_commit(conn->outgoing, n);
+    link->pos += n;
+}
+
+// A large argument not received yet is read straight into a new blob,
+// so that a value is neither moved around in `incoming` as it grows nor
+// copied once it's in: `set` keeps the blob, see `req_blob_of()`. What
+// is already in moves to the blob, and the reads fill the rest of it
+// before anything goes to `incoming` again, see `conn_read_dst()`.
+// Only the first one of a request, the others are buffered as usual.
+static void conn_sink(Conn *conn, size_t at, size_t len, size_t arg) {
+    assert(!conn->sink && at + len > buf_size(conn->incoming));
+    Blob *blob = blob_new(len);
+    size_t got = buf_size(conn->incoming) - at;
+    memcpy(blob_data(blob), buf_data(conn->incoming) + at, got);
+    conn->incoming.data_end -= got;
+    conn->sink = blob;
+    conn->sink_got = got;
+    conn->sink_arg = arg;
+}
+
+static bool conn_sink_full(const Conn *conn) {
+    return !conn->sink || conn->sink_got == conn->sink->cap;
+}
+
+static void conn_sink_done(Conn *conn) {
+    if (conn->sink) {
+        blob_unref(conn->sink);     // unless it was kept
+        conn->sink = NULL;
+        conn->sink_got = 0;
+    }
+}
+
+// the least free space offered to each `read()`
+const size_t k_min_read = 16 * 1024;
+
+// where the next read goes, and how much of it at most
+static uint8_t *conn_read_dst(Conn *conn, size_t &cap) {
+    if (!conn_sink_full(conn)) {
+        cap = conn->sink->cap - conn->sink_got;
+        return blob_data(conn->sink) + conn->sink_got;
+    }
+    buf_reserve(conn->incoming, k_min_read);
+    cap = buf_tail_size(conn->incoming);
+    return buf_tail(conn->incoming);
+}
+
+static void conn_read_commit(Conn *conn, size_t n) {
+    if (!conn_sink_full(conn)) {
+        conn->sink_got += n;
+        stat_add(g_data.worker->sink_bytes, n);
+    } else {
+        buf_commit(conn->incoming, n);
+    }
+}
+
+// received data from elsewhere, the same as reading it
+static void conn_feed(Conn *conn, const uint8_t *data, size_t n) {
+    while (n > 0) {
+        size_t cap = 0;
+        uint8_t *dst = conn_read_dst(conn, cap);
+        size_t k = std::min(n, cap);
+        memcpy(dst, data, k);
+        conn_read_commit(conn, k);
+        data += k;
+        n -= k;
+    }
+}
+
+// Binary requests of `k_stream_min` or more that aren't all in yet are
+// parsed as they arrive, with the same results as `resp_parse()`. The
+// request in `incoming` lacks the bytes of `conn->sink`.
+const size_t k_stream_min = k_blob_min;
+
+static int conn_parse_frame(Conn *conn) {
+    FrameParser &fp = conn->frame;
+    if (!conn_sink_full(conn)) {
+        return RESP_MORE;
+    }
+    const uint8_t *data = buf_data(conn->incoming);
+    size_t size = buf_size(conn->incoming);
+    size_t hole = conn->sink ? conn->sink->cap : 0;
+    if (fp.nargs < 0) {
+        uint32_t n = 0;
+        if (size - fp.pos < 4) {
+            return RESP_MORE;
+        }
+        memcpy(&n, data + fp.pos, 4);
+        if (n > k_max_args) {
+            return RESP_ERROR;
+        }
+        fp.nargs = n;
+        fp.pos += 4;
+    }
+    while (fp.args.size() < (size_t)fp.nargs) {
+        if (fp.bulk < 0) {
+            uint32_t n = 0;
+            if (size - fp.pos < 4) {
+                return RESP_MORE;
+            }
+            memcpy(&n, data + fp.pos, 4);
+            fp.pos += 4;
+            if (fp.pos - 4 + hole + n > fp.len) {
+                return RESP_ERROR;  // past the end of the body
+            }
+            fp.bulk = n;
+        }
+        size_t len = (size_t)fp.bulk;
+        if (size - fp.pos < len) {
+            if (len >= k_blob_min && !conn->sink) {
+                conn_sink(conn, fp.pos, len, fp.args.size());
+                RespArg arg;
+                arg.off = fp.pos;
+                fp.args.push_back(arg);
+                fp.bulk = -1;
+            } else {
+                buf_reserve(conn->incoming, len - (size - fp.pos));
+            }
+            return RESP_MORE;
+        }
+        RespArg arg;
+        arg.off = fp.pos;
+        arg.len = len;
+        fp.args.push_back(arg);
+        fp.pos += len;
+        fp.bulk = -1;
+    }
+    return fp.pos - 4 + hole == fp.len ? RESP_DONE : RESP_ERROR;   // trailing garbage
+}
+
+// the views of the arguments parsed by offset
+static void conn_args(Conn *conn, const std::vector<RespArg> &args,
+    std::vector<std::string_view> &cmd)
+{
+    cmd.clear();
+    const uint8_t *data = buf_data(conn->incoming);
+    for (const RespArg &arg : args) {
+        cmd.emplace_back((const char *)data + arg.off, arg.len);
+    }
+    if (conn->sink) {
+        cmd[conn->sink_arg] = std::string_view(
+            (const char *)blob_data(conn->sink), conn->sink->cap);
+    }
+}
+
+// The protocol is told once 4 bytes are in: a binary request starts with
+// its length, at most `k_max_msg` in little-endian, so its 4th byte is at
+// most 2, while that of a RESP request is text.
+static bool conn_sniff(Conn *conn) {
+    if (!conn->sniffed && buf_size(conn->incoming) >= 4) {
+        bool text = buf_data(conn->incoming)[3] > (k_max_msg >> 24);
+        conn->proto = text ? PROTO_RESP2 : PROTO_BINARY;
+        conn->sniffed = true;
+    }
+    return conn->sniffed;
+}
+
+// the RESP request at the front of `incoming`, continued from the last call
+static int conn_parse_resp(Conn *conn) {
+    RespParser &p = conn->resp;
+    if (!conn_sink_full(conn)) {
+        return RESP_MORE;
+    }
+    size_t size = buf_size(conn->incoming);
+    int rv = resp_parse(p, buf_data(conn->incoming), size, k_max_args, k_max_msg);
+    if (rv == RESP_MORE && p.need > size) {
+        if (p.bulk >= (int64_t)k_blob_min && !conn->sink) {
+            conn_sink(conn, p.pos, (size_t)p.bulk, p.args.size());
+            resp_take_bulk(p);
+        } else {
+            // make room for the whole bulk string up front
+            buf_reserve(conn->incoming, p.need - size);
+        }
+    }
+    return rv;
+}
+
+// Command names and keywords are lowercased in place, clients may send
+// them in any case. The views point into `incoming`.
+static void resp_args(Conn *conn, std::vector<std::string_view> &cmd) {
+    uint8_t *data = buf_data(conn->incoming);
+    std::vector<RespArg> &args = conn->resp.args;
+    auto lower = [&](size_t i) {
+        for (size_t k = 0; k < args[i].len; k++) {
+            uint8_t &c = data[args[i].off + k];
+            c = c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+        }
+    };
+    conn_args(conn, args, cmd);
+    if (cmd.empty()) {
+        return;
+    }
+    lower(0);
+    const Cmd *def = cmd_lookup(cmd[0]);
+    if (!def) {
+        return;
+    }
+    for (size_t i = 1; i < cmd.size() && i < 32; i++) {
+        if (def->keywords & (1u << i)) {
+            lower(i);   // ex, px, withscores, match, count, subcommands
+        }
+    }
+    if (def->flags & CMD_SLOT && cmd.size() >= 4 && cmd[1] == "setslot") {
+        lower(3);   // node
+    }
+}
+
+// process 1 request if there is enough data
+static bool try_one_request(Conn *conn) {
+    if (!conn_sniff(conn)) {
+        return false;   // want read
+    }
+    // the argument views point into `incoming`, the vector is reused.
+    static thread_local std::vector<std::string_view> cmd;
+    const uint8_t *request = NULL;  // the binary body, for forwarding
+    uint32_t len = 0;
+    size_t consumed = 0;
+    if (conn->proto != PROTO_BINARY) {
+        int rv = conn_parse_resp(conn);
+        if (rv == RESP_MORE) {
+            return false;   // want read
+        } else if (rv == RESP_ERROR) {
+            msg(conn->resp.err);
+            conn->want_close = true;
+            return false;   // want close
+        }
+        resp_args(conn, cmd);
+        consumed = conn->resp.pos;
+        if (cmd.empty()) {
+            buf_consume(conn->incoming, consumed);
+            resp_reset(conn->resp);
+            return true;    // a blank line
+        }
+    } else if (conn->frame.on) {
+        int rv = conn_parse_frame(conn);
+        if (rv == RESP_MORE) {
+            return false;   // want read
+        } else if (rv == RESP_ERROR) {
+            msg("bad request");
+            conn->want_close = true;
+            return false;   // want close
+        }
+        conn_args(conn, conn->frame.args, cmd);
+        consumed = conn->frame.pos;
+    } else {
+        // try to parse the protocol: message header
+        if (buf_size(conn->incoming) < 4) {
+            return false;   // want read
+        }
+        memcpy(&len, buf_data(conn->incoming), 4);
+        if (len > k_max_msg) {
+            msg("too long");
+            conn->want_close = true;
+            return false;   // want close
+        }
+        // message body
+        if (4 + len > buf_size(conn->incoming) && len >= k_stream_min) {
+            // want read, parse it as it comes, see `conn_parse_frame()`
+            conn->frame.on = true;
+            conn->frame.len = len;
+            conn->frame.pos = 4;
+            return try_one_request(conn);
+        } else if (4 + len > buf_size(conn->incoming)) {
+            // want read, make room for the whole message up front
+            buf_reserve(conn->incoming, 4 + len - buf_size(conn->incoming));
+            return false;
+        }
+        request = buf_data(conn->incoming) + 4;
+        // got one request, do some application logic.
+        if (parse_req(request, len, cmd) < 0) {
+            msg("bad request");
+            conn->want_close = true;
+            return false;   // want close
+        }
+        consumed = 4 + len;
+    }
+    uint64_t parsed = g_trace_sample ? cycles_now() : 0;
+    size_t shard = cmd_shard(cmd);
+    bool asking = conn->asking;     // only for the request right after it
+    conn->asking = cmd.size() == 1 && cmd[0] == "asking";
+    if (conn->proto != PROTO_BINARY && cmd[0] == "hello" && cmd.size() >= 2
+        && hello_version(cmd[1]) > 0)
+    {
+        conn->proto = (uint8_t)hello_version(cmd[1]);  // this reply is in it
+    }
+    if (conn->repl) {
+        repl_ack(conn, cmd);    // no response, the output is the stream
+    } else if (!cmd.empty() && cmd[0] == "psync" && conn->proto == PROTO_BINARY) {
+        repl_psync(conn, cmd);
+    } else if (shard == k_split_shards) {
+        conn_split(conn, cmd);
+    } else if (shard == g_data.worker->id && conn->inflight.empty()) {
+        // the response is written straight into `outgoing`
+        Response resp;
+        response_begin(resp, conn->outgoing, conn->proto);
+        resp.conn = g_uring ? NULL : conn;  // io_uring sends a flat buffer
+        g_data.asking = asking;
+        g_data.req_blob = conn->sink;
+        do_request(cmd, resp);
+        g_data.asking = false;
+        g_data.req_blob = NULL;
+        uint64_t executed = parsed ? cycles_now() : 0;
+        response_end(resp);
+        if (parsed) {
+            trace_sample(conn, cmd.empty() ? "" : cmd[0], parsed, executed);
+        }
+    } else {
+        if (!request) {
+            // the other shards take the binary format
+            static thread_local Buffer frame;
+            buf_clear(frame);
+            frame_append(frame, cmd.data(), cmd.size());
+            request = buf_data(frame) + 4;
+            len = (uint32_t)buf_size(frame) - 4;
+        }
+        conn_forward(conn, request, len, shard, asking);
+    }
+
+    // application logic done! remove the request message.
+    buf_consume(conn->incoming, consumed);
+    if (conn->proto != PROTO_BINARY) {
+        resp_reset(conn->resp);
+    } else if (conn->frame.on) {
+        frame_reset(conn->frame);
+    }
+    conn_sink_done(conn);
+    // Q: Why not just empty the buffer? See the explanation of "pipelining".
+    return true;        // success
+}
+
+// Fair scheduling: each connection gets `--req-budget` requests per loop
+// iteration, the rest waits in the ready list for the next ones, so a
+// deep pipeline doesn't hold up the other connections. A connection with
+// `--max-output` bytes of responses not yet sent is paused until they
+// are, so that its output can't grow without a limit.
+static uint32_t g_req_budget = 128;
+static size_t g_max_output = 16 << 20;  // 0 for no limit
+const size_t k_max_inflight = 1024;     // forwarded requests per connection
+
+// blobs sent by reference aren't counted, they are not copies
+static bool conn_paused(Conn *conn) {
+    size_t out = buf_size(conn->outgoing) + buf_size(conn->sending);
+    return (g_max_output && out >= g_max_output)
+        || conn->inflight.size() >= k_max_inflight;
+}
+
+// a complete request is buffered, or an invalid one
+static bool conn_has_request(Conn *conn) {
+    if (!conn_sniff(conn)) {
+        return false;
+    }
+    if (conn->proto != PROTO_BINARY) {
+        return conn_parse_resp(conn) != RESP_MORE;
+    } else if (conn->frame.on) {
+        return conn_parse_frame(conn) != RESP_MORE;
+    }
+    uint32_t len = 0;
+    memcpy(&len, buf_data(conn->incoming), 4);
+    return len > k_max_msg || 4 + (size_t)len <= buf_size(conn->incoming);
+}
+
+static void conn_set_ready(Conn *conn) {
+    if (dlist_empty(&conn->ready_node)) {
+        dlist_insert_before(&g_data.ready_list, &conn->ready_node);
+    }
+}
+
+// Execute the buffered requests within the budget. Returns true if it
+// ran out with requests left over, the connection is then ready.
+static bool conn_process(Conn *conn) {
+    if (conn->budget_iter != g_data.iter) {
+        conn->budget_iter = g_data.iter;
+        conn->budget = g_req_budget;
+    }
+    size_t nreq = 0;
+    while (conn->budget > 0 && !conn_paused(conn) && try_one_request(conn)) {
+        conn->budget--;
+        nreq++;
+    }
+    // Q: Why calling this in a loop? See the explanation of "pipelining".
+    if (nreq) {
+        hist_add(g_data.worker->pipeline, nreq);
+    }
+    if (conn->repl && !conn->want_close) {
+        repl_fill(conn);
+    }
+    bool more = conn->budget == 0 && !conn->want_close && conn_has_request(conn);
+    if (more) {
+        conn_set_ready(conn);
+    }
+    return more;
+}
+
+// resume a connection after its output was sent
+static void conn_wake(Conn *conn) {
+    if (conn->fd >= 0 && !conn_paused(conn)
+        && (conn_has_request(conn) || conn->read_stopped || conn->repl))
+    {
+        conn_set_ready(conn);
+    }
+}
+
+// update epoll events for a connection, only if they changed
+static void conn_update_epoll(int epoll_fd, Conn *conn) {
+    uint32_t events = conn_epoll_mask(conn);
+    if (events == conn->epoll_mask) {
+        stat_inc(g_data.worker->epoll_ctl_saved);
+        return;
+    }
+    struct epoll_event ev = {};
+    ev.data.ptr = conn;
+    ev.events = events;
+    // Use EPOLL_CTL_MOD to update the existing registration
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) < 0) {
+        msg_errno("epoll_ctl MOD error");
+    }
+    conn->epoll_mask = events;
+    stat_inc(g_data.worker->epoll_ctl_mod);
+}
+
+// With fsync always, the responses generated in a loop iteration are only
+// sent after the log of the iteration is synced, see `aof_flush()`.
+static bool aof_hold(Conn *conn) {
+    Worker *w = g_data.worker;
+    if (g_aof_fsync != FSYNC_ALWAYS || buf_size(w->aof_buf) == 0) {
+        return false;
+    }
+    if (!conn->aof_wait) {
+        conn->aof_wait = true;
+        w->aof_waiting.push_back(conn);
+    }
+    return true;
+}
+
+// move to the end of the idle list, which is sorted by the activity time
+static void conn_touch(Conn *conn) {
+    conn->last_active_ms = g_data.now_ms;
+    dlist_detach(&conn->idle_node);
+    dlist_insert_before(&g_data.idle_list, &conn->idle_node);
+}
+
+const int k_max_iov = 64;
+
+// Send the output interleaved with the referenced values in 1 syscall.
+// A zerocopy send only covers blobs: the kernel reads the memory after
+// `sendmsg()` returns, and `outgoing` is reused right away. Its blobs
+// are pinned under the id of the send.
+static ssize_t conn_sendmsg(Conn *conn) {
+    struct iovec iov[k_max_iov];
+    int n = 0;
+    uint8_t *data = buf_data(conn->outgoing);
+    uint64_t pos = conn->out_base;  // the stream offset sent up to
+    bool zc = conn->zerocopy && conn->outrefs.front().at == pos;
+    size_t nrefs = 0;
+    for (OutRef &ref : conn->outrefs) {
+        if (ref.at > pos) {
+            if (zc || n + 2 > k_max_iov) {
+                break;
+            }
+            iov[n++] = {data + (pos - conn->out_base), (size_t)(ref.at - pos)};
+            pos = ref.at;
+        }
+        if (conn->zerocopy && !zc) {
+            break;      // the bytes in front of a blob go alone
+        }
+        if (n + 1 > k_max_iov) {
+            break;
+        }
+        iov[n++] = {(void *)ref.data, ref.len};
+        nrefs++;
+    }
+    uint64_t end = conn->out_base + buf_size(conn->outgoing);
+    if (!zc && nrefs == conn->outrefs.size() && pos < end && n < k_max_iov) {
+        iov[n++] = {data + (pos - conn->out_base), (size_t)(end - pos)};
+    }
+
+    struct msghdr mh = {};
+    mh.msg_iov = iov;
+    mh.msg_iovlen = (size_t)n;
+    ssize_t rv = sendmsg(conn->fd, &mh, MSG_NOSIGNAL | (zc ? MSG_ZEROCOPY : 0));
+    if (rv < 0 && errno == ENOBUFS && zc) {
+        rv = sendmsg(conn->fd, &mh, MSG_NOSIGNAL);  // out of pinnable memory
+    } else if (rv > 0 && zc) {
+        uint32_t id = conn->zc_next++;
+        for (size_t i = 0; i < nrefs; i++) {
+            Blob *blob = conn->outrefs[i].blob;
+            blob->refs++;
+            conn->zc_pins.emplace_back(id, blob);
+        }
+    }
+    return rv;
+}
+
+// remove `n` sent bytes from the front of the output stream
+static void conn_consume_out(Conn *conn, size_t n) {
+    while (n > 0) {
+        if (!conn->outrefs.empty() && conn->outrefs.front().at == conn->out_base) {
+            OutRef &ref = conn->outrefs.front();
+            size_t k = n < ref.len ? n : ref.len;
+            ref.data += k;
+            ref.len -= k;
+            n -= k;
+            if (ref.len == 0) {
+                blob_unref(ref.blob);
+                conn->outrefs.pop_front();
+            }
+            continue;
+        }
+        size_t avail = conn->outrefs.empty() ? buf_size(conn->outgoing)
+            : (size_t)(conn->outrefs.front().at - conn->out_base);
+        size_t k = n < avail ? n : avail;
+        buf_consume(conn->outgoing, k);
+        conn->out_base += k;
+        n -= k;
+    }
+}
+
+// Read the MSG_ZEROCOPY completions from the error queue, which wakes
+// epoll with EPOLLERR. Returns false if the error is a real one.
+// `fd` is the socket, which outlives `conn->fd` for the pins.
+static bool conn_zerocopy_done(Conn *conn, int fd) {
+    if (!conn->zerocopy) {
+        return false;
+    }
+    while (true) {
+        char control[128];
+        struct msghdr mh = {};
+        mh.msg_control = control;
+        mh.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &mh, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            break;  // EAGAIN: drained
+        }
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm)) {
+            bool recverr = (cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+                || (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR);
+            if (!recverr) {
+                continue;
+            }
+            const struct sock_extended_err *ee =
+                (const struct sock_extended_err *)CMSG_DATA(cm);
+            if (ee->ee_errno != 0 || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            // the sends [ee_info, ee_data] are complete, in order
+            uint32_t last = ee->ee_data;
+            std::deque<std::pair<uint32_t, Blob *>> &pins = conn->zc_pins;
+            while (!pins.empty() && (int32_t)(pins.front().first - last) <= 0) {
+                blob_unref(pins.front().second);
+                pins.pop_front();
+            }
+        }
+    }
+    int err = 0;
+    socklen_t len = sizeof(err);
+    getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    return err == 0;
+}
+
+// application callback when the socket is writable.
+// With EPOLLET, keep writing until `outgoing` is empty or the socket is full.
+static void handle_write(int epoll_fd, Conn *conn) {
+    assert(conn_has_output(conn));
+    if (aof_hold(conn)) {
+        return;
+    }
+    do {
+        // large values take the scatter-gather path
+        ssize_t rv = conn->outrefs.empty()
+            ? send(conn->fd, buf_data(conn->outgoing), buf_size(conn->outgoing),
+                MSG_NOSIGNAL)
+            : conn_sendmsg(conn);
+        if (rv < 0 && errno == EAGAIN) {
+            break;  // actually not ready
+        }
+        if (rv < 0) {
+            msg_errno("write() error");
+            conn->want_close = true;    // error handling
+            return;
+        }
+        conn_touch(conn);
+        stat_add(g_data.worker->bytes_out, (uint64_t)rv);
+        // remove written data from the output
+        conn_consume_out(conn, (size_t)rv);
+        if (conn->trace_end) {
+            trace_check(conn);
+        }
+    } while (g_epoll_et && conn_has_output(conn));
+
+    // update the readiness intention
+    bool done = !conn_has_output(conn);     // all data written
+    conn->want_read = done;
+    conn->want_write = !done;
+    // update epoll registration, only a partial write changes it
+    conn_update_epoll(epoll_fd, conn);
+    if (done) {
+        conn_wake(conn);
+    }
+}
+
+// application callback when the socket is readable.
+// With EPOLLET, keep reading until the socket is drained.
+// Requests left over go first, and nothing more is read while a
+// connection is out of budget or paused, see `conn_process()`.
+static void handle_read(int epoll_fd, Conn *conn) {
+    conn->read_stopped = conn_process(conn) || conn_paused(conn);
+    while (!conn->read_stopped) {
+        // read some data, straight into the free space of `incoming`
+        size_t cap = 0;
+        uint8_t *dst = conn_read_dst(conn, cap);
+        ssize_t rv = read(conn->fd, dst, cap);
+        if (rv < 0 && errno == EAGAIN) {
+            break;  // actually not ready
+        }
+        // handle IO error
+        if (rv < 0) {
+            msg_errno("read() error");
+            conn->want_close = true;
+            return; // want close
+        }
+        // handle EOF
+        if (rv == 0) {
+            if (buf_size(conn->incoming) == 0) {
+                // msg("client closed");
+            } else {
+                msg("unexpected EOF");
+            }
+            conn->want_close = true;
+            return; // want close
+        }
+        // got some new data
+        conn_touch(conn);
+        conn_read_commit(conn, (size_t)rv);
+        Worker *w = g_data.worker;
+        stat_add(w->bytes_in, (uint64_t)rv);
+        if (g_trace_sample) {
+            g_data.read_tsc = cycles_now();
+        }
+
+        // parse requests and generate responses
+        conn->read_stopped = conn_process(conn) || conn_paused(conn);
+
+        if ((size_t)rv < cap || !g_epoll_et || conn->want_close) {
+            break;  // a short read emptied the socket, skip the EAGAIN
+        }
+    }
+
+    if (conn_has_output(conn)) {    // has a response
+        // The socket is likely ready to write in a request-response protocol,
+        // try to write it without waiting for the next iteration.
+        // epoll is only updated if it's not all written.
+        return handle_write(epoll_fd, conn);
+    }   // else: want read
+}
+
+// a new connection joins the event loop
+static void conn_register(Worker *w, Conn *conn) {
+    // put it into the map
+    if (w->fd2conn.size() <= (size_t)conn->fd) {
+        w->fd2conn.resize(conn->fd + 1);
+    }
+    assert(!w->fd2conn[conn->fd]);
+    w->fd2conn[conn->fd] = conn;
+    conn_touch(conn);   // start the idle timer
+}
+
+// the `Conn` is freed once nothing refers to it anymore
+static void conn_try_release(Conn *conn) {
+    if (conn->inflight.empty() && conn->uring_ops == 0 && !conn->aof_wait
+        && conn->zc_fd < 0)
+    {
+        release_conn(conn);
+    }
+}
+
+// remove a connection from the event loop. The `Conn` itself is kept
+// alive until the replies of its forwarded requests come back.
+static void conn_close(Worker *w, Conn *conn) {
+    if (conn->repl) {
+        std::vector<Conn *> &links = w->repl_conns;
+        links.erase(std::find(links.begin(), links.end(), conn));
+        w->repl_links.store(links.size(), std::memory_order_relaxed);
+        delete conn->repl;
+        conn->repl = NULL;
+    }
+    if (g_uring) {
+        // the pending operations complete with an error or EOF,
+        // the file stays open for them until then.
+        shutdown(conn->fd, SHUT_RDWR);
+    } else if (!conn->zc_pins.empty() && conn_zerocopy_done(conn, conn->fd)
+        && !conn->zc_pins.empty())
+    {
+        // The kernel still sends what was queued, from the pinned blobs,
+        // so they can't be reused yet. The socket stays open for the
+        // completions, edge-triggered for the EPOLLHUP of the shutdown.
+        shutdown(conn->fd, SHUT_RDWR);
+        struct epoll_event ev = {};
+        ev.events = conn->epoll_mask = EPOLLERR | EPOLLET;
+        ev.data.ptr = conn;
+        epoll_ctl(w->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+        conn->zc_fd = conn->fd;
+    } else {
+        // remove from epoll
+        epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    }
+    // close and cleanup
+    if (conn->zc_fd < 0) {
+        (void)close(conn->fd);
+    }
+    w->fd2conn[conn->fd] = NULL;
+    conn->fd = -1;
+    dlist_detach(&conn->idle_node);
+    dlist_init(&conn->idle_node);
+    dlist_detach(&conn->ready_node);
+    dlist_init(&conn->ready_node);
+    conn_try_release(conn);
+}
+
+// An EPOLLERR of a closed connection still holding zerocopy pins. A real
+// error means the queue was dropped, and nothing more reaches the peer.
+static void conn_zc_linger(Worker *w, Conn *conn) {
+    if (conn_zerocopy_done(conn, conn->zc_fd) && !conn->zc_pins.empty()) {
+        return;     // more to come
+    }
+    epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, conn->zc_fd, NULL);
+    (void)close(conn->zc_fd);
+    conn->zc_fd = -1;
+    conn_try_release(conn);
+}
+
+// what a completion is for, in the low bits of its `user_data`
+enum {
+    UR_ACCEPT = 1,
+    UR_WAKE = 2,
+    UR_RECV = 3,
+    UR_SEND = 4,
+};
+
+static uint64_t ur_data(uint64_t op, Conn *conn) {
+    return (uint64_t)(uintptr_t)conn | op;
+}
+
+static void uring_send_buf(Worker *w, Conn *conn) {
+    const size_t k_max_send = 1 << 30;
+    size_t len = buf_size(conn->sending);
+    struct io_uring_sqe *sqe = uring_get_sqe(&w->ring);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf_data(conn->sending);
+    sqe->len = (uint32_t)(len < k_max_send ? len : k_max_send);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = ur_data(UR_SEND, conn);
+    conn->uring_ops++;
+}
+
+// One send at a time: `outgoing` is swapped into `sending`, so that the
+// responses generated meanwhile don't move the memory under the kernel.
+// The sends queued by a loop iteration are submitted together.
+static void uring_send(Worker *w, Conn *conn) {
+    if (conn->fd < 0 || buf_size(conn->sending) || !buf_size(conn->outgoing)) {
+        return;
+    }
+    if (aof_hold(conn)) {
+        return;
+    }
+    buf_swap(conn->sending, conn->outgoing);
+    uring_send_buf(w, conn);
+}
+
+// send the responses that became ready
+static void conn_send(Worker *w, Conn *conn) {
+    if (g_uring) {
+        return uring_send(w, conn);
+    }
+    if (conn_has_output(conn) && !conn->want_write) {
+        handle_write(w->epoll_fd, conn);
+    }
+}
+
+// a forwarded request has been executed by its owner
+static void handle_reply(Worker *w, Forward *f) {
+    if (f->whole) {
+        Forward *whole = f->whole;
+        if (!whole->split) {
+            forward_free(f);    // the response of the origin stands for all
+        }
+        if (--whole->parts) {
+            return;
+        }
+        f = whole;
+    }
+    Conn *conn = f->conn;
+    f->done = true;
+    conn_flush_inflight(conn);
+    if (conn->fd < 0) {     // already closed
+        conn_try_release(conn);
+        return;
+    }
+    conn_send(w, conn);
+    conn_wake(conn);    // may have been paused by `k_max_inflight`
+    if (conn->want_close) {
+        conn_close(w, conn);
+    }
+}
+
+// the result of a forwarded request, held like the local responses
+static void aof_reply(Worker *w, Forward *f) {
+    if (g_aof_fsync == FSYNC_ALWAYS && buf_size(w->aof_buf) > 0) {
+        w->aof_replies.push_back(f);
+    } else {
+        worker_send(f->origin, f);
+    }
+}
+
+static void repl_apply(Worker *w, Forward *f);
+
+// process messages from other workers: requests for the keys we own,
+// and replies to the requests we forwarded.
+// A wakeup may also be for the replicas: more of the stream.
+static void handle_inbox(Worker *w) {
+    uint64_t cnt = 0;
+    if (read(w->wake_fd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN) {
+        msg_errno("eventfd read() error");
+    }
+    Forward *list = w->inbox.exchange(NULL, std::memory_order_acquire);
+    // it's a LIFO stack, reverse it to keep the order of each sender
+    Forward *fifo = NULL;
+    while (list) {
+        Forward *next = list->next;
+        list->next = fifo;
+        fifo = list;
+        list = next;
+    }
+    while (fifo) {
+        Forward *f = fifo;
+        fifo = f->next;
+        if (f->repl) {
+            repl_apply(w, f);
+            delete f;
+        } else if (f->origin == w) {
+            handle_reply(w, f);
+        } else {
+            forward_execute(f);
+            aof_reply(w, f);
+        }
+    }
+    for (Conn *conn : w->repl_conns) {
+        conn_set_ready(conn);
+    }
+}
+
+static void snap_poll(Worker *w);
+static void repl_poll(Worker *w);
+
+const uint64_t k_stats_tick_ms = 1000;
+
+// the epoll_wait() timeout for the nearest timer, -1 for none
+static int next_timer_ms() {
+    uint64_t next_ms = (uint64_t)-1;
+    // idle timers using a linked list
+    if (g_idle_timeout_ms && !dlist_empty(&g_data.idle_list)) {
+        Conn *conn = container_of(g_data.idle_list.next, Conn, idle_node);
+        next_ms = conn->last_active_ms + g_idle_timeout_ms;
+    }
+    // TTL timers using a heap
+    if (!g_data.heap.empty() && g_data.heap[0].val < next_ms) {
+        next_ms = g_data.heap[0].val;
+    }
+    // poll for the end of an AOF rewrite or a snapshot
+    Worker *w = g_data.worker;
+    bool child = w->aof_child > 0 || w->snap_child > 0 || w->repl_child > 0;
+    if (child && g_data.now_ms + 100 < next_ms) {
+        next_ms = g_data.now_ms + 100;
+    }
+    // update the rates, see `stats_tick()`
+    if (g_data.stats_tick_ms + k_stats_tick_ms < next_ms) {
+        next_ms = g_data.stats_tick_ms + k_stats_tick_ms;
+    }
+    // don't sleep with a resize in progress, see `rehash_step()`,
+    // with requests left over, see `conn_process()`, a slot migration,
+    // keys to evict or to free
+    if (hm_rehashing(&g_data.db) || !dlist_empty(&g_data.ready_list)
+        || g_data.migrate_slot >= 0 || evict_due() || lazy_due())
+    {
+        return 0;
+    }
+    // timeout value
+    if (next_ms == (uint64_t)-1) {
+        return -1;  // no timers, no timeouts
+    }
+    uint64_t now_ms = get_monotonic_msec();
+    if (next_ms <= now_ms) {
+        return 0;   // missed?
+    }
+    return (int)(next_ms - now_ms);
+}
+
+const size_t k_max_works = 2000;    // expired keys per loop iteration
+
+// Requests move the keys of a resize along with their own work, about
+// `k_rehash_iter_work` keys per loop iteration in total: fewer per request
+// when busy, more when there are few. An idle loop doesn't wait for
+// requests, it finishes the resize in slices of `k_rehash_idle_us`, so
+// that lookups don't keep probing 2 tables after the traffic stops.
+const size_t k_rehash_iter_work = 16 * 1024;
+const size_t k_rehash_idle_batch = 1024;    // keys between clock reads
+const uint64_t k_rehash_idle_us = 1000;
+
+static void rehash_step(Worker *w, bool idle) {
+    HMap *db = &g_data.db;
+    hm_set_rehash_work(k_rehash_iter_work / std::max<uint64_t>(g_data.nreq, 1));
+    g_data.nreq = 0;
+    if (idle && hm_rehashing(db)) {
+        uint64_t t0 = get_monotonic_usec();
+        size_t moved = 0;
+        do {
+            moved += hm_migrate(db, k_rehash_idle_batch);
+        } while (hm_rehashing(db) && get_monotonic_usec() - t0 < k_rehash_idle_us);
+        stat_add(w->rehash_idle_keys, moved);
+    }
+    // metrics, in loop iterations, a resize that starts and ends in the
+    // same one isn't seen
+    bool live = hm_rehashing(db);
+    if (live && !g_data.rehashing) {
+        g_data.rehash_since_ms = g_data.now_ms;
+        stat_inc(w->rehash_count);
+    } else if (!live && g_data.rehashing) {
+        stat_add(w->rehash_live_ms, get_monotonic_msec() - g_data.rehash_since_ms);
+    }
+    g_data.rehashing = live;
+    w->rehash_pending.store(db->older.size, std::memory_order_relaxed);
+    w->db_keys.store(hm_size(db), std::memory_order_relaxed);
+    w->db_slots.store(db->newer.mask + 1 + (live ? db->older.mask + 1 : 0),
+        std::memory_order_relaxed);
+}
+
+// Eviction runs in the event loop, not in the writes, so that a write
+// costs the same at the limit: `k_evict_us` per loop iteration, and the
+// loop doesn't sleep while still over. Only when the writes outpace it
+// by 1/16 of the limit does it evict until back under that.
+const size_t k_evict_samples = 5;       // keys compared per eviction
+const size_t k_evict_batch = 64;        // keys between clock reads
+const uint64_t k_evict_us = 1000;
+
+// evict the best of a few random keys, false if there is none
+static bool evict_one(Worker *w) {
+    Entry *best = NULL;
+    uint64_t best_score = 0;
+    for (size_t i = 0; i < k_evict_samples; i++) {
+        HNode *node = hm_sample(&g_data.db, rand_u64());
+        if (!node) {
+            return false;
+        }
+        Entry *ent = container_of(node, Entry, node);
+        uint64_t score = evict_score(ent);
+        if (!best || score > best_score) {
+            best = ent;
+            best_score = score;
+        }
+    }
+    if (!entry_expired(best)) {
+        aof_feed_del(w, entry_key(best));
+        stat_inc(w->evicted_keys);
+    }
+    db_remove(best);
+    return true;
+}
+
+static void evict_step(Worker *w) {
+    w->used_memory.store(shard_mem(), std::memory_order_relaxed);
+    if (!evict_due()) {
+        return;
+    }
+    uint64_t t0 = get_monotonic_usec();
+    size_t hard = g_shard_maxmemory + g_shard_maxmemory / 16;
+    do {
+        for (size_t i = 0; i < k_evict_batch && mem_over(); i++) {
+            if (!evict_one(w)) {
+                return;
+            }
+        }
+    } while (mem_over() && (get_monotonic_usec() - t0 < k_evict_us || shard_mem() > hard));
+    w->used_memory.store(shard_mem(), std::memory_order_relaxed);
+}
+
+// The keys of a dropped table, and the members of a large set, are freed
+// in steps like a resize: `k_lazy_work` per loop iteration, without
+// sleeping until done. Their memory is already out of `shard_mem()`.
+const size_t k_lazy_work = 4096;
+
+static void lazy_step(Worker *w) {
+    if (lazy_due()) {
+        lazy_work(k_lazy_work);
+    }
+    w->lazy_pending.store(g_data.lazy_dbs.size() + g_data.lazy_zsets.size(),
+        std::memory_order_relaxed);
+    w->lazy_objects.store(t_lazy_objs, std::memory_order_relaxed);
+}
+
+// the rates of the last second
+static void stats_tick(Worker *w) {
+    uint64_t elapsed = g_data.now_ms - g_data.stats_tick_ms;
+    if (elapsed < k_stats_tick_ms) {
+        return;
+    }
+    for (CmdStats &st : w->cmds) {
+        uint64_t calls = st.calls.load(std::memory_order_relaxed);
+        st.ops_sec.store((calls - st.calls_last) * 1000 / elapsed, std::memory_order_relaxed);
+        st.calls_last = calls;
+    }
+    uint64_t lag = 0;
+    for (Conn *conn : w->repl_conns) {
+        ReplLink *link = conn->repl;
+        lag += link->shard->repl_offset.load(std::memory_order_relaxed) - link->ack;
+    }
+    w->repl_lag_bytes.store(lag, std::memory_order_relaxed);
+    g_data.stats_tick_ms = g_data.now_ms;
+}
+
+static void process_timers(Worker *w) {
+    // idle timers using a linked list
+    while (g_idle_timeout_ms && !dlist_empty(&g_data.idle_list)) {
+        Conn *conn = container_of(g_data.idle_list.next, Conn, idle_node);
+        uint64_t next_ms = conn->last_active_ms + g_idle_timeout_ms;
+        if (next_ms > g_data.now_ms) {
+            break;  // not expired
+        }
+        stat_inc(w->idle_closed);
+        conn_close(w, conn);
+    }
+    // TTL timers using a heap, a bounded amount of work so that
+    // a mass expiration doesn't stall the event loop
+    std::vector<HeapItem> &heap = g_data.heap;
+    size_t nworks = 0;
+    while (!heap.empty() && heap[0].val <= g_data.now_ms && nworks++ < k_max_works) {
+        Entry *ent = container_of(heap[0].ref, Entry, heap_idx);
+        db_remove(ent);     // also removes it from the heap
+    }
+    // background saves
+    snap_poll(w);
+    repl_poll(w);
+    stats_tick(w);
+}
+
+static std::string aof_file(size_t id) {
+    return std::string(g_aof_path) + "." + std::to_string(id);
+}
+
+static bool write_all(int fd, const uint8_t *data, size_t size) {
+    while (size > 0) {
+        ssize_t rv = write(fd, data, size);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv <= 0) {
+            return false;
+        }
+        data += rv;
+        size -= (size_t)rv;
+    }
+    return true;
+}
+
+static void frame_header(Buffer &buf) {
+    char shards[24], seed[24];
+    std::string_view args[4] = {
+        "aof", "1", int2str(shards, (int64_t)g_workers.size()),
+        std::string_view(seed, (size_t)snprintf(seed, sizeof(seed), "%llu",
+            (unsigned long long)g_hash_seed)),
+    };
+    frame_append(buf, args, 4);
+}
+
+const size_t k_rewrite_chunk = 1 << 20;
+
+struct RewriteCtx {
+    int fd = -1;
+    uint64_t now_real = 0;
+    Buffer buf;
+    bool ok = true;
+};
+
+// the commands that rebuild a key, each after an `asking` for a slot
+// migration. Returns the number of frames.
+static size_t entry_frames(Buffer &buf, Entry *ent, uint64_t now_real, bool asking) {
+    static const std::string_view k_asking = "asking";
+    size_t n = 0;
+    auto next = [&]() {     // before each frame
+        if (asking) {
+            frame_append(buf, &k_asking, 1);
+            n++;
+        }
+        n++;
+    };
+    std::string_view key = entry_key(ent);
+    if (ent->type == T_STR) {
+        std::string_view args[3] = {"set", key, entry_val(ent)};
+        next();
+        frame_append(buf, args, 3);
+    } else {
+        ZNode *znode = zset_at(ent->zset, 0);
+        for (; znode; znode = znode_offset(znode, +1)) {
+            char text[32];
+            std::string_view args[4] = {
+                "zadd", key, dbl2str(text, znode->score), znode_name(znode),
+            };
+            next();
+            frame_append(buf, args, 4);
+        }
+    }
+    if (ent->heap_idx != (size_t)-1) {
+        next();
+        frame_pexpireat(buf, ent, now_real);
+    }
+    return n;
+}
+
+static bool rewrite_entry(HNode *node, void *arg) {
+    RewriteCtx &ctx = *(RewriteCtx *)arg;
+    Entry *ent = container_of(node, Entry, node);
+    if (entry_expired(ent)) {
+        return true;
+    }
+    entry_frames(ctx.buf, ent, ctx.now_real, false);
+    if (buf_size(ctx.buf) >= k_rewrite_chunk) {
+        ctx.ok = write_all(ctx.fd, buf_data(ctx.buf), buf_size(ctx.buf));
+        buf_clear(ctx.buf);
+    }
+    return ctx.ok;
+}
+
+// The forked child sees this shard as it was at the fork: each key is
+// written as the commands that rebuild it. It only ever reads the data.
+[[noreturn]] static void aof_rewrite_child(int fd) {
+    RewriteCtx ctx;
+    ctx.fd = fd;
+    ctx.now_real = get_realtime_msec();
+    frame_header(ctx.buf);
+    hm_foreach(&g_data.db, rewrite_entry, &ctx);
+    bool ok = ctx.ok && write_all(fd, buf_data(ctx.buf), buf_size(ctx.buf))
+        && fdatasync(fd) == 0;
+    _exit(ok ? 0 : 1);
+}
+
+// start a rewrite once asked, or when the file doubled since the last one
+const size_t k_aof_rewrite_min = 64 << 20;
+
+static bool aof_rewrite_due(Worker *w) {
+    bool grown = w->aof_size >= k_aof_rewrite_min
+        && w->aof_size >= 2 * w->aof_base_size;
+    if (!grown && !w->aof_rewrite.load(std::memory_order_relaxed)) {
+        return false;
+    }
+    std::lock_guard<std::mutex> guard(w->aof_lock);
+    return w->aof_old_fd < 0;   // wait for the previous file to be closed
+}
+
+static void aof_rewrite_start(Worker *w) {
+    w->aof_rewrite.store(false, std::memory_order_relaxed);
+    w->aof_base_size = w->aof_size;     // don't retry on failures
+    std::string tmp = aof_file(w->id) + ".rewrite";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        msg_errno("AOF rewrite open() error");
+        return;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        aof_rewrite_child(fd);
+    }
+    close(fd);
+    if (pid < 0) {
+        msg_errno("fork() error");
+        return;
+    }
+    w->aof_child = pid;
+}
+
+// the child is done: append what was written meanwhile, then switch files
+static void aof_rewrite_done(Worker *w, int status) {
+    w->aof_child = -1;
+    std::string path = aof_file(w->id);
+    std::string tmp = path + ".rewrite";
+    int fd = -1;
+    bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    if (ok) {
+        fd = open(tmp.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+        ok = fd >= 0
+            && write_all(fd, buf_data(w->aof_rwbuf), buf_size(w->aof_rwbuf))
+            && (g_aof_fsync != FSYNC_ALWAYS || fdatasync(fd) == 0)
+            && rename(tmp.c_str(), path.c_str()) == 0;
+    }
+    buf_clear(w->aof_rwbuf);
+    buf_trim(w->aof_rwbuf, 0);
+    if (!ok) {
+        msg("AOF rewrite failed");
+        if (fd >= 0) {
+            close(fd);
+        }
+        unlink(tmp.c_str());
+        return;
+    }
+    // on an error, the old log, which went on with the same records, is
+    // an upper bound that doesn't start another rewrite right away
+    struct stat st = {};
+    if (fstat(fd, &st) == 0) {
+        w->aof_size = (size_t)st.st_size;
+    } else {
+        msg_errno("AOF fstat() error");
+    }
+    w->aof_base_size = w->aof_size;
+    std::lock_guard<std::mutex> guard(w->aof_lock);
+    w->aof_old_fd = w->aof_fd;  // closing it may free a large file
+    w->aof_fd = fd;
+    w->aof_dirty.store(true, std::memory_order_relaxed);
+}
+
+const uint64_t k_repl_ping_ms = 1000;
+
+// The log of the iteration goes into the replication stream too, with a
+// `replping <wall clock>` every second for the replicas to measure the lag.
+// Then the workers with links are woken up to send it.
+static void repl_feed(Worker *w) {
+    static thread_local Buffer ping;
+    buf_clear(ping);
+    if (g_data.now_ms >= g_data.repl_ping_ms + k_repl_ping_ms) {
+        g_data.repl_ping_ms = g_data.now_ms;
+        char text[24];
+        std::string_view args[2] = {
+            "replping", int2str(text, (int64_t)get_realtime_msec()),
+        };
+        frame_append(ping, args, 2);
+    }
+    if (buf_size(w->aof_buf) + buf_size(ping) == 0) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> guard(w->repl_lock);
+        std::vector<uint8_t> &ring = w->repl_ring;
+        uint64_t offset = w->repl_offset.load(std::memory_order_relaxed);
+        auto put = [&](const uint8_t *data, size_t n) {
+            // only the last `ring.size()` bytes are kept
+            if (n > ring.size()) {
+                offset += n - ring.size();
+                data += n - ring.size();
+                n = ring.size();
+            }
+            size_t at = (size_t)(offset % ring.size());
+            size_t first = std::min(n, ring.size() - at);
+            memcpy(&ring[at], data, first);
+            memcpy(&ring[0], data + first, n - first);
+            offset += n;
+        };
+        put(buf_data(w->aof_buf), buf_size(w->aof_buf));
+        put(buf_data(ping), buf_size(ping));
+        w->repl_offset.store(offset, std::memory_order_relaxed);
+    }
+    for (Worker *other : g_workers) {
+        if (other->repl_links.load(std::memory_order_relaxed)) {
+            worker_wake(other);
+        }
+    }
+}
+
+// Group commit, once per loop iteration: the log of the iteration is
+// written with 1 syscall, and synced before the held responses go out.
+static void aof_flush(Worker *w) {
+    if (w->repl_on.load(std::memory_order_relaxed)) {
+        repl_feed(w);
+    }
+    if (w->aof_fd < 0) {
+        buf_clear(w->aof_buf);  // only fed for the replicas
+        return;
+    }
+    if (size_t n = buf_size(w->aof_buf)) {
+        if (!write_all(w->aof_fd, buf_data(w->aof_buf), n)) {
+            die("AOF write()");
+        }
+        if (w->aof_child > 0) {
+            buf_append(w->aof_rwbuf, buf_data(w->aof_buf), n);
+        }
+        w->aof_size += n;
+        buf_clear(w->aof_buf);
+        buf_trim(w->aof_buf, k_conn_buf);
+        if (g_aof_fsync == FSYNC_ALWAYS) {
+            if (fdatasync(w->aof_fd) < 0) {
+                die("AOF fdatasync()");
+            }
+        } else {
+            w->aof_dirty.store(true, std::memory_order_relaxed);
+        }
+    }
+    // release the held responses
+    for (Forward *f : w->aof_replies) {
+        worker_send(f->origin, f);
+    }
+    w->aof_replies.clear();
+    std::vector<Conn *> waiting;
+    waiting.swap(w->aof_waiting);
+    for (Conn *conn : waiting) {
+        conn->aof_wait = false;
+        if (conn->fd < 0) {
+            conn_try_release(conn);
+            continue;
+        }
+        // not `conn_send()`: a held write may have consumed an EPOLLET edge
+        if (g_uring) {
+            uring_send(w, conn);
+        } else if (conn_has_output(conn)) {
+            handle_write(w->epoll_fd, conn);
+        }
+        if (conn->want_close) {
+            conn_close(w, conn);
+        }
+    }
+    // the rewrite starts with nothing buffered, the child has it all
+    if (w->aof_child > 0) {
+        int status = 0;
+        if (waitpid(w->aof_child, &status, WNOHANG) == w->aof_child) {
+            aof_rewrite_done(w, status);
+        }
+    } else if (aof_rewrite_due(w)) {
+        aof_rewrite_start(w);
+    }
+}
+
+// fsync everysec, and close the files replaced by rewrites, off the loops
+static void aof_bio_run() {
+    while (true) {
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        for (Worker *w : g_workers) {
+            int fd = -1, old_fd = -1;
+            {
+                std::lock_guard<std::mutex> guard(w->aof_lock);
+                if (g_aof_fsync == FSYNC_EVERYSEC
+                    && w->aof_dirty.exchange(false, std::memory_order_relaxed))
+                {
+                    fd = dup(w->aof_fd);    // survives a swap meanwhile
+                }
+                std::swap(old_fd, w->aof_old_fd);
+            }
+            if (fd >= 0) {
+                if (fdatasync(fd) < 0) {
+                    msg_errno("AOF fdatasync() error");
+                }
+                close(fd);
+            }
+            if (old_fd >= 0) {
+                close(old_fd);
+            }
+        }
+    }
+}
+
+// read the header of a shard's file, false if it's missing or empty
+static bool aof_read_header(size_t id, std::vector<std::string> &out) {
+    FILE *fp = fopen(aof_file(id).c_str(), "rb");
+    if (!fp) {
+        return false;
+    }
+    uint32_t len = 0;
+    std::vector<uint8_t> body;
+    bool ok = fread(&len, 4, 1, fp) == 1 && len <= 4096;
+    if (ok) {
+        body.resize(len);
+        ok = fread(body.data(), 1, len, fp) == len;
+    }
+    fclose(fp);
+    std::vector<std::string_view> cmd;
+    if (ok && parse_req(body.data(), body.size(), cmd) == 0) {
+        out.assign(cmd.begin(), cmd.end());
+    } else {
+        out.clear();
+    }
+    return ok || len > 0;
+}
+
+// The files of a previous run must be for the same shards: as many
+// workers, and the hash seed they were written with, which is reused.
+static bool aof_check(size_t nshards) {
+    for (size_t id = 0; id <= nshards; id++) {
+        std::vector<std::string> header;
+        if (!aof_read_header(id, header)) {
+            continue;
+        }
+        if (header.size() != 4 || header[0] != "aof" || header[1] != "1") {
+            fprintf(stderr, "%s: not an AOF\n", aof_file(id).c_str());
+            return false;
+        }
+        if (id == nshards || header[2] != std::to_string(nshards)) {
+            fprintf(stderr, "%s: written with --threads %s\n",
+                aof_file(id).c_str(), header[2].c_str());
+            return false;
+        }
+        g_hash_seed = strtoull(header[3].c_str(), NULL, 10);
+    }
+    return true;
+}
+
+// Replay the log of this shard before serving anything. A record cut
+// short by a crash is truncated away.
+static void aof_load(Worker *w) {
+    std::string path = aof_file(w->id);
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        die("AOF open()");
+    }
+    struct stat st = {};
+    if (fstat(fd, &st) < 0) {
+        die("AOF fstat()");
+    }
+    size_t size = (size_t)st.st_size, pos = 0, nreq = 0;
+    if (size > 0) {
+        void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            die("AOF mmap()");
+        }
+        madvise(map, size, MADV_SEQUENTIAL);
+        const uint8_t *data = (const uint8_t *)map;
+        std::vector<std::string_view> cmd;
+        Buffer scratch;
+        g_data.loading = true;
+        while (size - pos >= 4) {
+            uint32_t len = 0;
+            memcpy(&len, data + pos, 4);
+            if (size - pos - 4 < len) {
+                break;      // incomplete
+            }
+            if (parse_req(data + pos + 4, len, cmd) < 0) {
+                fprintf(stderr, "%s: bad record at %zu\n", path.c_str(), pos);
+                exit(1);
+            }
+            if (nreq++ > 0) {   // after the header
+                Response resp;
+                response_begin(resp, scratch);
+                do_request(cmd, resp);
+                buf_clear(scratch);
+            }
+            pos += 4 + len;
+        }
+        g_data.loading = false;
+        munmap(map, size);
+        if (pos < size) {
+            fprintf(stderr, "%s: truncating a partial record at %zu\n",
+                path.c_str(), pos);
+            if (ftruncate(fd, (off_t)pos) < 0) {
+                die("AOF ftruncate()");
+            }
+        }
+        fprintf(stderr, "%s: %zu records loaded\n", path.c_str(), nreq);
+    }
+    if (pos == 0) {
+        frame_header(w->aof_buf);   // a new file
+    }
+    {
+        std::lock_guard<std::mutex> guard(w->aof_lock);
+        w->aof_fd = fd;
+    }
+    w->aof_size = w->aof_base_size = pos;
+    aof_flush(w);
+}
+
+// Snapshot, `--snapshot PATH`: each shard is saved to `PATH.<id>` by a
+// forked child, and `bgsave` saves all shards as one generation.
+// +--------+---------+-----+---------+-------------------+
+// | header | chunk 1 | ... | chunk n | end (nrec = 0)    |
+// +--------+---------+-----+---------+-------------------+
+// chunk:  | nrec | size | crc32c of the records | records (size bytes) |
+// record: | type (1) | has TTL (1) | klen | key | [expire at, unix ms (8)] | value |
+//  T_STR:  | vlen | bytes |
+//  T_ZSET: | n | score (8) | len | name | ... |
+// Chunks are checksummed separately, so large files are verified as
+// they are loaded instead of in a pass of their own.
+struct SnapHeader {
+    char magic[8];
+    uint32_t shard;
+    uint32_t nshards;
+    uint64_t seed;
+    uint64_t nkeys;
+    uint64_t gen;       // the `bgsave` it's from
+    uint64_t offset;    // in the replication stream, where it continues
+    uint32_t crc;       // of the fields above
+    uint32_t pad;
+};
+
+const char k_snap_magic[8] = {'K', 'V', 'S', 'N', 'A', 'P', '0', '2'};
+const size_t k_snap_chunk = 1 << 20;
+const size_t k_chunk_header = 12;
+
+static uint32_t snap_header_crc(const SnapHeader &h) {
+    return crc32c(0, (const uint8_t *)&h, offsetof(SnapHeader, crc));
+}
+
+struct SnapCtx {
+    int fd = -1;
+    uint64_t now_real = 0;
+    uint64_t nkeys = 0;
+    uint32_t nrec = 0;      // of the current chunk
+    Buffer buf;             // the current chunk
+    bool ok = true;
+};
+
+static void snap_put(Buffer &buf, const void *data, size_t len) {
+    buf_append(buf, (const uint8_t *)data, len);
+}
+
+static void snap_chunk_begin(SnapCtx &ctx) {
+    uint8_t header[k_chunk_header] = {};
+    snap_put(ctx.buf, header, sizeof(header));
+    ctx.nrec = 0;
+}
+
+// patch in the chunk header, then write it out
+static void snap_chunk_end(SnapCtx &ctx) {
+    uint8_t *data = buf_data(ctx.buf);
+    uint32_t size = (uint32_t)(buf_size(ctx.buf) - k_chunk_header);
+    uint32_t crc = crc32c(0, data + k_chunk_header, size);
+    memcpy(data, &ctx.nrec, 4);
+    memcpy(data + 4, &size, 4);
+    memcpy(data + 8, &crc, 4);
+    ctx.ok = ctx.ok && write_all(ctx.fd, data, buf_size(ctx.buf));
+    buf_clear(ctx.buf);
+}
+
+static bool snap_entry(HNode *node, void *arg) {
+    SnapCtx &ctx = *(SnapCtx *)arg;
+    Entry *ent = container_of(node, Entry, node);
+    if (entry_expired(ent)) {
+        return true;
+    }
+    uint8_t type = (uint8_t)ent->type;
+    uint8_t has_ttl = ent->heap_idx != (size_t)-1;
+    snap_put(ctx.buf, &type, 1);
+    snap_put(ctx.buf, &has_ttl, 1);
+    snap_put(ctx.buf, &ent->klen, 4);
+    snap_put(ctx.buf, ent + 1, ent->klen);
+    if (has_ttl) {
+        uint64_t expire_at = g_data.heap[ent->heap_idx].val;
+        uint64_t at = ctx.now_real + (expire_at - g_data.now_ms);
+        snap_put(ctx.buf, &at, 8);
+    }
+    if (ent->type == T_STR) {
+        snap_put(ctx.buf, &ent->vlen, 4);
+        snap_put(ctx.buf, ent->val, ent->vlen);
+    } else {
+        uint32_t n = (uint32_t)zset_size(ent->zset);
+        snap_put(ctx.buf, &n, 4);
+        for (ZNode *znode = zset_at(ent->zset, 0); znode; znode = znode_offset(znode, +1)) {
+            uint32_t len = (uint32_t)znode->len;
+            snap_put(ctx.buf, &znode->score, 8);
+            snap_put(ctx.buf, &len, 4);
+            snap_put(ctx.buf, znode + 1, len);
+        }
+    }
+    ctx.nrec++;
+    ctx.nkeys++;
+    if (buf_size(ctx.buf) >= k_snap_chunk) {
+        snap_chunk_end(ctx);
+        snap_chunk_begin(ctx);
+    }
+    return ctx.ok;
+}
+
+// The forked child sees the shard as it was at the fork.
+static bool snap_write(Worker *w, int fd, uint64_t gen, uint64_t offset) {
+    SnapCtx ctx;
+    ctx.fd = fd;
+    ctx.now_real = get_realtime_msec();
+    SnapHeader h = {};
+    ctx.ok = write_all(ctx.fd, (const uint8_t *)&h, sizeof(h));   // patched below
+    snap_chunk_begin(ctx);
+    hm_foreach(&g_data.db, snap_entry, &ctx);
+    snap_chunk_end(ctx);
+    if (ctx.nrec > 0) {
+        snap_chunk_begin(ctx);
+        snap_chunk_end(ctx);    // the end marker
+    }
+
+    memcpy(h.magic, k_snap_magic, sizeof(h.magic));
+    h.shard = (uint32_t)w->id;
+    h.nshards = (uint32_t)g_workers.size();
+    h.seed = g_hash_seed;
+    h.nkeys = ctx.nkeys;
+    h.gen = gen;
+    h.offset = offset;
+    h.crc = snap_header_crc(h);
+    return ctx.ok && pwrite(ctx.fd, &h, sizeof(h), 0) == (ssize_t)sizeof(h);
+}
+
+// The file is synced and renamed into place by the child,
+// so it's never seen half done.
+[[noreturn]] static void snap_save_child(Worker *w, uint64_t gen) {
+    std::string path = std::string(g_snap_path) + "." + std::to_string(w->id);
+    std::string tmp = path + ".tmp";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool ok = fd >= 0
+        && snap_write(w, fd, gen, w->repl_offset.load(std::memory_order_relaxed))
+        && fdatasync(fd) == 0
+        && rename(tmp.c_str(), path.c_str()) == 0;
+    _exit(ok ? 0 : 1);
+}
+
+// start a requested save, or reap a finished one
+static void snap_poll(Worker *w) {
+    if (w->snap_child > 0) {
+        int status = 0;
+        if (waitpid(w->snap_child, &status, WNOHANG) != w->snap_child) {
+            return;     // still running
+        }
+        w->snap_child = -1;
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            msg("snapshot failed");
+        }
+    }
+    uint64_t gen = w->snap_gen.exchange(0, std::memory_order_relaxed);
+    if (!gen) {
+        return;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        snap_save_child(w, gen);
+    }
+    if (pid < 0) {
+        msg_errno("fork() error");
+    } else {
+        w->snap_child = pid;
+    }
+}
+
+// hand the snapshot to the links waiting for it, -1 if it failed
+static void repl_sync_done(Worker *w, int fd, size_t size) {
+    for (std::shared_ptr<ReplSync> &sync : w->repl_forked) {
+        sync->fd = fd >= 0 ? dup(fd) : -1;
+        sync->size = size;
+        sync->offset = w->repl_child_offset;
+        sync->done.store(true, std::memory_order_release);
+        worker_wake(sync->origin);
+    }
+    w->repl_forked.clear();
+    if (fd >= 0) {
+        close(fd);
+    }
+    w->repl_memfd = -1;
+}
+
+// Take a snapshot for the replicas waiting for a full resync, one for
+// all of them, into a memfd rather than a file. The stream continues
+// where it was at the fork, after the records of this loop iteration
+// that `repl_feed()` appends next.
+static void repl_poll(Worker *w) {
+    if (w->repl_child > 0) {
+        int status = 0;
+        if (waitpid(w->repl_child, &status, WNOHANG) != w->repl_child) {
+            return;     // still running
+        }
+        w->repl_child = -1;
+        struct stat st = {};
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 0
+            && fstat(w->repl_memfd, &st) == 0)
+        {
+            repl_sync_done(w, w->repl_memfd, (size_t)st.st_size);
+        } else {
+            msg("replication snapshot failed");
+            close(w->repl_memfd);
+            repl_sync_done(w, -1, 0);
+        }
+    }
+    {
+        std::lock_guard<std::mutex> guard(w->repl_lock);
+        if (w->repl_syncs.empty()) {
+            return;
+        }
+        w->repl_forked.swap(w->repl_syncs);
+    }
+    w->repl_memfd = memfd_create("repl-snapshot", MFD_CLOEXEC);
+    if (w->repl_memfd < 0) {
+        msg_errno("memfd_create() error");
+        return repl_sync_done(w, -1, 0);
+    }
+    w->repl_child_offset = w->repl_offset.load(std::memory_order_relaxed)
+        + buf_size(w->aof_buf);
+    pid_t pid = fork();
+    if (pid == 0) {
+        _exit(snap_write(w, w->repl_memfd, 0, w->repl_child_offset) ? 0 : 1);
+    }
+    if (pid < 0) {
+        msg_errno("fork() error");
+        close(w->repl_memfd);
+        return repl_sync_done(w, -1, 0);
+    }
+    w->repl_child = pid;
+}
+
+// the files found at startup, all for the same number of shards
+static size_t g_snap_nfiles = 0;
+static uint64_t g_snap_nkeys = 0;
+
+static bool snap_read_header(size_t id, SnapHeader &h) {
+    std::string path = std::string(g_snap_path) + "." + std::to_string(id);
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (!fp) {
+        return false;
+    }
+    bool ok = fread(&h, sizeof(h), 1, fp) == 1;
+    fclose(fp);
+    if (!ok || memcmp(h.magic, k_snap_magic, 8) || h.crc != snap_header_crc(h)) {
+        fprintf(stderr, "%s: not a snapshot\n", path.c_str());
+        exit(1);
+    }
+    return true;
+}
+
+// The shard count comes from file 0; stale files of another shard count
+// are ignored. The hash seed is reused, so that each file still
+// belongs to one shard if the number of workers is the same.
+static void snap_check(size_t nshards) {
+    SnapHeader h0 = {};
+    if (!snap_read_header(0, h0)) {
+        return;     // nothing saved yet
+    }
+    g_hash_seed = h0.seed;
+    for (size_t id = 0; id < h0.nshards; id++) {
+        SnapHeader h = {};
+        if (!snap_read_header(id, h) || h.nshards != h0.nshards || h.seed != h0.seed) {
+            fprintf(stderr, "%s.%zu: missing from the snapshot\n", g_snap_path, id);
+            exit(1);
+        }
+        if (h.gen != h0.gen) {
+            fprintf(stderr, "%s.%zu: from another bgsave\n", g_snap_path, id);
+        }
+        g_snap_nkeys += h.nkeys;
+    }
+    g_snap_nfiles = h0.nshards;
+    if (g_snap_nfiles != nshards) {
+        fprintf(stderr, "%s: saved with --threads %zu, every worker scans all files\n",
+            g_snap_path, g_snap_nfiles);
+    }
+}
+
+static bool snap_load_record(const uint8_t *&cur, const uint8_t *end,
+    bool filter, uint64_t now_real)
+{
+    uint8_t type = 0, has_ttl = 0;
+    uint32_t klen = 0;
+    uint64_t at = 0;
+    std::string_view key;
+    if (cur + 2 > end) {
+        return false;
+    }
+    type = cur[0];
+    has_ttl = cur[1];
+    cur += 2;
+    if (!read_u32(cur, end, klen) || !read_str(cur, end, klen, key)
+        || (has_ttl && !read_u64(cur, end, at)))
+    {
+        return false;
+    }
+    uint64_t hcode = EntryTraits::hash(key);
+    bool mine = !filter || key_shard_of(key) == g_data.worker->id;
+
+    Entry *ent = NULL;
+    if (type == T_STR) {
+        uint32_t vlen = 0;
+        std::string_view val;
+        if (!read_u32(cur, end, vlen) || !read_str(cur, end, vlen, val)) {
+            return false;
+        }
+        if (mine) {
+            ent = entry_new(key, val);
+        }
+    } else if (type == T_ZSET) {
+        uint32_t n = 0;
+        if (!read_u32(cur, end, n)) {
+            return false;
+        }
+        ZSet *zset = NULL;
+        if (mine) {
+            ent = entry_new(key, "");
+            entry_make_zset(ent);
+            zset = ent->zset;
+            hm_reserve(&zset->hmap, n);
+        }
+        for (uint32_t i = 0; i < n; i++) {
+            uint64_t bits = 0;
+            uint32_t len = 0;
+            std::string_view name;
+            if (!read_u64(cur, end, bits) || !read_u32(cur, end, len)
+                || !read_str(cur, end, len, name))
+            {
+                if (ent) {
+                    entry_del(ent);
+                }
+                return false;
+            }
+            if (zset) {
+                double score = 0;
+                memcpy(&score, &bits, 8);
+                entry_zadd(ent, name, score);
+            }
+        }
+    } else {
+        return false;
+    }
+    if (ent) {
+        // keys are unique in a snapshot, no lookup needed
+        ent->node.hcode = hcode;
+        db_insert(ent);
+        if (has_ttl) {
+            entry_set_ttl(ent, at > now_real ? (int64_t)(at - now_real) : 0);
+        }
+    }
+    return true;
+}
+
+// Each worker loads its own file, all in parallel, into a table sized
+// up front. The records are used straight from the mapped file.
+static void snap_load(Worker *w) {
+    if (!g_snap_nfiles) {
+        return;
+    }
+    bool filter = g_snap_nfiles != g_workers.size();
+    hm_reserve(&g_data.db, g_snap_nkeys / g_workers.size());
+    uint64_t now_real = get_realtime_msec();
+    uint64_t t0 = get_monotonic_msec();
+    size_t first = filter ? 0 : w->id;
+    size_t last = filter ? g_snap_nfiles : w->id + 1;
+    for (size_t id = first; id < last; id++) {
+        std::string path = std::string(g_snap_path) + "." + std::to_string(id);
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st = {};
+        if (fd < 0 || fstat(fd, &st) < 0) {
+            die("snapshot open()");
+        }
+        size_t size = (size_t)st.st_size;
+        void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            die("snapshot mmap()");
+        }
+        close(fd);
+        madvise(map, size, MADV_SEQUENTIAL);
+        const uint8_t *cur = (const uint8_t *)map + sizeof(SnapHeader);
+        const uint8_t *end = (const uint8_t *)map + size;
+        bool ok = false;
+        while (true) {
+            uint32_t nrec = 0, len = 0, crc = 0;
+            if (!read_u32(cur, end, nrec) || !read_u32(cur, end, len)
+                || !read_u32(cur, end, crc) || len > (size_t)(end - cur)
+                || crc32c(0, cur, len) != crc)
+            {
+                break;  // truncated or corrupted
+            }
+            const uint8_t *chunk_end = cur + len;
+            uint32_t i = 0;
+            while (i < nrec && snap_load_record(cur, chunk_end, filter, now_real)) {
+                i++;
+            }
+            if (i < nrec || cur != chunk_end) {
+                break;
+            }
+            if (nrec == 0) {
+                ok = cur == end;    // the end marker
+                break;
+            }
+        }
+        munmap(map, size);
+        if (!ok) {
+            fprintf(stderr, "%s: corrupted at offset %zu\n", path.c_str(),
+                (size_t)(cur - ((const uint8_t *)map)));
+            exit(1);
+        }
+    }
+    fprintf(stderr, "snapshot: shard %zu loaded %zu keys in %llu ms\n", w->id,
+        hm_size(&g_data.db), (unsigned long long)(get_monotonic_msec() - t0));
+}
+
+// Replication, the replica side: a thread per worker links to the same
+// shard of the primary, with blocking I/O, and hands what it receives to
+// the worker in batches through the inbox. The primary must have the same
+// `--threads` and hash seed, so that its shards are the same keys.
+enum {
+    REPL_STREAM = 1,    // frames of the stream, executed as requests
+    REPL_CHUNK = 2,     // snapshot records, checked by the thread
+    REPL_RESET = 3,     // a full resync starts, drop all keys
+};
+
+const size_t k_repl_queue_max = 64 << 20;   // received, not applied yet
+const uint64_t k_repl_ack_ms = 1000;
+
+// in the worker, which owns the keys
+static void repl_apply(Worker *w, Forward *f) {
+    const uint8_t *cur = f->req.data();
+    const uint8_t *end = cur + f->req.size();
+    if (f->repl == REPL_RESET) {
+        db_flush();
+        hm_reserve(&g_data.db, f->nrec);
+    } else if (f->repl == REPL_CHUNK) {
+        uint64_t now_real = get_realtime_msec();
+        for (uint32_t i = 0; i < f->nrec; i++) {
+            if (!snap_load_record(cur, end, false, now_real)) {
+                msg("bad snapshot record from the primary");
+                break;
+            }
+        }
+    } else {
+        static thread_local Buffer scratch;  // the responses are dropped
+        static thread_local std::vector<std::string_view> cmd;
+        g_data.repl_applying = true;
+        while (cur < end) {
+            uint32_t len = 0;
+            memcpy(&len, cur, 4);
+            cur += 4;
+            int64_t at = 0;
+            if (parse_req(cur, len, cmd) < 0 || cmd.empty()) {
+                msg("bad request from the primary");
+            } else if (cmd[0] == "replping" && cmd.size() == 2 && str2int(cmd[1], at)) {
+                int64_t lag = (int64_t)get_realtime_msec() - at;
+                w->repl_lag_ms.store(lag > 0 ? (uint64_t)lag : 0, std::memory_order_relaxed);
+            } else {
+                Response resp;
+                response_begin(resp, scratch);
+                do_request(cmd, resp);
+                buf_clear(scratch);
+            }
+            cur += len;
+        }
+        g_data.repl_applying = false;
+        w->repl_applied.store(f->repl_offset, std::memory_order_relaxed);
+    }
+    w->repl_queued.fetch_sub(f->req.size(), std::memory_order_relaxed);
+}
+
+// the worker may lag behind, the thread waits rather than queue without a limit
+static void repl_post(Worker *w, uint32_t type, const uint8_t *data, size_t size,
+    uint32_t nrec, uint64_t offset)
+{
+    while (w->repl_queued.load(std::memory_order_relaxed) > k_repl_queue_max) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    Forward *f = new Forward();
+    f->repl = type;
+    f->nrec = nrec;
+    f->repl_offset = offset;
+    f->req.assign(data, data + size);
+    w->repl_queued.fetch_add(size, std::memory_order_relaxed);
+    worker_send(w, f);
+}
+
+struct ReplConn {
+    Worker *w = NULL;
+    int fd = -1;
+    Buffer in;
+    bool streaming = false;     // acks are sent
+    uint64_t ack_ms = 0;
+};
+
+// blocking I/O, for the links between servers
+static bool send_all(int fd, const uint8_t *data, size_t size) {
+    while (size > 0) {
+        ssize_t rv = send(fd, data, size, MSG_NOSIGNAL);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv <= 0) {
+            return false;
+        }
+        data += rv;
+        size -= (size_t)rv;
+    }
+    return true;
+}
+
+static bool repl_send(ReplConn &rc, const std::string_view *args, size_t n) {
+    Buffer buf;
+    frame_append(buf, args, n);
+    return send_all(rc.fd, buf_data(buf), buf_size(buf));
+}
+
+// receive until `n` bytes are buffered, with the acks sent meanwhile
+static bool repl_recv(ReplConn &rc, size_t n) {
+    while (buf_size(rc.in) < n) {
+        uint64_t now_ms = get_monotonic_msec();
+        if (rc.streaming && now_ms >= rc.ack_ms + k_repl_ack_ms) {
+            rc.ack_ms = now_ms;
+            char text[24];
+            uint64_t applied = rc.w->repl_applied.load(std::memory_order_relaxed);
+            std::string_view args[3] = {"replconf", "ack", int2str(text, (int64_t)applied)};
+            if (!repl_send(rc, args, 3)) {
+                return false;
+            }
+        }
+        buf_reserve(rc.in, std::max(n - buf_size(rc.in), k_min_read));
+        ssize_t rv = recv(rc.fd, buf_tail(rc.in), buf_tail_size(rc.in), 0);
+        if (rv < 0 && (errno == EINTR || errno == EAGAIN)) {
+            continue;   // the receive timeout, for the acks
+        }
+        if (rv <= 0) {
+            return false;
+        }
+        buf_commit(rc.in, (size_t)rv);
+    }
+    return true;
+}
+
+// connect to HOST:PORT, -1 on failure
+static int tcp_connect(std::string_view hostport) {
+    std::string addr(hostport);
+    size_t colon = addr.rfind(':');
+    std::string host = addr.substr(0, colon);
+    std::string port = colon == addr.npos ? "1234" : addr.substr(colon + 1);
+    struct addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *res = NULL;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0) {
+        return -1;
+    }
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, 0);
+        if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    if (fd >= 0) {
+        int val = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+    }
+    return fd;
+}
+
+static int repl_connect() {
+    int fd = tcp_connect(g_replicaof);
+    if (fd >= 0) {
+        struct timeval tv = {0, 200 * 1000};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    }
+    return fd;
+}
+
+// the snapshot of a full resync, posted chunk by chunk
+static bool repl_recv_snapshot(ReplConn &rc, uint64_t &offset) {
+    Worker *w = rc.w;
+    if (!repl_recv(rc, sizeof(SnapHeader))) {
+        return false;
+    }
+    SnapHeader h = {};
+    memcpy(&h, buf_data(rc.in), sizeof(h));
+    buf_consume(rc.in, sizeof(h));
+    if (memcmp(h.magic, k_snap_magic, 8) || h.crc != snap_header_crc(h)) {
+        msg("replicaof: bad snapshot header");
+        return false;
+    }
+    if (h.shard != w->id || h.nshards != g_workers.size() || h.seed != g_hash_seed) {
+        fprintf(stderr, "replicaof: the primary has %u shards and the hash seed %llu, "
+            "start with the same --threads and --hash-seed\n",
+            h.nshards, (unsigned long long)h.seed);
+        exit(1);
+    }
+    repl_post(w, REPL_RESET, NULL, 0, (uint32_t)std::min<uint64_t>(h.nkeys, UINT32_MAX), 0);
+    while (true) {
+        if (!repl_recv(rc, k_chunk_header)) {
+            return false;
+        }
+        uint32_t nrec = 0, size = 0, crc = 0;
+        memcpy(&nrec, buf_data(rc.in), 4);
+        memcpy(&size, buf_data(rc.in) + 4, 4);
+        memcpy(&crc, buf_data(rc.in) + 8, 4);
+        if (size > 2 * k_snap_chunk + k_max_msg || !repl_recv(rc, k_chunk_header + size)) {
+            return false;
+        }
+        const uint8_t *data = buf_data(rc.in) + k_chunk_header;
+        if (crc32c(0, data, size) != crc) {
+            msg("replicaof: corrupted snapshot");
+            return false;
+        }
+        if (nrec == 0) {
+            buf_consume(rc.in, k_chunk_header + size);
+            break;  // the end marker
+        }
+        repl_post(w, REPL_CHUNK, data, size, nrec, 0);
+        buf_consume(rc.in, k_chunk_header + size);
+    }
+    offset = h.offset;
+    return true;
+}
+
+// one connection to the primary, until it fails
+static void repl_session(ReplConn &rc, std::string &replid, uint64_t &offset) {
+    Worker *w = rc.w;
+    char t1[24], t2[24];
+    std::string_view args[4] = {
+        "psync", int2str(t1, (int64_t)w->id), replid, int2str(t2, (int64_t)offset),
+    };
+    if (!repl_send(rc, args, 4) || !repl_recv(rc, 4)) {
+        return;
+    }
+    uint32_t len = 0;
+    memcpy(&len, buf_data(rc.in), 4);
+    if (len > k_max_msg || !repl_recv(rc, 4 + len)) {
+        return;
+    }
+    const uint8_t *cur = buf_data(rc.in) + 4;
+    const uint8_t *end = cur + len;
+    uint32_t status = 0, n = 0, l1 = 0, l2 = 0;
+    std::string_view mode, id;
+    if (!read_u32(cur, end, status) || status != RES_OK || !read_u32(cur, end, n)
+        || n != 2 || !read_u32(cur, end, l1) || !read_str(cur, end, l1, mode)
+        || !read_u32(cur, end, l2) || !read_str(cur, end, l2, id))
+    {
+        msg("replicaof: psync refused");
+        return;
+    }
+    std::string new_id(id);
+    bool full = mode == "full";
+    buf_consume(rc.in, 4 + len);
+    if (full && !repl_recv_snapshot(rc, offset)) {
+        return;
+    }
+    replid = new_id;
+    fprintf(stderr, "replicaof: shard %zu %s at offset %llu\n",
+        w->id, full ? "synced" : "continued", (unsigned long long)offset);
+
+    // the stream, in batches of whole frames
+    rc.streaming = true;
+    w->repl_link_up.store(1, std::memory_order_relaxed);
+    while (repl_recv(rc, buf_size(rc.in) + 1)) {
+        const uint8_t *data = buf_data(rc.in);
+        size_t size = buf_size(rc.in), used = 0;
+        while (size - used >= 4) {
+            memcpy(&len, data + used, 4);
+            if (len > k_max_msg) {
+                msg("replicaof: bad stream");
+                return;
+            }
+            if (4 + (size_t)len > size - used) {
+                break;
+            }
+            used += 4 + len;
+        }
+        if (used > 0) {
+            offset += used;
+            repl_post(w, REPL_STREAM, data, used, 0, offset);
+            buf_consume(rc.in, used);
+        }
+    }
+}
+
+static void repl_run(Worker *w) {
+    std::string replid = "?";   // none yet, a full resync
+    uint64_t offset = 0;
+    while (true) {
+        ReplConn rc;
+        rc.w = w;
+        rc.fd = repl_connect();
+        if (rc.fd >= 0) {
+            repl_session(rc, replid, offset);
+            close(rc.fd);
+            msg("replicaof: link lost");
+        }
+        w->repl_link_up.store(0, std::memory_order_relaxed);
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+    }
+}
+
+// Cluster mode, the commands:
+//  cluster keyslot KEY
+//  cluster slots                               `LO-HI HOST:PORT` per range
+//  cluster setslot SLOT|LO-HI node HOST:PORT   assign slots to a node
+//  cluster countkeysinslot SLOT
+//  cluster getkeysinslot SLOT COUNT
+//  cluster migrate SLOT HOST:PORT              move the keys away, then the slot
+// The map isn't persisted, a node starts with all slots.
+static bool str2slot(std::string_view s, uint32_t &slot) {
+    int64_t val = 0;
+    if (!str2int(s, val) || val < 0 || (size_t)val >= k_nslots) {
+        return false;
+    }
+    slot = (uint32_t)val;
+    return true;
+}
+
+static void cluster_slots(Response &out) {
+    std::vector<std::string> ranges;
+    for (size_t lo = 0, hi = 0; lo < k_nslots; lo = hi + 1) {
+        uint16_t node = g_slot_node[lo].load(std::memory_order_acquire);
+        for (hi = lo; hi + 1 < k_nslots; hi++) {
+            if (g_slot_node[hi + 1].load(std::memory_order_acquire) != node) {
+                break;
+            }
+        }
+        char text[32];
+        snprintf(text, sizeof(text), "%zu-%zu ", lo, hi);
+        ranges.push_back(text + g_nodes[node]);
+    }
+    out_arr(out, (uint32_t)ranges.size());
+    for (const std::string &range : ranges) {
+        out_str(out, range);
+    }
+}
+
+static void cluster_setslot(std::vector<std::string_view> &cmd, Response &out) {
+    std::string_view range = cmd[2];
+    size_t dash = range.find('-');
+    uint32_t lo = 0, hi = 0;
+    if (!str2slot(range.substr(0, dash), lo)
+        || !str2slot(dash == range.npos ? range : range.substr(dash + 1), hi)
+        || lo > hi || cmd[3] != "node")
+    {
+        return out_err(out, "expect cluster setslot SLOT|LO-HI node HOST:PORT");
+    }
+    for (uint32_t slot = lo; slot <= hi; slot++) {
+        if (g_slot_migrating[slot].load(std::memory_order_relaxed)) {
+            return out_err(out, "slot is migrating");
+        }
+    }
+    int node = cluster_node(cmd[4]);
+    if (node < 0) {
+        return out_err(out, "too many nodes");
+    }
+    for (uint32_t slot = lo; slot <= hi; slot++) {
+        g_slot_node[slot].store((uint16_t)node, std::memory_order_release);
+    }
+}
+
+const int k_migrate_timeout_s = 5;
+
+// in the shard owning the slot, see `cmd_shard()`
+static void cluster_migrate(std::vector<std::string_view> &cmd, Response &out) {
+    uint32_t slot = 0;
+    if (!str2slot(cmd[2], slot)) {
+        return out_err(out, "expect cluster migrate SLOT HOST:PORT");
+    }
+    if (g_slot_node[slot].load(std::memory_order_relaxed) != 0) {
+        return out_err(out, "not the owner of the slot");
+    }
+    if (g_data.migrate_slot >= 0) {
+        return out_err(out, "a migration is in progress");
+    }
+    int node = cluster_node(cmd[3]);
+    if (node <= 0) {
+        return out_err(out, node < 0 ? "too many nodes" : "cannot migrate to itself");
+    }
+    int fd = tcp_connect(cmd[3]);
+    if (fd < 0) {
+        return out_err(out, "cannot connect to the target");
+    }
+    struct timeval tv = {k_migrate_timeout_s, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    g_data.migrate_slot = (int)slot;
+    g_data.migrate_fd = fd;
+    g_slot_migrating[slot].store((uint16_t)(node + 1), std::memory_order_relaxed);
+}
+
+static void do_cluster(std::vector<std::string_view> &cmd, Response &out) {
+    if (!g_cluster) {
+        return out_err(out, "cluster mode is off");
+    }
+    std::string_view sub = cmd[1];
+    uint32_t slot = 0;
+    int64_t count = 0;
+    if (cmd.size() == 3 && sub == "keyslot") {
+        out_int(out, key_slot(cmd[2]));
+    } else if (cmd.size() == 2 && sub == "slots") {
+        cluster_slots(out);
+    } else if (cmd.size() == 5 && sub == "setslot") {
+        cluster_setslot(cmd, out);
+    } else if (cmd.size() == 3 && sub == "countkeysinslot" && str2slot(cmd[2], slot)) {
+        out_int(out, g_data.slot_nkeys[slot]);
+    } else if (cmd.size() == 4 && sub == "getkeysinslot" && str2slot(cmd[2], slot)
+        && str2int(cmd[3], count) && count >= 0)
+    {
+        uint32_t n = (uint32_t)std::min<int64_t>(count, g_data.slot_nkeys[slot]);
+        out_arr(out, n);
+        DList *head = &g_data.slot_keys[slot];
+        for (DList *node = head->next; n > 0; node = node->next, n--) {
+            out_str(out, entry_key(slot_node_entry(node)));
+        }
+    } else if (cmd.size() == 4 && sub == "migrate") {
+        cluster_migrate(cmd, out);
+    } else {
+        out_err(out, "unknown cluster subcommand");
+    }
+}
+
+// the responses to `n` requests, which must all succeed
+static bool migrate_wait(int fd, size_t n) {
+    static thread_local Buffer in;
+    buf_clear(in);
+    while (n > 0) {
+        uint32_t len = 0, status = 0;
+        if (buf_size(in) >= 8) {
+            memcpy(&len, buf_data(in), 4);
+            memcpy(&status, buf_data(in) + 4, 4);
+        }
+        if (buf_size(in) >= 8 && buf_size(in) >= 4 + (size_t)len) {
+            if (status != RES_OK) {
+                return false;
+            }
+            buf_consume(in, 4 + len);
+            n--;
+            continue;
+        }
+        buf_reserve(in, k_min_read);
+        ssize_t rv = recv(fd, buf_tail(in), buf_tail_size(in), 0);
+        if (rv < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rv <= 0) {
+            return false;   // also on the timeout
+        }
+        buf_commit(in, (size_t)rv);
+    }
+    return true;
+}
+
+// A failed migration leaves the slot here, with the keys moved so far on
+// the target. Running it again continues, the moved keys are asked for.
+static void migrate_end(const char *why) {
+    g_slot_migrating[g_data.migrate_slot].store(0, std::memory_order_relaxed);
+    close(g_data.migrate_fd);
+    g_data.migrate_fd = -1;
+    g_data.migrate_slot = -1;
+    msg(why);
+}
+
+// Slot migration, like the progressive resize: each loop iteration moves
+// up to `k_migrate_keys` keys of the slot to the target, as the commands
+// that rebuild them, then deletes them here. A batch is a blocking round
+// trip, like MIGRATE in Redis, so it is kept small. Once the slot is
+// empty, the target is told that it owns it, and it is redirected to.
+const size_t k_migrate_keys = 128;
+const size_t k_migrate_bytes = 256 << 10;
+
+static void migrate_step(Worker *w) {
+    if (g_data.migrate_slot < 0) {
+        return;
+    }
+    uint32_t slot = (uint32_t)g_data.migrate_slot;
+    uint16_t target = g_slot_migrating[slot].load(std::memory_order_relaxed) - 1;
+    int fd = g_data.migrate_fd;
+    DList *head = &g_data.slot_keys[slot];
+    static thread_local Buffer buf;
+    static thread_local std::vector<Entry *> batch;
+    buf_clear(buf);
+    batch.clear();
+    uint64_t now_real = get_realtime_msec();
+    size_t nreq = 0;
+    for (DList *node = head->next; node != head; node = node->next) {
+        if (batch.size() >= k_migrate_keys || buf_size(buf) >= k_migrate_bytes) {
+            break;
+        }
+        Entry *ent = slot_node_entry(node);
+        if (!entry_expired(ent)) {
+            nreq += entry_frames(buf, ent, now_real, true);
+        }
+        batch.push_back(ent);
+    }
+    if (nreq > 0 && !(send_all(fd, buf_data(buf), buf_size(buf)) && migrate_wait(fd, nreq))) {
+        return migrate_end("slot migration: the target failed, stopped");
+    }
+    // the keys are gone from this shard, for its AOF and replicas too
+    uint64_t moved = 0;
+    for (Entry *ent : batch) {
+        if (!entry_expired(ent)) {
+            moved++;
+            aof_feed_del(w, entry_key(ent));
+        }
+        db_remove(ent);
+    }
+    stat_add(w->migrated_keys, moved);
+    if (!dlist_empty(head)) {
+        return;
+    }
+    // hand the slot over
+    char text[24];
+    std::string_view args[5] = {
+        "cluster", "setslot", int2str(text, slot), "node", g_nodes[target],
+    };
+    buf_clear(buf);
+    frame_append(buf, args, 5);
+    if (!send_all(fd, buf_data(buf), buf_size(buf)) || !migrate_wait(fd, 1)) {
+        return migrate_end("slot migration: the target failed, stopped");
+    }
+    g_slot_node[slot].store(target, std::memory_order_release);
+    migrate_end("slot migration: done");
+}
+
+static int listen_socket(uint16_t port, bool reuseport) {
+    // the listening socket
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        die("socket()");
+    }
+    int val = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+    if (reuseport) {
+        // each worker has its own accept queue, balanced by the kernel
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val))) {
+            die("setsockopt(SO_REUSEPORT)");
+        }
+    }
+
+    // bind
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = ntohs(port);
+    addr.sin_addr.s_addr = ntohl(0);    // wildcard address 0.0.0.0
+    int rv = bind(fd, (const sockaddr *)&addr, sizeof(addr));
+    if (rv) {
+        die("bind()");
+    }
+
+    // set the listen fd to nonblocking mode
+    fd_set_nb(fd);
+
+    // listen
+    rv = listen(fd, SOMAXCONN);
+    if (rv) {
+        die("listen()");
+    }
+    return fd;
+}
+
+static void worker_init(Worker *w, uint16_t port) {
+    w->listen_fd = listen_socket(port, g_workers.size() > 1);
+    w->wake_fd = eventfd(0, EFD_NONBLOCK);
+    if (w->wake_fd < 0) {
+        die("eventfd()");
+    }
+    if (g_uring) {
+        return;     // the ring is created by the worker thread itself
+    }
+
+    // create epoll instance
+    w->epoll_fd = epoll_create1(0);
+    if (w->epoll_fd < 0) {
+        die("epoll_create1()");
+    }
+
+    // add the listening socket and the inbox to epoll
+    for (int fd : {w->listen_fd, w->wake_fd}) {
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;  // use fd directly for non-client sockets
+        if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            die("epoll_ctl() for listening socket");
+        }
+    }
+}
+
+// multishot requests stay armed until they complete without IORING_CQE_F_MORE
+static void uring_accept(Worker *w) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&w->ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = w->listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = ur_data(UR_ACCEPT, NULL);
+}
+
+static void uring_wake(Worker *w) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&w->ring);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = w->wake_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = ur_data(UR_WAKE, NULL);
+}
+
+// the kernel picks a provided buffer for each chunk of received data
+static void uring_recv(Worker *w, Conn *conn) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&w->ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = w->pbuf.bgid;
+    sqe->user_data = ur_data(UR_RECV, conn);
+    conn->uring_ops++;
+}
+
+static void uring_on_accept(Worker *w, const struct io_uring_cqe *cqe) {
+    if (cqe->res >= 0) {
+        Conn *conn = conn_new(cqe->res);
+        conn_register(w, conn);
+        uring_recv(w, conn);
+    } else {
+        errno = -cqe->res;
+        msg_errno("accept() error");
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        uring_accept(w);
+    }
+}
+
+static void uring_on_recv(Worker *w, Conn *conn, const struct io_uring_cqe *cqe) {
+    bool more = cqe->flags & IORING_CQE_F_MORE;
+    if (!more) {
+        conn->uring_ops--;
+    }
+    if (cqe->res > 0) {
+        // the same as `handle_read()`, with data from a provided buffer
+        unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (conn->fd >= 0) {
+            conn_touch(conn);
+            conn_feed(conn, ubuf_get(&w->pbuf, bid), (size_t)cqe->res);
+            stat_add(w->bytes_in, (uint64_t)cqe->res);
+            if (g_trace_sample) {
+                g_data.read_tsc = cycles_now();
+            }
+            conn_process(conn);
+            uring_send(w, conn);
+        }
+        ubuf_recycle(&w->ring, &w->pbuf, bid);
+    } else if (cqe->res == 0) {
+        conn->want_close = true;        // EOF
+    } else if (cqe->res != -ENOBUFS && conn->fd >= 0) {
+        errno = -cqe->res;
+        msg_errno("recv() error");
+        conn->want_close = true;
+    }   // else: out of buffers, just rearm
+
+    if (conn->fd < 0) {
+        conn_try_release(conn);
+    } else if (conn->want_close) {
+        conn_close(w, conn);
+    } else if (!more) {
+        uring_recv(w, conn);
+    }
+}
+
+static void uring_on_send(Worker *w, Conn *conn, const struct io_uring_cqe *cqe) {
+    conn->uring_ops--;
+    if (conn->fd < 0) {
+        return conn_try_release(conn);
+    }
+    if (cqe->res < 0) {
+        errno = -cqe->res;
+        msg_errno("send() error");
+        return conn_close(w, conn);
+    }
+    conn_touch(conn);
+    stat_add(w->bytes_out, (uint64_t)cqe->res);
+    buf_consume(conn->sending, (size_t)cqe->res);
+    conn->out_base += (uint64_t)cqe->res;
+    if (conn->trace_end) {
+        trace_check(conn);
+    }
+    if (buf_size(conn->sending) > 0) {
+        uring_send_buf(w, conn);    // partial send
+    } else {
+        uring_send(w, conn);        // what was generated meanwhile
+        conn_wake(conn);
+    }
+}
+
+const unsigned k_uring_entries = 4096;
+const unsigned k_uring_bufs = 256;          // per worker
+const unsigned k_uring_buf_size = 16 * 1024;
+
+// Start a loop iteration: a new budget for every connection, and the
+// connections left over from the last iteration go first.
+// Returns the number of them.
+static size_t process_ready(Worker *w) {
+    g_data.iter++;
+    static thread_local std::vector<Conn *> ready;
+    ready.clear();
+    while (!dlist_empty(&g_data.ready_list)) {
+        DList *node = g_data.ready_list.next;
+        dlist_detach(node);
+        dlist_init(node);
+        ready.push_back(container_of(node, Conn, ready_node));
+    }
+    for (Conn *conn : ready) {
+        if (conn->fd < 0) {
+            continue;
+        }
+        if (g_uring) {
+            conn_process(conn);
+            uring_send(w, conn);
+        } else if (!conn->want_write) {
+            handle_read(w->epoll_fd, conn);     // the leftovers, then the socket
+        }   // else: resumed after the write, see `conn_wake()`
+        if (conn->want_close) {
+            conn_close(w, conn);
+        }
+    }
+    return ready.size();
+}
+
+// the event loop with io_uring, the counterpart of the epoll loop below.
+// Each iteration is a single `io_uring_enter()` that both submits the
+// queued operations and waits for completions.
+static void uring_run(Worker *w) {
+    if (!uring_init(&w->ring, k_uring_entries)) {
+        die("io_uring_setup()");
+    }
+    if (!ubuf_init(&w->ring, &w->pbuf, 0, k_uring_bufs, k_uring_buf_size)) {
+        die("out of memory");
+    }
+    uring_accept(w);
+    uring_wake(w);
     while (true) {
-        // wait for events
-        int nfds = epoll_wait(epoll_fd, events, k_max_events, -1);
+        uring_submit_wait(&w->ring, next_timer_ms());
+        g_data.now_ms = get_monotonic_msec();
+        size_t nready = process_ready(w);
+        uint64_t nevents = 0;
+        while (struct io_uring_cqe *ptr = uring_peek_cqe(&w->ring)) {
+            nevents++;
+            struct io_uring_cqe cqe = *ptr;
+            uring_cqe_seen(&w->ring);
+            Conn *conn = (Conn *)(uintptr_t)(cqe.user_data & ~(uint64_t)7);
+            switch (cqe.user_data & 7) {
+            case UR_ACCEPT:
+                uring_on_accept(w, &cqe);
+                break;
+            case UR_WAKE:
+                handle_inbox(w);
+                if (!(cqe.flags & IORING_CQE_F_MORE)) {
+                    uring_wake(w);
+                }
+                break;
+            case UR_RECV:
+                uring_on_recv(w, conn, &cqe);
+                break;
+            case UR_SEND:
+                uring_on_send(w, conn, &cqe);
+                break;
+            }   // else: IORING_OP_PROVIDE_BUFFERS
+        }
+        process_timers(w);
+        aof_flush(w);   // before the sends are submitted
+        stat_inc(w->wakeups);
+        stat_add(w->events, nevents);
+        rehash_step(w, nevents == 0 && nready == 0);
+        migrate_step(w);
+        evict_step(w);
+        lazy_step(w);
+    }
+}
+
+static void worker_run(Worker *w) {
+    g_data.worker = w;
+    g_data.now_ms = get_monotonic_msec();
+    g_data.stats_tick_ms = g_data.now_ms;
+    g_data.rand_state = g_repl_id + w->id;
+    w->pool = &pool_stats;
+    dlist_init(&g_data.idle_list);
+    dlist_init(&g_data.ready_list);
+    if (g_cluster) {
+        g_data.slot_keys.resize(k_nslots);
+        for (DList &head : g_data.slot_keys) {
+            dlist_init(&head);
+        }
+        g_data.slot_nkeys.assign(k_nslots, 0);
+    }
+    if (g_aof_path) {
+        aof_load(w);    // the AOF is more recent than any snapshot
+    } else if (g_snap_path) {
+        snap_load(w);
+    }
+    if (g_uring) {
+        return uring_run(w);
+    }
+    int epoll_fd = w->epoll_fd;
+    int fd = w->listen_fd;
+
+    // events buffer for epoll_wait
+    const int k_max_events = 10000;
+    std::vector<struct epoll_event> events(k_max_events);
+
+    // the event loop
+    while (true) {
+        // wait for events, or the nearest timer
+        int timeout_ms = next_timer_ms();
+        int nfds = epoll_wait(epoll_fd, events.data(), k_max_events, timeout_ms);
         if (nfds < 0 && errno == EINTR) {
             continue;   // not an error
         }
         if (nfds < 0) {
             die("epoll_wait");
         }
+        g_data.now_ms = get_monotonic_msec();
+        stat_inc(w->wakeups);
+        stat_add(w->events, (uint64_t)nfds);
+        size_t nready = process_ready(w);
 
         // process all ready events
         for (int i = 0; i < nfds; ++i) {
             struct epoll_event *e = &events[i];
-            
+
             // check if this is the listening socket
             if (e->data.fd == fd) {
                 // handle new connection
                 if (Conn *conn = handle_accept(epoll_fd, fd)) {
-                    // put it into the map
-                    if (fd2conn.size() <= (size_t)conn->fd) {
-                        fd2conn.resize(conn->fd + 1);
-                    }
-                    assert(!fd2conn[conn->fd]);
-                    fd2conn[conn->fd] = conn;
+                    conn_register(w, conn);
                 }
                 continue;
             }
-            
+            // messages from other workers
+            if (e->data.fd == w->wake_fd) {
+                handle_inbox(w);
+                continue;
+            }
+
             // this is a client connection
             Conn *conn = (Conn *)e->data.ptr;
-            
+            if (conn->fd < 0 && conn->zc_fd >= 0) {
+                conn_zc_linger(w, conn);
+                continue;
+            }
+            if (conn->fd < 0) {
+                continue;   // closed by an earlier event in this batch
+            }
+
             // handle the connection
-            if (e->events & EPOLLIN) {
-                assert(conn->want_read);
+            // an edge must be handled even while the intention is otherwise.
+            // A level may be stale: a reply handled earlier in this batch
+            // can leave a partial write, which stops the reading.
+            if ((e->events & EPOLLIN) && (conn->want_read || g_epoll_et)) {
                 handle_read(epoll_fd, conn);  // application logic
             }
-            if (e->events & EPOLLOUT) {
-                assert(conn->want_write);
+            if ((e->events & EPOLLOUT) && conn->want_write && !conn->want_close) {
                 handle_write(epoll_fd, conn); // application logic
             }
 
             // close the socket from socket error or application logic
-            if ((e->events & EPOLLERR) || conn->want_close) {
-                // remove from epoll
-                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
-                // close and cleanup
-                (void)close(conn->fd);
-                fd2conn[conn->fd] = NULL;
-                release_conn(conn);
+            if ((e->events & EPOLLERR) && !conn_zerocopy_done(conn, conn->fd)) {
+                conn->want_close = true;
+            }
+            if (conn->want_close) {
+                conn_close(w, conn);
             }
         }   // for each ready event
+
+        // handle timers
+        process_timers(w);
+        aof_flush(w);
+        rehash_step(w, nfds == 0 && nready == 0);
+        migrate_step(w);
+        evict_step(w);
+        lazy_step(w);
     }   // the event loop
-    
-    close(epoll_fd);
+}
+
+int main(int argc, char **argv) {
+    uint16_t port = 1234;
+    size_t nthreads = 1;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+            nthreads = (size_t)atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--port") && i + 1 < argc) {
+            port = (uint16_t)atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--io") && i + 1 < argc) {
+            const char *io = argv[++i];
+            if (!strcmp(io, "uring")) {
+                g_uring = true;
+            } else if (!strcmp(io, "epoll-et")) {
+                g_epoll_et = true;
+            } else if (strcmp(io, "epoll")) {
+                die("--io epoll|epoll-et|uring");
+            }
+        } else if (!strcmp(argv[i], "--aof") && i + 1 < argc) {
+            g_aof_path = argv[++i];
+        } else if (!strcmp(argv[i], "--aof-fsync") && i + 1 < argc) {
+            const char *policy = argv[++i];
+            if (!strcmp(policy, "always")) {
+                g_aof_fsync = FSYNC_ALWAYS;
+            } else if (!strcmp(policy, "no")) {
+                g_aof_fsync = FSYNC_NO;
+            } else if (strcmp(policy, "everysec")) {
+                die("--aof-fsync always|everysec|no");
+            }
+        } else if (!strcmp(argv[i], "--snapshot") && i + 1 < argc) {
+            g_snap_path = argv[++i];
+        } else if (!strcmp(argv[i], "--zerocopy")) {
+            g_zerocopy = true;
+        } else if (!strcmp(argv[i], "--slowlog-us") && i + 1 < argc) {
+            int64_t us = strtoll(argv[++i], NULL, 10);
+            g_slowlog_ns = us < 0 ? (uint64_t)-1 : (uint64_t)us * 1000;
+        } else if (!strcmp(argv[i], "--trace-sample") && i + 1 < argc) {
+            g_trace_sample = strtoull(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--req-budget") && i + 1 < argc) {
+            g_req_budget = (uint32_t)strtoul(argv[++i], NULL, 10);
+            g_req_budget = g_req_budget ? g_req_budget : UINT32_MAX;
+        } else if (!strcmp(argv[i], "--max-output") && i + 1 < argc) {
+            g_max_output = strtoull(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--replicaof") && i + 1 < argc) {
+            g_replicaof = argv[++i];
+        } else if (!strcmp(argv[i], "--cluster") && i + 1 < argc) {
+            g_cluster = true;
+            g_nodes[0] = argv[++i];
+        } else if (!strcmp(argv[i], "--maxmemory") && i + 1 < argc) {
+            g_maxmemory = strtoull(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--maxmemory-policy") && i + 1 < argc) {
+            const char *policy = argv[++i];
+            if (!strcmp(policy, "allkeys-lru")) {
+                g_evict_policy = EVICT_LRU;
+            } else if (!strcmp(policy, "allkeys-lfu")) {
+                g_evict_policy = EVICT_LFU;
+            } else if (strcmp(policy, "noeviction")) {
+                die("--maxmemory-policy noeviction|allkeys-lru|allkeys-lfu");
+            }
+        } else if (!strcmp(argv[i], "--repl-backlog") && i + 1 < argc) {
+            g_repl_backlog = std::max<size_t>(strtoull(argv[++i], NULL, 10), 1 << 16);
+        } else if (!strcmp(argv[i], "--idle-timeout") && i + 1 < argc) {
+            g_idle_timeout_ms = strtoull(argv[++i], NULL, 10) * 1000;
+        } else if (!strcmp(argv[i], "--hash-seed") && i + 1 < argc) {
+            const char *seed = argv[++i];
+            if (!strcmp(seed, "random")) {
+                if (getrandom(&g_hash_seed, sizeof(g_hash_seed), 0) < 0) {
+                    die("getrandom()");
+                }
+            } else {
+                g_hash_seed = strtoull(seed, NULL, 0);
+            }
+        } else {
+            fprintf(stderr, "usage: %s [--threads N] [--port PORT] "
+                "[--io epoll|epoll-et|uring] [--zerocopy] [--idle-timeout SEC] "
+                "[--hash-seed N|random] [--aof PATH] "
+                "[--aof-fsync always|everysec|no] [--snapshot PATH] "
+                "[--slowlog-us N] [--trace-sample N] [--req-budget N] "
+                "[--max-output BYTES] [--replicaof HOST:PORT] "
+                "[--repl-backlog BYTES] [--cluster HOST:PORT] [--maxmemory BYTES] "
+                "[--maxmemory-policy noeviction|allkeys-lru|allkeys-lfu]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (nthreads == 0) {
+        nthreads = std::thread::hardware_concurrency();
+    }
+    g_shard_maxmemory = g_maxmemory / nthreads;
+    g_lazy_fd = eventfd(0, EFD_CLOEXEC);
+    if (g_lazy_fd < 0) {
+        die("eventfd()");
+    }
+    std::thread(lazy_run).detach();
+    g_cycles_base = cycles_now();
+    g_nsec_base = get_monotonic_nsec();
+    if (getrandom(&g_repl_id, sizeof(g_repl_id), 0) < 0) {
+        die("getrandom()");
+    }
+
+    // all workers must exist before any of them can forward requests
+    for (size_t i = 0; i < nthreads; ++i) {
+        Worker *w = new Worker();
+        w->id = i;
+        g_workers.push_back(w);
+    }
+    for (Worker *w : g_workers) {
+        worker_init(w, port);
+    }
+    if (g_aof_path) {
+        if (!aof_check(nthreads)) {
+            return 1;
+        }
+        std::thread(aof_bio_run).detach();
+    } else if (g_snap_path) {
+        snap_check(nthreads);
+    }
+    for (size_t i = 1; i < nthreads; ++i) {
+        g_workers[i]->thread = std::thread(worker_run, g_workers[i]);
+    }
+    if (g_replicaof) {
+        for (Worker *w : g_workers) {
+            std::thread(repl_run, w).detach();
+        }
+    }
+    worker_run(g_workers[0]);   // the main thread is worker 0
     return 0;
-}
\ No newline at end of file
+}
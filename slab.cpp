@@ -0,0 +1,184 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>     // malloc(), free()
+// C++
+#include <atomic>
+#include <mutex>
+#include <vector>
+// proj
+#include "slab.h"
+
+
+// 16-byte steps up to 128, then 4 classes per power of 2
+static const uint32_t k_class_size[] = {
+    32, 48, 64, 80, 96, 112, 128,
+    160, 192, 224, 256,
+    320, 384, 448, 512,
+    640, 768, 896, 1024,
+    1280, 1536, 1792, 2048,
+    2560, 3072, 3584, 4096,
+};
+const size_t k_nclass = sizeof(k_class_size) / sizeof(k_class_size[0]);
+
+// the smallest class for each 16-byte step of the request size
+static uint8_t g_class_of[k_slab_max / 16 + 1];
+
+static struct ClassInit {
+    ClassInit() {
+        size_t cls = 0;
+        for (size_t i = 0; i <= k_slab_max / 16; i++) {
+            while (k_class_size[cls] < i * 16) {
+                cls++;
+            }
+            g_class_of[i] = (uint8_t)cls;
+        }
+    }
+} g_class_init;
+
+static size_t slab_class(size_t size) {
+    assert(size <= k_slab_max);
+    return g_class_of[(size + 15) / 16];
+}
+
+struct FreeObj {
+    FreeObj *next;
+};
+
+// the counters are only written by the owner thread,
+// they are atomic so that `slab_stats()` can read them from any thread.
+static void stat_add(std::atomic<size_t> &v, size_t d) {
+    v.store(v.load(std::memory_order_relaxed) + d, std::memory_order_relaxed);
+}
+
+static void stat_sub(std::atomic<size_t> &v, size_t d) {
+    v.store(v.load(std::memory_order_relaxed) - d, std::memory_order_relaxed);
+}
+
+struct SlabClass {
+    FreeObj *free_list = NULL;
+    std::atomic<size_t> pages{0};
+    std::atomic<size_t> used{0};    // live objects
+};
+
+// the classes of one thread
+struct SlabCache {
+    SlabClass cls[k_nclass];
+    std::atomic<size_t> large_count{0};     // malloc() fallbacks
+    std::atomic<size_t> large_bytes{0};
+};
+
+// all threads that ever allocated, for the statistics
+static std::mutex g_caches_lock;
+static std::vector<SlabCache *> g_caches;
+
+static SlabCache *slab_cache() {
+    static thread_local SlabCache *cache = NULL;
+    if (!cache) {
+        cache = new SlabCache();
+        std::lock_guard<std::mutex> guard(g_caches_lock);
+        g_caches.push_back(cache);
+    }
+    return cache;
+}
+
+// carve a new page into free objects
+static void slab_refill(SlabClass &sc, size_t objsize) {
+    uint8_t *page = (uint8_t *)malloc(k_slab_page);
+    if (!page) {
+        abort();
+    }
+    size_t n = k_slab_page / objsize;
+    for (size_t i = n; i-- > 0; ) {
+        FreeObj *obj = (FreeObj *)(page + i * objsize);
+        obj->next = sc.free_list;
+        sc.free_list = obj;
+    }
+    stat_add(sc.pages, 1);
+}
+
+size_t slab_usable(size_t size) {
+    return size <= k_slab_max ? k_class_size[slab_class(size)] : size;
+}
+
+void *slab_alloc(size_t size) {
+    SlabCache *cache = slab_cache();
+    if (size > k_slab_max) {
+        stat_add(cache->large_count, 1);
+        stat_add(cache->large_bytes, size);
+        return malloc(size);
+    }
+    size_t cls = slab_class(size);
+    SlabClass &sc = cache->cls[cls];
+    if (!sc.free_list) {
+        slab_refill(sc, k_class_size[cls]);
+    }
+    FreeObj *obj = sc.free_list;
+    sc.free_list = obj->next;
+    stat_add(sc.used, 1);
+    return obj;
+}
+
+void slab_free(void *ptr, size_t size) {
+    if (!ptr) {
+        return;
+    }
+    SlabCache *cache = slab_cache();
+    if (size > k_slab_max) {
+        stat_sub(cache->large_count, 1);
+        stat_sub(cache->large_bytes, size);
+        free(ptr);
+        return;
+    }
+    SlabClass &sc = cache->cls[slab_class(size)];
+    FreeObj *obj = (FreeObj *)ptr;
+    obj->next = sc.free_list;
+    sc.free_list = obj;
+    stat_sub(sc.used, 1);
+}
+
+void slab_disown(size_t size) {
+    assert(size > k_slab_max);
+    SlabCache *cache = slab_cache();
+    stat_sub(cache->large_count, 1);
+    stat_sub(cache->large_bytes, size);
+}
+
+void slab_stats(std::string &out) {
+    size_t pages[k_nclass] = {}, used[k_nclass] = {};
+    size_t large_count = 0, large_bytes = 0;
+    {
+        std::lock_guard<std::mutex> guard(g_caches_lock);
+        for (SlabCache *cache : g_caches) {
+            for (size_t i = 0; i < k_nclass; i++) {
+                pages[i] += cache->cls[i].pages.load(std::memory_order_relaxed);
+                used[i] += cache->cls[i].used.load(std::memory_order_relaxed);
+            }
+            large_count += cache->large_count.load(std::memory_order_relaxed);
+            large_bytes += cache->large_bytes.load(std::memory_order_relaxed);
+        }
+    }
+
+    char line[256];
+    out.append("class size pages used free used_bytes reserved_bytes\n");
+    size_t total_used = large_bytes, total_reserved = large_bytes;
+    for (size_t i = 0; i < k_nclass; i++) {
+        if (!pages[i]) {
+            continue;
+        }
+        size_t cap = pages[i] * (k_slab_page / k_class_size[i]);
+        size_t used_bytes = used[i] * k_class_size[i];
+        size_t reserved = pages[i] * k_slab_page;
+        snprintf(line, sizeof(line), "%zu %u %zu %zu %zu %zu %zu\n",
+            i, k_class_size[i], pages[i], used[i], cap - used[i],
+            used_bytes, reserved);
+        out.append(line);
+        total_used += used_bytes;
+        total_reserved += reserved;
+    }
+    snprintf(line, sizeof(line), "large count=%zu bytes=%zu\n",
+        large_count, large_bytes);
+    out.append(line);
+    snprintf(line, sizeof(line), "total used_bytes=%zu reserved_bytes=%zu\n",
+        total_used, total_reserved);
+    out.append(line);
+}
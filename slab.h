@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+
+// A size-class slab allocator for small objects.
+// Objects of the same class are carved out of 64KB pages and recycled
+// through a free list, so they never fragment the general heap.
+// Requests larger than the biggest class fall back to malloc().
+// Each thread has its own classes: free on the thread that allocated.
+
+const size_t k_slab_page = 64 * 1024;
+const size_t k_slab_max = 4096;     // the biggest class
+
+// the capacity actually reserved for a request of `size` bytes
+size_t slab_usable(size_t size);
+// `size` must be the same when freeing, or anything between `size`
+// and its `slab_usable()` capacity.
+void  *slab_alloc(size_t size);
+void   slab_free(void *ptr, size_t size);
+// a malloc() fallback, `size` > `k_slab_max`, freed by another thread
+// with free(): drops it from the statistics of this one
+void   slab_disown(size_t size);
+
+// per-class memory statistics of all threads, as text
+void   slab_stats(std::string &out);
@@ -0,0 +1,104 @@
+#!/usr/bin/env python3
+# `mget`/`mset`/`mdel` over keys of several shards, checked against a model,
+# pipelined so that the parts of different batches are in flight together.
+#
+#   python3 tests/batch_split.py ./server [--threads 4] [--rounds 300]
+import argparse, random, socket, struct, subprocess, sys, time
+
+def frame(*args):
+    args = [a.encode() for a in args]
+    body = struct.pack('<I', len(args))
+    body += b''.join(struct.pack('<I', len(a)) + a for a in args)
+    return struct.pack('<I', len(body)) + body
+
+def recv_exact(sock, n):
+    data = b''
+    while len(data) < n:
+        chunk = sock.recv(n - len(data))
+        if not chunk:
+            raise EOFError('server closed the connection')
+        data += chunk
+    return data
+
+def recv_reply(sock):
+    (size,) = struct.unpack('<I', recv_exact(sock, 4))
+    body = recv_exact(sock, size)
+    (status,) = struct.unpack('<I', body[:4])
+    return status, body[4:]
+
+# `[4-byte n]` then `[4-byte len][bytes]` per element, a len of ~0 for nil
+def parse_arr(data):
+    (n,) = struct.unpack('<I', data[:4])
+    pos, out = 4, []
+    for _ in range(n):
+        (size,) = struct.unpack('<I', data[pos:pos + 4])
+        pos += 4
+        if size == 0xFFFFFFFF:
+            out.append(None)
+        else:
+            out.append(data[pos:pos + size])
+            pos += size
+    return out
+
+RES_OK = 0
+
+def main():
+    ap = argparse.ArgumentParser()
+    ap.add_argument('server')
+    ap.add_argument('--port', type=int, default=1298)
+    ap.add_argument('--threads', type=int, default=4)
+    ap.add_argument('--rounds', type=int, default=300)
+    opt = ap.parse_args()
+
+    srv = subprocess.Popen(
+        [opt.server, '--port', str(opt.port), '--threads', str(opt.threads)],
+        stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    try:
+        for _ in range(100):
+            try:
+                sock = socket.create_connection(('127.0.0.1', opt.port))
+                break
+            except ConnectionRefusedError:
+                time.sleep(0.05)
+        else:
+            sys.exit('the server did not start')
+        rng = random.Random(1)
+        model = {}
+        for _ in range(opt.rounds):
+            # a few batches per write, each checked against the model
+            pipe, expect = [], []
+            for _ in range(rng.randint(1, 8)):
+                keys = ['k%d' % rng.randrange(300) for _ in range(rng.randint(1, 40))]
+                op = rng.random()
+                if op < 0.4:
+                    args = []
+                    for k in keys:
+                        model[k] = 'v%d' % rng.randrange(10**6) * rng.choice([1, 1, 500])
+                        args += [k, model[k]]
+                    pipe.append(frame('mset', *args))
+                    expect.append(('mset', None))
+                elif op < 0.6:
+                    n = len({k for k in keys if k in model})
+                    for k in keys:
+                        model.pop(k, None)
+                    pipe.append(frame('mdel', *keys))
+                    expect.append(('mdel', n))
+                else:
+                    vals = [model[k].encode() if k in model else None for k in keys]
+                    pipe.append(frame('mget', *keys))
+                    expect.append(('mget', vals))
+            sock.sendall(b''.join(pipe))
+            for name, want in expect:
+                status, data = recv_reply(sock)
+                assert status == RES_OK, (name, data)
+                if name == 'mdel':
+                    assert struct.unpack('<q', data)[0] == want, name
+                elif name == 'mget':
+                    assert parse_arr(data) == want, name
+        print('%d rounds ok' % opt.rounds)
+    finally:
+        srv.terminate()
+        srv.wait()
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,79 @@
+#!/usr/bin/env python3
+# `flushall` with several workers: the writes a connection forwarded to
+# other shards before it are gone, the ones after it are kept.
+#
+#   python3 tests/flushall_order.py ./server [--threads 4] [--trials 200]
+import argparse, socket, struct, subprocess, sys, time
+
+def frame(*args):
+    args = [a.encode() for a in args]
+    body = struct.pack('<I', len(args))
+    body += b''.join(struct.pack('<I', len(a)) + a for a in args)
+    return struct.pack('<I', len(body)) + body
+
+def recv_exact(sock, n):
+    data = b''
+    while len(data) < n:
+        chunk = sock.recv(n - len(data))
+        if not chunk:
+            raise EOFError('server closed the connection')
+        data += chunk
+    return data
+
+def recv_reply(sock):
+    (size,) = struct.unpack('<I', recv_exact(sock, 4))
+    body = recv_exact(sock, size)
+    (status,) = struct.unpack('<I', body[:4])
+    return status, body[4:]
+
+RES_OK, RES_NX = 0, 2
+
+def main():
+    ap = argparse.ArgumentParser()
+    ap.add_argument('server')
+    ap.add_argument('--port', type=int, default=1299)
+    ap.add_argument('--threads', type=int, default=4)
+    ap.add_argument('--trials', type=int, default=200)
+    ap.add_argument('--keys', type=int, default=40)
+    opt = ap.parse_args()
+
+    srv = subprocess.Popen(
+        [opt.server, '--port', str(opt.port), '--threads', str(opt.threads)],
+        stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    try:
+        for _ in range(100):
+            try:
+                sock = socket.create_connection(('127.0.0.1', opt.port))
+                break
+            except ConnectionRefusedError:
+                time.sleep(0.05)
+        else:
+            sys.exit('the server did not start')
+        bad = 0
+        for trial in range(opt.trials):
+            keys = ['k%d_%d' % (trial, i) for i in range(opt.keys)]
+            # one write, so that the sets are still in flight at `flushall`
+            pipe = [frame('set', k, 'v') for k in keys]
+            pipe.append(frame('flushall'))
+            pipe += [frame('get', k) for k in keys]
+            pipe += [frame('set', k, 'after') for k in keys[:4]]
+            pipe += [frame('get', k) for k in keys[:4]]
+            sock.sendall(b''.join(pipe))
+            replies = [recv_reply(sock) for _ in pipe]
+            sets = replies[:opt.keys]
+            flush = replies[opt.keys]
+            gets = replies[opt.keys + 1:2 * opt.keys + 1]
+            after = replies[2 * opt.keys + 5:]
+            assert all(r[0] == RES_OK for r in sets), sets
+            assert flush[0] == RES_OK, flush
+            assert all(r == (RES_OK, b'after') for r in after), after
+            if any(r[0] != RES_NX for r in gets):
+                bad += 1
+        print('%d of %d trials kept keys across flushall' % (bad, opt.trials))
+        sys.exit(1 if bad else 0)
+    finally:
+        srv.terminate()
+        srv.wait()
+
+if __name__ == '__main__':
+    main()
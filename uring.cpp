@@ -0,0 +1,167 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>     // malloc()
+// system
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+// proj
+#include "uring.h"
+
+
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete,
+    unsigned flags, void *arg, size_t argsz)
+{
+    return (int)syscall(
+        __NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static void fail(const char *msg) {
+    fprintf(stderr, "[%d] %s\n", errno, msg);
+    abort();
+}
+
+static void *map(int fd, size_t size, off_t offset) {
+    void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, offset);
+    return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+bool uring_init(URing *ring, unsigned entries) {
+    struct io_uring_params p = {};
+    // only this thread submits, and completions are left for `io_uring_enter()`
+    // instead of interrupting the thread.
+    p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+    p.flags |= IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4;     // multishot requests complete many times
+    int fd = sys_setup(entries, &p);
+    if (fd < 0 && errno == EINVAL) {
+        p = {};     // an older kernel
+        fd = sys_setup(entries, &p);
+    }
+    if (fd < 0) {
+        return false;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+        close(fd);
+        return false;
+    }
+
+    // the SQ and CQ rings share one mapping
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    size_t size = sq_size > cq_size ? sq_size : cq_size;
+    uint8_t *rings = (uint8_t *)map(fd, size, IORING_OFF_SQ_RING);
+    void *sqes = map(fd, p.sq_entries * sizeof(struct io_uring_sqe), IORING_OFF_SQES);
+    if (!rings || !sqes) {
+        close(fd);
+        return false;
+    }
+
+    ring->fd = fd;
+    ring->sq_head = (unsigned *)(rings + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(rings + p.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(rings + p.sq_off.ring_mask);
+    ring->sq_entries = p.sq_entries;
+    ring->sq_local = *ring->sq_tail;
+    ring->sqes = (struct io_uring_sqe *)sqes;
+    ring->cq_head = (unsigned *)(rings + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(rings + p.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(rings + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(rings + p.cq_off.cqes);
+    // SQE i always goes to slot i
+    unsigned *array = (unsigned *)(rings + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; i++) {
+        array[i] = i;
+    }
+    return true;
+}
+
+// publish the queued SQEs, returns the number of them
+static unsigned uring_flush(URing *ring) {
+    __atomic_store_n(ring->sq_tail, ring->sq_local, __ATOMIC_RELEASE);
+    return ring->sq_local - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+}
+
+struct io_uring_sqe *uring_get_sqe(URing *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_local - head >= ring->sq_entries) {
+        // full, submit without waiting
+        unsigned n = uring_flush(ring);
+        if (sys_enter(ring->fd, n, 0, 0, NULL, 0) < 0 && errno != EINTR) {
+            fail("io_uring_enter()");
+        }
+    }
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sq_local & ring->sq_mask];
+    ring->sq_local++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+void uring_submit_wait(URing *ring, int timeout_ms) {
+    unsigned n = uring_flush(ring);
+    unsigned flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    struct __kernel_timespec ts = {};
+    struct io_uring_getevents_arg arg = {};
+    if (timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000 * 1000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+    unsigned wait_nr = timeout_ms == 0 ? 0 : 1;
+    int rv = sys_enter(ring->fd, n, wait_nr, flags, &arg, sizeof(arg));
+    if (rv < 0 && errno != ETIME && errno != EINTR) {
+        fail("io_uring_enter()");
+    }
+}
+
+struct io_uring_cqe *uring_peek_cqe(URing *ring) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(URing *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+static void ubuf_provide(URing *ring, UBufs *ub, unsigned bid, unsigned n) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = (int)n;
+    sqe->addr = (uint64_t)(uintptr_t)ubuf_get(ub, bid);
+    sqe->len = ub->buf_size;
+    sqe->off = bid;
+    sqe->buf_group = ub->bgid;
+    sqe->user_data = 0;
+}
+
+bool ubuf_init(URing *ring, UBufs *ub, uint16_t bgid,
+    unsigned nbufs, unsigned buf_size)
+{
+    ub->bufs = (uint8_t *)malloc((size_t)nbufs * buf_size);
+    ub->nbufs = nbufs;
+    ub->buf_size = buf_size;
+    ub->bgid = bgid;
+    if (!ub->bufs) {
+        return false;
+    }
+    ubuf_provide(ring, ub, 0, nbufs);
+    return true;
+}
+
+uint8_t *ubuf_get(UBufs *ub, unsigned bid) {
+    return ub->bufs + (size_t)bid * ub->buf_size;
+}
+
+// hand a buffer back to the kernel
+void ubuf_recycle(URing *ring, UBufs *ub, unsigned bid) {
+    ubuf_provide(ring, ub, bid, 1);
+}
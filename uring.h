@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+
+// A minimal io_uring wrapper over the raw syscalls (no liburing).
+// One ring per thread: nothing here is thread-safe.
+
+struct URing {
+    int fd = -1;
+    // submission queue, shared with the kernel
+    unsigned *sq_head = NULL;
+    unsigned *sq_tail = NULL;
+    unsigned sq_mask = 0;
+    unsigned sq_entries = 0;
+    unsigned sq_local = 0;      // the tail of the queued but unpublished SQEs
+    struct io_uring_sqe *sqes = NULL;
+    // completion queue, shared with the kernel
+    unsigned *cq_head = NULL;
+    unsigned *cq_tail = NULL;
+    unsigned cq_mask = 0;
+    struct io_uring_cqe *cqes = NULL;
+};
+
+// false if io_uring is not available
+bool uring_init(URing *ring, unsigned entries);
+// a zeroed SQE to fill in, the queue is submitted first if it is full
+struct io_uring_sqe *uring_get_sqe(URing *ring);
+// submit the queued SQEs, then wait for a completion, up to `timeout_ms`
+// (-1 to wait forever, 0 to not wait)
+void uring_submit_wait(URing *ring, int timeout_ms);
+// the next completion, NULL if none
+struct io_uring_cqe *uring_peek_cqe(URing *ring);
+void uring_cqe_seen(URing *ring);
+
+// Provided buffers: the kernel picks one for each completion of a read
+// with `IOSQE_BUFFER_SELECT`, and it is given back after use.
+// They are handed over with IORING_OP_PROVIDE_BUFFERS requests queued with
+// the other submissions. The registered buffer ring (IORING_REGISTER_PBUF_RING)
+// would save those SQEs, but it doesn't work on every kernel that has
+// multishot receive.
+struct UBufs {
+    uint8_t *bufs = NULL;
+    unsigned nbufs = 0;
+    unsigned buf_size = 0;
+    uint16_t bgid = 0;      // the buffer group ID
+};
+
+// the completions of these requests have a `user_data` of 0
+bool     ubuf_init(URing *ring, UBufs *ub, uint16_t bgid,
+                   unsigned nbufs, unsigned buf_size);
+uint8_t *ubuf_get(UBufs *ub, unsigned bid);
+void     ubuf_recycle(URing *ring, UBufs *ub, unsigned bid);
@@ -0,0 +1,181 @@
+#include <assert.h>
+#include <string.h>
+// C++
+#include <new>
+// proj
+#include "hash.h"
+#include "hashtable_t.h"
+#include "slab.h"
+#include "zset.h"
+
+
+#define container_of(ptr, T, member) \
+    ((T *)( (char *)ptr - offsetof(T, member) ))
+
+// the name index, see hashtable_t.h
+struct ZNodeTraits {
+    typedef ZNode Entry;
+    typedef std::string_view Key;
+    static ZNode *entry(HNode *node) {
+        return container_of(node, ZNode, hmap);
+    }
+    static uint64_t hash(std::string_view name) {
+        return str_hash((const uint8_t *)name.data(), name.size());
+    }
+    static bool eq(const ZNode *node, std::string_view name) {
+        return znode_name(node) == name;
+    }
+};
+
+static size_t znode_size(size_t len) {
+    return sizeof(ZNode) + len;
+}
+
+static ZNode *znode_new(std::string_view name, double score) {
+    ZNode *node = new (slab_alloc(znode_size(name.size()))) ZNode();
+    avl_init(&node->tree);
+    node->hmap.hcode = ZNodeTraits::hash(name);
+    node->score = score;
+    node->len = name.size();
+    memcpy(node + 1, name.data(), name.size());
+    return node;
+}
+
+static void znode_del(ZNode *node) {
+    slab_free(node, znode_size(node->len));
+}
+
+// compare by the (score, name) tuple
+static bool zless(AVLNode *lhs, double score, std::string_view name) {
+    ZNode *zl = container_of(lhs, ZNode, tree);
+    if (zl->score != score) {
+        return zl->score < score;
+    }
+    return znode_name(zl) < name;
+}
+
+static bool zless(AVLNode *lhs, AVLNode *rhs) {
+    ZNode *zr = container_of(rhs, ZNode, tree);
+    return zless(lhs, zr->score, znode_name(zr));
+}
+
+// insert into the AVL tree
+static void tree_insert(ZSet *zset, ZNode *node) {
+    AVLNode *parent = NULL;         // insert under this node
+    AVLNode **from = &zset->root;   // the incoming pointer to the next node
+    while (*from) {                 // tree search
+        parent = *from;
+        from = zless(&node->tree, parent) ? &parent->left : &parent->right;
+    }
+    *from = &node->tree;            // attach the new node
+    node->tree.parent = parent;
+    zset->root = avl_fix(&node->tree);
+}
+
+// update the score of an existing node
+static void zset_update(ZSet *zset, ZNode *node, double score) {
+    if (node->score == score) {
+        return;
+    }
+    // detach the tree node
+    zset->root = avl_del(&node->tree);
+    avl_init(&node->tree);
+    // reinsert the tree node
+    node->score = score;
+    tree_insert(zset, node);
+}
+
+bool zset_insert(ZSet *zset, std::string_view name, double score) {
+    if (ZNode *node = zset_lookup(zset, name)) {
+        zset_update(zset, node, score);
+        return false;
+    }
+    ZNode *node = znode_new(name, score);
+    zset->bytes += slab_usable(znode_size(name.size()));
+    hm_insert(&zset->hmap, &node->hmap);
+    tree_insert(zset, node);
+    return true;
+}
+
+ZNode *zset_lookup(ZSet *zset, std::string_view name) {
+    if (!zset->root) {
+        return NULL;
+    }
+    return hm_lookup<ZNodeTraits>(&zset->hmap, name);
+}
+
+void zset_delete(ZSet *zset, ZNode *node) {
+    // remove from the hashtable, by identity
+    HNode *found = hm_remove(&zset->hmap, node->hmap.hcode,
+        [&](HNode *cur) { return cur == &node->hmap; });
+    assert(found == &node->hmap);
+    (void)found;
+    // remove from the tree
+    zset->root = avl_del(&node->tree);
+    // deallocate the node
+    zset->bytes -= slab_usable(znode_size(node->len));
+    znode_del(node);
+}
+
+ZNode *zset_at(ZSet *zset, int64_t rank) {
+    if (!zset->root || rank < 0) {
+        return NULL;
+    }
+    AVLNode *node = avl_offset(zset->root, rank - avl_cnt(zset->root->left));
+    return node ? container_of(node, ZNode, tree) : NULL;
+}
+
+int64_t zset_rank(ZNode *node) {
+    return avl_rank(&node->tree);
+}
+
+size_t zset_size(const ZSet *zset) {
+    return avl_cnt(zset->root);
+}
+
+ZNode *znode_offset(ZNode *node, int64_t offset) {
+    AVLNode *tnode = node ? avl_offset(&node->tree, offset) : NULL;
+    return tnode ? container_of(tnode, ZNode, tree) : NULL;
+}
+
+static void tree_dispose(AVLNode *node) {
+    if (!node) {
+        return;
+    }
+    tree_dispose(node->left);
+    tree_dispose(node->right);
+    znode_del(container_of(node, ZNode, tree));
+}
+
+void zset_clear(ZSet *zset) {
+    hm_clear(&zset->hmap);
+    tree_dispose(zset->root);
+    zset->root = NULL;
+    zset->bytes = 0;
+}
+
+// frees leaves, the parent of each freed leaf is where the next one is
+// looked for, so each call only descends once from the root
+size_t zset_dispose(ZSet *zset, size_t n, void (*dealloc)(void *)) {
+    hm_clear_with(&zset->hmap, dealloc);    // a no-op after the first call
+    AVLNode *node = zset->root;
+    size_t nfree = 0;
+    for (; node && nfree < n; nfree++) {
+        while (node->left || node->right) {
+            node = node->left ? node->left : node->right;
+        }
+        AVLNode *parent = node->parent;
+        if (!parent) {
+            zset->root = NULL;
+        } else if (parent->left == node) {
+            parent->left = NULL;
+        } else {
+            parent->right = NULL;
+        }
+        ZNode *znode = container_of(node, ZNode, tree);
+        zset->bytes -= slab_usable(znode_size(znode->len));
+        znode_del(znode);
+        node = parent;
+    }
+    return nfree;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string_view>
+#include "avl.h"
+#include "hashtable.h"
+
+
+// A sorted set, indexed twice: by name with a hashtable, and by
+// (score, name) with an AVL tree that also answers rank queries.
+struct ZSet {
+    AVLNode *root = NULL;   // index by (score, name)
+    HMap hmap;              // index by name
+    size_t bytes = 0;       // allocated to the nodes
+};
+
+// allocated from the slab, the name is stored right after the struct
+struct ZNode {
+    AVLNode tree;
+    HNode hmap;
+    double score = 0;
+    size_t len = 0;
+};
+
+inline std::string_view znode_name(const ZNode *node) {
+    return std::string_view((const char *)(node + 1), node->len);
+}
+
+// returns true if the name is new, otherwise updates its score
+bool    zset_insert(ZSet *zset, std::string_view name, double score);
+ZNode  *zset_lookup(ZSet *zset, std::string_view name);
+void    zset_delete(ZSet *zset, ZNode *node);
+// the node at a rank, from 0, NULL if out of range
+ZNode  *zset_at(ZSet *zset, int64_t rank);
+int64_t zset_rank(ZNode *node);
+size_t  zset_size(const ZSet *zset);
+// the node `offset` positions away in the sorted order
+ZNode  *znode_offset(ZNode *node, int64_t offset);
+// free all nodes, the set is empty after this
+void    zset_clear(ZSet *zset);
+// Free up to `n` nodes, to free a large set in steps, and return the
+// number freed. The name index goes first, its slot arrays are passed to
+// `dealloc()`. Then the set can only be disposed further, until the tree
+// is empty. The caller deletes the `ZSet`.
+size_t  zset_dispose(ZSet *zset, size_t n, void (*dealloc)(void *));